@@ -29,16 +29,39 @@
 
 #include "hid-ids.h"
 #include <asm/unaligned.h>
+#include <linux/completion.h>
+#include <linux/debugfs.h>
 #include <linux/delay.h>
 #include <linux/device.h>
+#include <linux/fixp-arith.h>
 #include <linux/kernel.h>
 #include <linux/hid.h>
+#include <linux/hrtimer.h>
+#include <linux/idr.h>
+#include <linux/iio/buffer.h>
+#include <linux/iio/iio.h>
+#include <linux/iio/kfifo_buf.h>
 #include <linux/input.h>
 #include <linux/jiffies.h>
+#include <linux/jump_label.h>
+#include <linux/kfifo.h>
+#include <linux/kref.h>
+#include <linux/ktime.h>
 #include <linux/leds.h>
+#include <linux/list.h>
+#include <linux/math64.h>
+#include <linux/miscdevice.h>
 #include <linux/module.h>
+#include <linux/poll.h>
 #include <linux/power_supply.h>
+#include <linux/seq_file.h>
+#include <linux/seqlock.h>
+#include <linux/slab.h>
 #include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
+#include <linux/workqueue.h>
 
 /*
  * Reference the url below for the following HID report defines:
@@ -131,6 +154,18 @@
 #define NX_CON_IMU_CAL_USR_MAGIC_ADDR		0x8026
 #define NX_CON_IMU_CAL_USR_DATA_ADDR		0x8028
 
+/* The most SPI flash data the controller will return for a single read */
+#define NX_CON_SPI_READ_MAX_SIZE		0x1D
+
+/*
+ * All of the calibration data above lives in two small contiguous regions of
+ * SPI flash, one for factory and one for user calibration. These are read in
+ * as few subcommands as possible and cached in a per-controller image.
+ */
+#define NX_CON_CAL_FCT_REGION_ADDR		0x6020
+#define NX_CON_CAL_USR_REGION_ADDR		0x8010
+#define NX_CON_CAL_REGION_SIZE			0x30
+
 /* The raw analog joystick values will be mapped in terms of this magnitude */
 #define NX_CON_MAX_STICK_MAG			32767
 #define NX_CON_STICK_FUZZ			250
@@ -142,9 +177,12 @@
 #define NX_CON_DPAD_FLAT			0
 
 /* Under most circumstances IMU reports are pushed every 15ms; use as default */
-#define NX_CON_IMU_DFLT_AVG_DELTA_MS		15
-/* How many samples to sum before calculating average IMU report delta */
-#define NX_CON_IMU_SAMPLES_PER_DELTA_AVG	300
+#define NX_CON_IMU_DFLT_REPORT_NS		(15 * NSEC_PER_MSEC)
+/* Bounds on the estimated period of the report timer byte */
+#define NX_CON_IMU_MIN_TICK_NS			(100 * NSEC_PER_USEC)
+#define NX_CON_IMU_MAX_TICK_NS			(50 * NSEC_PER_MSEC)
+/* Arrivals this far off the estimated clock restart the estimate */
+#define NX_CON_IMU_RESYNC_NS			(100 * NSEC_PER_MSEC)
 /* Controls how many dropped IMU packets at once trigger a warning message */
 #define NX_CON_IMU_DROPPED_PKT_WARNING		3
 
@@ -182,6 +220,49 @@
 #define NX_CON_IMU_GYRO_FUZZ			10
 #define NX_CON_IMU_GYRO_FLAT			0
 
+/*
+ * IMU settings sent with NX_CON_SUBCMD_SET_IMU_SENSITIVITY, in the order of its
+ * data bytes. Enabling the IMU resets them to their defaults.
+ *
+ * The calibration and the resolutions above are for the default ranges. A
+ * narrower range only means more LSBs per G or per dps, so changing the range
+ * changes the resolutions reported to userspace and nothing else.
+ */
+enum nx_con_imu_setting {
+	NX_CON_IMU_SET_GYRO_RANGE,
+	NX_CON_IMU_SET_ACCEL_RANGE,
+	NX_CON_IMU_SET_GYRO_RATE,
+	NX_CON_IMU_SET_ACCEL_BANDWIDTH,
+	NX_CON_IMU_NUM_SETTINGS,
+};
+
+/* The value each setting's byte selects; 0 where there's no such byte */
+static const u16 nx_con_imu_setting_values[NX_CON_IMU_NUM_SETTINGS][4] = {
+	[NX_CON_IMU_SET_GYRO_RANGE]		= { 250, 500, 1000, 2000 }, /* +-dps */
+	[NX_CON_IMU_SET_ACCEL_RANGE]		= { 8, 4, 2, 16 }, /* +-G */
+	[NX_CON_IMU_SET_GYRO_RATE]		= { 833, 208 }, /* Hz */
+	[NX_CON_IMU_SET_ACCEL_BANDWIDTH]	= { 200, 100 }, /* Hz, anti-aliasing filter */
+};
+
+static const u8 nx_con_imu_dflt_settings[NX_CON_IMU_NUM_SETTINGS] = { 3, 0, 1, 1 };
+
+#define NX_CON_IMU_DFLT_GYRO_RANGE		2000
+#define NX_CON_IMU_DFLT_ACCEL_RANGE		8
+
+/* Fractional bits of the per-axis multipliers; see nx_con_calc_imu_mults */
+#define NX_CON_IMU_MULT_SHIFT			20
+
+/* IMU axes in the order of their samples: accel x, y, z, then gyro x, y, z */
+#define NX_CON_IMU_NUM_AXES			6
+
+/*
+ * Size of one evdev unit in the SI units of IIO, in picounits: 1 G over
+ * NX_CON_IMU_ACCEL_RES_PER_G in m/s^2, and 1 degree over
+ * NX_CON_IMU_GYRO_RES_PER_DPS in radians.
+ */
+#define NX_CON_IMU_IIO_ACCEL_UNIT_PICO		2394201660U /* 9.80665e12 / 4096 */
+#define NX_CON_IMU_IIO_GYRO_UNIT_PICO		1225050U /* (pi / 180)e12 / 14247 */
+
 /* frequency/amplitude tables for rumble */
 struct nx_con_rumble_freq_data {
 	u16 high;
@@ -195,6 +276,14 @@ struct nx_con_rumble_amp_data {
 	u16 amp;
 };
 
+/* HD rumble parameters for one side (i.e., one Joy-Con's worth) */
+struct nx_con_rumble_side {
+	u16 amp_low; /* 0 to nx_con_max_rumble_amp */
+	u16 amp_high;
+	u16 freq_low; /* Hz; 0 for the controller's default */
+	u16 freq_high;
+};
+
 #if IS_ENABLED(CONFIG_NINTENDO_FF)
 /*
  * These tables are from
@@ -300,6 +389,8 @@ static const u16 NX_CON_RUMBLE_DFLT_LOW_FREQ 	= 160;
 static const u16 NX_CON_RUMBLE_DFLT_HIGH_FREQ	= 320;
 #endif /* IS_ENABLED(CONFIG_NINTENDO_FF) */
 static const u16 NX_CON_RUMBLE_PERIOD_MS	= 50;
+/* minimum time between output reports */
+static const u32 NX_CON_OUTPUT_PERIOD_US	= 25000;
 
 /* States for controller state machine */
 enum nx_con_state {
@@ -308,6 +399,17 @@ enum nx_con_state {
 	NX_CON_STATE_REMOVED,
 };
 
+/* How rumble frames are queued when they arrive faster than they're sent */
+enum nx_con_rumble_mode {
+	NX_CON_RUMBLE_MODE_LATEST, /* only the newest frame is kept */
+	NX_CON_RUMBLE_MODE_QUEUE, /* every frame is sent, in order */
+};
+
+static const char * const nx_con_rumble_mode_names[] = {
+	[NX_CON_RUMBLE_MODE_LATEST]	= "latest",
+	[NX_CON_RUMBLE_MODE_QUEUE]	= "queue",
+};
+
 /* Controller type received as part of device info */
 enum nx_con_type {
 	NX_CON_TYPE_JCL		= 0x01,
@@ -320,17 +422,64 @@ enum nx_con_type {
 	NX_CON_TYPE_N64		= 0x0C,
 };
 
+/* Controller capabilities, resolved once by nx_con_select_desc() */
+#define NX_CON_CAP_LEFT_STICK	BIT(0)
+#define NX_CON_CAP_RIGHT_STICK	BIT(1)
+#define NX_CON_CAP_DPAD		BIT(2) /* reported as a hat */
+#define NX_CON_CAP_IMU		BIT(3)
+#define NX_CON_CAP_RUMBLE	BIT(4)
+
+/*
+ * Bits of nx_con's imu_users and rumble_users. The IMU and rumble are only
+ * enabled on the controller while they have users; see nx_con_update_features.
+ */
+#define NX_CON_IMU_USER_EVDEV		0 /* imu_idev is open */
+#define NX_CON_IMU_USER_IIO		1 /* the IIO buffer is enabled */
+#define NX_CON_RUMBLE_USER_FF		0 /* an effect was uploaded since idev opened */
+#define NX_CON_RUMBLE_USER_STREAM	1 /* the rumble stream device is open */
+
 struct nx_con_stick_cal {
 	s32 max;
 	s32 min;
 	s32 center;
 };
 
+/* What an axis is mapped with; derived by nx_con_calc_stick_map() */
+struct nx_con_stick_map {
+	s32 center;
+	u64 mult_pos;
+	u64 mult_neg;
+};
+
 struct nx_con_imu_cal {
 	s16 offset[3];
 	s16 scale[3];
 };
 
+/*
+ * Everything reports are decoded with, derived from the calibration as a
+ * whole by nx_con_cal_changed() and read under nx_con's cal_seq.
+ */
+struct nx_con_cal_set {
+	struct nx_con_stick_map left_stick[2]; /* x, y */
+	struct nx_con_stick_map right_stick[2];
+	s64 imu_mult[NX_CON_IMU_NUM_AXES];
+	s32 imu_offset[NX_CON_IMU_NUM_AXES];
+};
+
+/* A region of SPI flash, of which the range [start, end) has been read */
+struct nx_con_cal_region {
+	u32 base;
+	u32 start;
+	u32 end;
+	u8 data[NX_CON_CAL_REGION_SIZE];
+};
+
+struct nx_con_cal_image {
+	struct nx_con_cal_region factory;
+	struct nx_con_cal_region user;
+};
+
 static const u32 NX_CON_BTN_Y		= BIT(0);
 static const u32 NX_CON_BTN_X		= BIT(1);
 static const u32 NX_CON_BTN_B		= BIT(2);
@@ -354,6 +503,11 @@ static const u32 NX_CON_BTN_SL_L	= BIT(21);
 static const u32 NX_CON_BTN_L		= BIT(22);
 static const u32 NX_CON_BTN_ZL		= BIT(23);
 
+#define NX_CON_NUM_BUTTON_BITS	24
+
+/* down, up, right and left */
+static const u32 NX_CON_BTN_DPAD	= GENMASK(19, 16);
+
 struct nx_con_button_mapping {
 	u32 code;
 	u32 bit;
@@ -485,6 +639,62 @@ static const struct nx_con_button_mapping n64con_button_mappings[] = {
 	{ /* sentinel */ },
 };
 
+/*
+ * In the simple HID report mode (NX_CON_INPUT_BUTTON_EVENT), reports are only
+ * sent when an input changes, and buttons are laid out differently. These map
+ * each bit of a simple report's 16-bit button field to the NX_CON_BTN_* bit of
+ * the same button, so both modes are decoded alike.
+ */
+#define NX_CON_NUM_SIMPLE_BUTTON_BITS	16
+
+/* The Pro Controller, and presumably the NSO pads; the d-pad is the hat */
+static const u32 nx_con_simple_procon_buttons[NX_CON_NUM_SIMPLE_BUTTON_BITS] = {
+	NX_CON_BTN_B, NX_CON_BTN_A, NX_CON_BTN_Y, NX_CON_BTN_X,
+	NX_CON_BTN_L, NX_CON_BTN_R, NX_CON_BTN_ZL, NX_CON_BTN_ZR,
+	NX_CON_BTN_MINUS, NX_CON_BTN_PLUS, NX_CON_BTN_LSTICK, NX_CON_BTN_RSTICK,
+	NX_CON_BTN_HOME, NX_CON_BTN_CAP,
+};
+
+/* The Joy-Cons use the hat for their stick instead */
+static const u32 nx_con_simple_left_joycon_buttons[NX_CON_NUM_SIMPLE_BUTTON_BITS] = {
+	NX_CON_BTN_DOWN, NX_CON_BTN_RIGHT, NX_CON_BTN_LEFT, NX_CON_BTN_UP,
+	NX_CON_BTN_SL_L, NX_CON_BTN_SR_L, 0, 0,
+	NX_CON_BTN_MINUS, 0, NX_CON_BTN_LSTICK, 0,
+	0, NX_CON_BTN_CAP, NX_CON_BTN_L, NX_CON_BTN_ZL,
+};
+
+static const u32 nx_con_simple_right_joycon_buttons[NX_CON_NUM_SIMPLE_BUTTON_BITS] = {
+	NX_CON_BTN_A, NX_CON_BTN_X, NX_CON_BTN_B, NX_CON_BTN_Y,
+	NX_CON_BTN_SL_R, NX_CON_BTN_SR_R, 0, 0,
+	0, NX_CON_BTN_PLUS, 0, NX_CON_BTN_RSTICK,
+	NX_CON_BTN_HOME, 0, NX_CON_BTN_R, NX_CON_BTN_ZR,
+};
+
+/* The d-pad directions for each position of a simple report's hat; 8 is centered */
+static const u32 nx_con_simple_hat_dpad[8] = {
+	NX_CON_BTN_UP,
+	NX_CON_BTN_UP | NX_CON_BTN_RIGHT,
+	NX_CON_BTN_RIGHT,
+	NX_CON_BTN_DOWN | NX_CON_BTN_RIGHT,
+	NX_CON_BTN_DOWN,
+	NX_CON_BTN_DOWN | NX_CON_BTN_LEFT,
+	NX_CON_BTN_LEFT,
+	NX_CON_BTN_UP | NX_CON_BTN_LEFT,
+};
+
+/* Choices for the report_mode attribute */
+enum nx_con_report_mode_pref {
+	NX_CON_REPORT_MODE_AUTO,	/* see nx_con_choose_report_mode */
+	NX_CON_REPORT_MODE_FULL,
+	NX_CON_REPORT_MODE_SIMPLE,
+};
+
+static const char * const nx_con_report_mode_names[] = {
+	[NX_CON_REPORT_MODE_AUTO]	= "auto",
+	[NX_CON_REPORT_MODE_FULL]	= "full",
+	[NX_CON_REPORT_MODE_SIMPLE]	= "simple",
+};
+
 enum nx_con_msg_type {
 	NX_CON_MSG_TYPE_NONE,
 	NX_CON_MSG_TYPE_USB,
@@ -537,9 +747,51 @@ struct nx_con_input_report {
 } __packed;
 
 #define NX_CON_MAX_RESP_SIZE		(sizeof(struct nx_con_input_report) + 35)
+
+/* The bytes of a report that carry battery, button and stick state */
+#define NX_CON_REPORT_STATE_OFFSET	offsetof(struct nx_con_input_report, bat_con)
+#define NX_CON_REPORT_STATE_SIZE	(offsetof(struct nx_con_input_report, vibrator_report) - \
+					 NX_CON_REPORT_STATE_OFFSET)
+#define NX_CON_SUBCMD_MAX_DATA_SIZE	38
 #define NX_CON_RUMBLE_DATA_SIZE		8
 #define NX_CON_RUMBLE_QUEUE_SIZE	8
 
+struct nx_con;
+
+/*
+ * Subcommands are sent in order of priority, and in submission order within
+ * the same priority. Rumble data outranks all of these (see
+ * nx_con_output_worker).
+ */
+enum nx_con_subcmd_prio {
+	NX_CON_SUBCMD_PRIO_CONFIG,	/* affects input, e.g., the report mode */
+	NX_CON_SUBCMD_PRIO_LED,
+	NX_CON_SUBCMD_PRIO_HOUSEKEEPING,	/* e.g., SPI flash reads */
+	NX_CON_SUBCMD_NUM_PRIOS,
+};
+
+/*
+ * A subcommand waiting in a controller's queue. Each one carries its own copy
+ * of the request and a buffer for its reply, so any number of them may be
+ * queued at once; nx_con_output_worker sends them one at a time.
+ *
+ * Once the request has been answered (or has failed), @ret and @reply are
+ * filled in and @complete is called from the worker. Requests without a
+ * @complete callback signal @done instead.
+ */
+struct nx_con_subcmd {
+	struct list_head node;
+	u8 buf[sizeof(struct nx_con_subcmd_request) + NX_CON_SUBCMD_MAX_DATA_SIZE];
+	size_t data_len;
+	u32 timeout;
+	bool coalesce; /* may be overwritten by a newer request with the same id */
+	u8 packet_num; /* as sent; the controller doesn't echo it in the reply */
+	int ret;
+	u8 reply[NX_CON_MAX_RESP_SIZE];
+	void (*complete)(struct nx_con *con, struct nx_con_subcmd *cmd);
+	struct completion done;
+};
+
 static const unsigned short NX_CON_RUMBLE_ZERO_AMP_PKT_CNT = 5;
 
 /* for compat with kernels before 5.16 */
@@ -560,31 +812,139 @@ static const char * nx_con_player_led_names[] = {
 
 #define NX_CON_NUM_LEDS ARRAY_SIZE(nx_con_player_led_names)
 
+/* The inputs to the newest rumble frame, so it's only encoded once */
+struct nx_con_rumble_memo {
+	bool valid;
+	struct nx_con_rumble_side left;
+	struct nx_con_rumble_side right;
+	u8 data[NX_CON_RUMBLE_DATA_SIZE];
+};
+
+#define NX_CON_FF_MAX_EFFECTS	16
+
+struct nx_con_ff_effect {
+	struct ff_effect effect;
+	bool playing;
+	int repeat; /* replays left, including the current one */
+	ktime_t start; /* of the current replay, after its delay */
+};
+
+/* Must be a power of 2 */
+#define NX_CON_STREAM_FIFO_SIZE	64
+
+/* What userspace writes to the rumble stream device, one or more at a time */
+struct nx_con_rumble_stream_frame {
+	u64 timestamp_ns; /* CLOCK_MONOTONIC time at which to send the frame */
+	u8 data[NX_CON_RUMBLE_DATA_SIZE]; /* as sent in the rumble output report */
+};
+
+/* What a read() of the rumble stream device returns */
+struct nx_con_rumble_stream_stats {
+	u64 sent; /* frames handed to the output worker */
+	u64 late; /* frames sent more than NX_CON_OUTPUT_PERIOD_US past due */
+	u64 dropped; /* frames superseded by a newer frame that was also due */
+	u64 underruns; /* times the queue ran dry after sending a frame */
+	u64 queued; /* frames still waiting to be sent */
+};
+
+/*
+ * The rumble stream device outlives its controller for as long as it's held
+ * open, so it's refcounted separately.
+ */
+struct nx_con_rumble_stream {
+	struct miscdevice misc;
+	char name[32];
+	struct kref kref;
+	unsigned long open; /* bit 0 is set while the device is open */
+	struct mutex mutex; /* serializes users of con against its removal */
+	struct nx_con *con; /* NULL once the controller is removed */
+	spinlock_t lock; /* protects fifo, stats and con->stream_timer_armed */
+	DECLARE_KFIFO(fifo, struct nx_con_rumble_stream_frame, NX_CON_STREAM_FIFO_SIZE);
+	struct nx_con_rumble_stream_stats stats;
+	wait_queue_head_t wait; /* for room in fifo */
+	bool gone;
+};
+
+/* Estimates when IMU samples were taken; see nx_con_imu_clock_update */
+struct nx_con_imu_clock {
+	bool synced;
+	u8 last_timer; /* the timer byte of the last report */
+	s64 last_arrival_ns;
+	s64 tick_ns_q16; /* period of the timer byte; 0 until measured */
+	u32 report_ticks_q8; /* ticks between reports, when none are lost */
+	s64 phase_ns; /* when the last report was sent, by the estimate */
+	u32 updates; /* since the estimate (re)started; sets the loop gain */
+	s64 base_ns; /* when the first report's samples started */
+	unsigned long dropped; /* reports lost so far */
+};
+
+struct nx_con_desc;
+
 /* Each physical controller is associated with a nx_con struct */
 struct nx_con {
 	struct hid_device *hdev;
 	struct input_dev *idev;
 	struct led_classdev leds[NX_CON_NUM_LEDS]; /* player leds */
 	struct led_classdev home_led;
+	int player_id; /* zero-based; player LEDs show (player_id % 4) + 1 */
 	enum nx_con_state state;
 	spinlock_t lock;
 	u8 mac_addr[6];
 	char *mac_addr_str;
 	enum nx_con_type type;
+	const struct nx_con_desc *desc; /* chosen by type */
+	u32 caps; /* NX_CON_CAP_* */
+
+	/* output arbitration between rumble and subcommands */
+	struct list_head subcmd_queue[NX_CON_SUBCMD_NUM_PRIOS];
+	struct nx_con_subcmd *subcmd_inflight; /* sent, awaiting its reply */
+	unsigned long subcmd_deadline; /* in jiffies */
+	int subcmd_retries;
+	struct work_struct output_worker;
 
 	/* The following members are used for synchronous sends/receives */
 	enum nx_con_msg_type msg_type;
 	u8 subcmd_num;
 	struct mutex output_mutex;
 	u8 input_buf[NX_CON_MAX_RESP_SIZE];
+	u8 *resp_buf; /* receives the reply to the message in flight */
 	wait_queue_head_t wait;
 	bool received_resp;
 	u8 usb_ack_match;
 	u8 subcmd_ack_match;
-	bool received_input_report;
-	unsigned int last_subcmd_sent_msecs;
-
-	/* factory calibration data */
+	/* see nx_con_wait_for_input_report */
+	bool input_report_wanted;
+	struct completion input_report;
+	ktime_t last_output_time;
+	ktime_t last_report_time;
+	ktime_t event_time; /* when the report being handled arrived */
+	u8 report_mode; /* the id of the reports the controller was asked for */
+	enum nx_con_report_mode_pref report_mode_pref;
+	u32 report_interval_us; /* moving average; 0 until measured */
+
+	/* state bytes of the last report that was decoded in full */
+	u8 last_report_state[NX_CON_REPORT_STATE_SIZE];
+	bool last_report_valid;
+	unsigned int last_report_cal_gen;
+	unsigned long reports_unchanged; /* reports that weren't decoded again */
+
+	/* raw calibration data read from SPI flash */
+	struct nx_con_cal_image cal_image;
+	bool calibrated; /* false while using default calibration */
+	unsigned int cal_gen; /* bumped by nx_con_cal_changed() */
+	struct work_struct setup_worker;
+
+	/* see nx_con_update_idle */
+	bool idle; /* in the simple report mode for lack of input */
+	bool idle_wanted;
+	ktime_t last_activity;
+	u16 idle_stick_ref[4]; /* raw stick values as of the last activity */
+	u16 simple_stick_ref[4]; /* the same, from simple reports */
+	bool simple_stick_valid;
+	u8 simple_hat;
+	struct work_struct idle_worker;
+
+	/* factory calibration data; reports are decoded with cal, below */
 	struct nx_con_stick_cal left_stick_cal_x;
 	struct nx_con_stick_cal left_stick_cal_y;
 	struct nx_con_stick_cal right_stick_cal_x;
@@ -593,39 +953,67 @@ struct nx_con {
 	struct nx_con_imu_cal accel_cal;
 	struct nx_con_imu_cal gyro_cal;
 
-	/* prevents needlessly recalculating these divisors every sample */
-	s32 imu_cal_accel_divisor[3];
-	s32 imu_cal_gyro_divisor[3];
+	/* published by nx_con_cal_changed; writes are under con->lock */
+	struct nx_con_cal_set cal;
+	seqcount_spinlock_t cal_seq;
 
 	/* power supply data */
 	struct power_supply *battery;
 	struct power_supply_desc battery_desc;
-	u8 battery_capacity;
-	bool battery_charging;
-	bool host_powered;
+	u8 bat_con; /* the newest report's battery/connection byte */
 
 	/* rumble */
 	u8 rumble_data[NX_CON_RUMBLE_QUEUE_SIZE][NX_CON_RUMBLE_DATA_SIZE];
 	int rumble_queue_head;
 	int rumble_queue_tail;
-	struct workqueue_struct *rumble_queue;
-	struct work_struct rumble_worker;
-	unsigned int rumble_msecs;
+	bool rumble_tail_unsent; /* rumble_queue_tail hasn't gone out yet */
+	bool rumble_pending; /* rumble_queue_tail is due to be sent */
+	enum nx_con_rumble_mode rumble_mode;
+	struct nx_con_rumble_memo rumble_memo; /* the newest frame, encoded */
+
+	/* force feedback effects, rendered by ff_timer */
+	struct nx_con_ff_effect ff_effects[NX_CON_FF_MAX_EFFECTS];
+	u16 ff_gain;
+	struct hrtimer ff_timer;
+	bool ff_timer_armed;
+	unsigned long rumble_coalesced; /* frames dropped in latest mode */
+	struct hrtimer rumble_timer; /* periodically resends rumble */
+	bool rumble_timer_armed;
+	ktime_t rumble_last_sent;
 	u16 rumble_ll_freq;
 	u16 rumble_lh_freq;
 	u16 rumble_rl_freq;
 	u16 rumble_rh_freq;
 	unsigned short rumble_zero_countdown;
 
+	/* raw rumble frames streamed from userspace, sent by stream_timer */
+	struct nx_con_rumble_stream *stream;
+	struct hrtimer stream_timer;
+	bool stream_timer_armed;
+	bool rumble_streaming; /* force feedback is muted meanwhile */
+
+	/* buttons */
+	u16 button_codes[NX_CON_NUM_BUTTON_BITS]; /* 0 for unmapped bits */
+	u32 button_status; /* as of the last report */
+
 	/* imu */
 	struct input_dev *imu_idev;
-	bool imu_first_packet_received; /* helps in initiating timestamp */
-	unsigned int imu_timestamp_us; /* timestamp we report to userspace */
-	unsigned int imu_last_pkt_ms; /* used to calc imu report delta */
-	/* the following are used to track the average imu report time delta */
-	unsigned int imu_delta_samples_count;
-	unsigned int imu_delta_samples_sum;
-	unsigned int imu_avg_delta_ms;
+	struct iio_dev *imu_iio;
+	s16 imu_raw[NX_CON_IMU_NUM_AXES]; /* the newest sample, for IIO reads */
+	struct nx_con_imu_clock imu_clock;
+	s64 imu_timestamp_ns; /* of the last sample, since the first report */
+	unsigned long imu_trace; /* bit 0 is set while tracing raw samples */
+	u8 imu_settings[NX_CON_IMU_NUM_SETTINGS]; /* see nx_con_imu_setting */
+
+	/* see nx_con_update_features */
+	struct mutex features_mutex;
+	bool features_ready; /* the controller has been set up */
+	bool imu_on; /* as last requested of the controller */
+	bool rumble_on;
+	unsigned long imu_users;
+	unsigned long rumble_users;
+
+	struct dentry *debugfs_dir;
 };
 
 /*
@@ -763,31 +1151,36 @@ static inline bool nx_con_type_is_any_nescon(struct nx_con *con)
 /*
  * Controller capability helpers
  *
- * These helpers combine the use of the helpers above to detect certain
- * capabilities during initialization. They are always accurate but (since they
- * use type helpers) cannot be used early in the HID probe.
+ * These look at the capabilities of the controller's type, which
+ * nx_con_select_desc() resolves once the type is known. They are always
+ * accurate but cannot be used any earlier in the HID probe.
  */
 static inline bool nx_con_has_imu(struct nx_con *con)
 {
-	return nx_con_device_is_chrggrip(con) ||
-	       nx_con_type_is_any_joycon(con) ||
-	       nx_con_type_is_procon(con);
+	return con->caps & NX_CON_CAP_IMU;
 }
 
 static inline bool nx_con_has_joysticks(struct nx_con *con)
 {
-	return nx_con_device_is_chrggrip(con) ||
-	       nx_con_type_is_any_joycon(con) ||
-	       nx_con_type_is_procon(con) ||
-	       nx_con_type_is_n64con(con);
+	return con->caps & (NX_CON_CAP_LEFT_STICK | NX_CON_CAP_RIGHT_STICK);
 }
 
 static inline bool nx_con_has_rumble(struct nx_con *con)
 {
-	return nx_con_device_is_chrggrip(con) ||
-	       nx_con_type_is_any_joycon(con) ||
-	       nx_con_type_is_procon(con) ||
-	       nx_con_type_is_n64con(con);
+	return con->caps & NX_CON_CAP_RUMBLE;
+}
+
+static inline bool nx_con_using_usb(struct nx_con *con)
+{
+	return con->hdev->bus == BUS_USB;
+}
+
+/* Whether the controller has anything which only full reports carry */
+static inline bool nx_con_is_digital_only(struct nx_con *con)
+{
+	return !(con->caps & (NX_CON_CAP_LEFT_STICK |
+			      NX_CON_CAP_RIGHT_STICK |
+			      NX_CON_CAP_IMU));
 }
 
 static int __nx_con_hid_send(struct hid_device *hdev, u8 *data, size_t len)
@@ -805,6 +1198,21 @@ static int __nx_con_hid_send(struct hid_device *hdev, u8 *data, size_t len)
 	return ret;
 }
 
+/*
+ * How long to wait for the next input report. Once the report interval is
+ * known, this allows for a couple of dropped reports, so that a stalled link
+ * doesn't hold up output for long.
+ */
+static unsigned long nx_con_report_timeout(struct nx_con *con)
+{
+	u32 interval_us = READ_ONCE(con->report_interval_us);
+
+	if (!interval_us)
+		return HZ / 4;
+
+	return clamp(usecs_to_jiffies(3 * interval_us), 1UL, (unsigned long)HZ / 4);
+}
+
 static void nx_con_wait_for_input_report(struct nx_con *con)
 {
 	/*
@@ -813,15 +1221,19 @@ static void nx_con_wait_for_input_report(struct nx_con *con)
 	 * reliability considerably.
 	 */
 	if (con->state == NX_CON_STATE_READ) {
-		unsigned long flags;
-
-		spin_lock_irqsave(&con->lock, flags);
-		con->received_input_report = false;
-		spin_unlock_irqrestore(&con->lock, flags);
+		/*
+		 * Reports only complete input_report while this is set, so
+		 * that they don't touch its lock the rest of the time. A
+		 * completion left over from a previous wait is reset first.
+		 */
+		reinit_completion(&con->input_report);
+		smp_store_release(&con->input_report_wanted, true);
 
 		/* We will still proceed, even with a timeout here */
-		if (!wait_event_timeout(con->wait, con->received_input_report, HZ / 4))
-			hid_warn(con->hdev, "timeout waiting for input report\n");
+		if (!wait_for_completion_timeout(&con->input_report,
+						 nx_con_report_timeout(con)))
+			hid_dbg(con->hdev, "timeout waiting for input report\n");
+		WRITE_ONCE(con->input_report_wanted, false);
 	}
 }
 
@@ -831,17 +1243,21 @@ static void nx_con_wait_for_input_report(struct nx_con *con)
  */
 static void nx_con_enforce_subcmd_rate(struct nx_con *con)
 {
-	static const unsigned int max_subcmd_rate_ms = 25;
-	unsigned int current_ms = jiffies_to_msecs(jiffies);
-	unsigned int delta_ms = current_ms - con->last_subcmd_sent_msecs;
+	s64 delta_us;
 
-	while (delta_ms < max_subcmd_rate_ms &&
+	while ((delta_us = ktime_us_delta(ktime_get(), con->last_output_time)) <
+	       NX_CON_OUTPUT_PERIOD_US &&
 	       con->state == NX_CON_STATE_READ) {
+		/* in the simple mode, there may not be another report for ages */
+		if (READ_ONCE(con->report_mode) == NX_CON_INPUT_BUTTON_EVENT) {
+			usleep_range(NX_CON_OUTPUT_PERIOD_US - delta_us,
+				     NX_CON_OUTPUT_PERIOD_US - delta_us + 1000);
+			break;
+		}
 		nx_con_wait_for_input_report(con);
-		current_ms = jiffies_to_msecs(jiffies);
-		delta_ms = current_ms - con->last_subcmd_sent_msecs;
 	}
-	con->last_subcmd_sent_msecs = current_ms;
+
+	con->last_output_time = ktime_get();
 }
 
 static int nx_con_hid_send_sync(struct nx_con *con, u8 *data, size_t len, u32 timeout)
@@ -857,7 +1273,7 @@ static int nx_con_hid_send_sync(struct nx_con *con, u8 *data, size_t len, u32 ti
 		nx_con_enforce_subcmd_rate(con);
 
 		if ((ret = __nx_con_hid_send(con->hdev, data, len)) < 0) {
-			memset(con->input_buf, 0, NX_CON_MAX_RESP_SIZE);
+			memset(con->resp_buf, 0, NX_CON_MAX_RESP_SIZE);
 			return ret;
 		}
 
@@ -866,7 +1282,7 @@ static int nx_con_hid_send_sync(struct nx_con *con, u8 *data, size_t len, u32 ti
 			if (tries) {
 				hid_dbg(con->hdev, "retrying sync send after timeout\n");
 			}
-			memset(con->input_buf, 0, NX_CON_MAX_RESP_SIZE);
+			memset(con->resp_buf, 0, NX_CON_MAX_RESP_SIZE);
 			ret = -ETIMEDOUT;
 		} else {
 			ret = 0;
@@ -882,23 +1298,53 @@ static int nx_con_send_usb(struct nx_con *con, u8 cmd, u32 timeout)
 {
 	int ret;
 	u8 buf[64] = {NX_CON_OUTPUT_USB_CMD};
+	unsigned long flags;
 
 	buf[1] = cmd;
 	con->usb_ack_match = cmd;
-	con->msg_type = NX_CON_MSG_TYPE_USB;
-	if ((ret = nx_con_hid_send_sync(con, buf, sizeof(buf), timeout)))
+	con->resp_buf = con->input_buf;
+	WRITE_ONCE(con->msg_type, NX_CON_MSG_TYPE_USB);
+	if ((ret = nx_con_hid_send_sync(con, buf, sizeof(buf), timeout))) {
 		hid_dbg(con->hdev, "send usb command failed; ret=%d\n", ret);
+
+		/* otherwise every report would go on checking for the reply */
+		spin_lock_irqsave(&con->lock, flags);
+		WRITE_ONCE(con->msg_type, NX_CON_MSG_TYPE_NONE);
+		spin_unlock_irqrestore(&con->lock, flags);
+	}
 	return ret;
 }
 
-static int nx_con_send_subcmd(struct nx_con *con,
-			      struct nx_con_subcmd_request *subcmd,
-			      size_t data_len,
-			      u32 timeout)
+/* shared by all controllers; created at module init */
+static struct workqueue_struct *nx_con_output_wq;
+
+static enum nx_con_subcmd_prio nx_con_subcmd_prio(u8 subcmd_id)
+{
+	switch (subcmd_id) {
+	case NX_CON_SUBCMD_SET_PLAYER_LIGHTS:
+	case NX_CON_SUBCMD_SET_HOME_LIGHT:
+		return NX_CON_SUBCMD_PRIO_LED;
+	case NX_CON_SUBCMD_SPI_FLASH_READ:
+	case NX_CON_SUBCMD_GET_REGULATED_VOLTAGE:
+		return NX_CON_SUBCMD_PRIO_HOUSEKEEPING;
+	default:
+		return NX_CON_SUBCMD_PRIO_CONFIG;
+	}
+}
+
+/*
+ * Sends the subcommand in flight without waiting for its reply; the output
+ * worker picks that up. Called with output_mutex held.
+ */
+static int nx_con_send_subcmd_packet(struct nx_con *con)
 {
+	struct nx_con_subcmd *cmd = con->subcmd_inflight;
+	struct nx_con_subcmd_request *subcmd;
 	int ret;
 	unsigned long flags;
 
+	subcmd = (struct nx_con_subcmd_request *)cmd->buf;
+
 	spin_lock_irqsave(&con->lock, flags);
 	/*
 	 * If the controller has been removed, just return ENODEV so the LED
@@ -908,158 +1354,607 @@ static int nx_con_send_subcmd(struct nx_con *con,
 		spin_unlock_irqrestore(&con->lock, flags);
 		return -ENODEV;
 	}
-	memcpy(subcmd->rumble_data, con->rumble_data[con->rumble_queue_tail],
+
+	/* every subcommand packet also carries the newest rumble frame */
+	memcpy(subcmd->rumble_data, con->rumble_data[con->rumble_queue_head],
 	       NX_CON_RUMBLE_DATA_SIZE);
+	if (con->rumble_queue_tail == con->rumble_queue_head)
+		con->rumble_tail_unsent = false;
+	con->rumble_last_sent = ktime_get();
+
+	/*
+	 * Replies carry the subcommand id but not the packet number, so they
+	 * can only be matched by id. That's unambiguous because only this one
+	 * request is in flight until it's answered or times out.
+	 */
+	con->subcmd_ack_match = subcmd->subcmd_id;
+	con->resp_buf = cmd->reply;
+	con->received_resp = false;
+	WRITE_ONCE(con->msg_type, NX_CON_MSG_TYPE_SUBCMD);
 	spin_unlock_irqrestore(&con->lock, flags);
 
 	subcmd->output_id = NX_CON_OUTPUT_RUMBLE_AND_SUBCMD;
 	subcmd->packet_num = con->subcmd_num;
+	cmd->packet_num = con->subcmd_num;
 	if (++con->subcmd_num > 0xF)
 		con->subcmd_num = 0;
-	con->subcmd_ack_match = subcmd->subcmd_id;
-	con->msg_type = NX_CON_MSG_TYPE_SUBCMD;
 
-	if ((ret = nx_con_hid_send_sync(con,
-					(u8 *)subcmd,
-					sizeof(*subcmd) + data_len,
-					timeout)) < 0)
-		hid_dbg(con->hdev, "send subcommand failed; ret=%d\n", ret);
+	nx_con_enforce_subcmd_rate(con);
+
+	if ((ret = __nx_con_hid_send(con->hdev,
+				     cmd->buf,
+				     sizeof(*subcmd) + cmd->data_len)) < 0) {
+		hid_dbg(con->hdev,
+			"send subcommand 0x%02X (packet %u) failed; ret=%d\n",
+			subcmd->subcmd_id, cmd->packet_num, ret);
+		return ret;
+	}
+
+	con->subcmd_deadline = jiffies + cmd->timeout;
+	return 0;
+}
+
+static void nx_con_complete_subcmd(struct nx_con *con,
+				   struct nx_con_subcmd *cmd,
+				   int ret)
+{
+	cmd->ret = ret;
+	if (cmd->complete)
+		cmd->complete(con, cmd);
 	else
-		ret = 0;
-	return ret;
+		complete(&cmd->done);
 }
 
-/* Supply nibbles for flash and on. Ones correspond to active */
-static int nx_con_set_player_leds(struct nx_con *con, u8 flash, u8 on)
+/* Retires the subcommand in flight. Called with output_mutex held. */
+static void nx_con_finish_subcmd(struct nx_con *con, int ret)
 {
-	struct nx_con_subcmd_request *req;
-	u8 buffer[sizeof(*req) + 1] = { 0 };
+	struct nx_con_subcmd *cmd = con->subcmd_inflight;
+	unsigned long flags;
 
-	req = (struct nx_con_subcmd_request *)buffer;
-	req->subcmd_id = NX_CON_SUBCMD_SET_PLAYER_LIGHTS;
-	req->data[0] = (flash << 4) | on;
+	/* stop nx_con_handle_event from writing to the reply buffer */
+	spin_lock_irqsave(&con->lock, flags);
+	WRITE_ONCE(con->msg_type, NX_CON_MSG_TYPE_NONE);
+	con->resp_buf = con->input_buf;
+	con->received_resp = false;
+	con->subcmd_inflight = NULL;
+	spin_unlock_irqrestore(&con->lock, flags);
 
-	hid_dbg(con->hdev, "setting player leds\n");
-	return nx_con_send_subcmd(con, req, 1, HZ/4);
+	if (ret)
+		memset(cmd->reply, 0, NX_CON_MAX_RESP_SIZE);
+	nx_con_complete_subcmd(con, cmd, ret);
 }
 
-static int nx_con_request_spi_flash_read(struct nx_con *con,
-					 u32 start_addr,
-					 u8 size,
-					 u8 **reply)
+/*
+ * Checks on the subcommand in flight, retiring it once it has been answered
+ * or has timed out. Returns true if anything changed.
+ */
+static bool nx_con_poll_subcmd(struct nx_con *con)
 {
-	struct nx_con_subcmd_request *req;
-	struct nx_con_input_report *report;
-	u8 buffer[sizeof(*req) + 5] = { 0 };
-	u8 *data;
 	int ret;
 
-	if (!reply)
-		return -EINVAL;
+	if (!con->subcmd_inflight)
+		return false;
 
-	req = (struct nx_con_subcmd_request *)buffer;
-	req->subcmd_id = NX_CON_SUBCMD_SPI_FLASH_READ;
-	data = req->data;
-	put_unaligned_le32(start_addr, data);
-	data[4] = size;
+	if (con->received_resp) {
+		nx_con_finish_subcmd(con, 0);
+		return true;
+	}
 
-	hid_dbg(con->hdev, "requesting SPI flash data\n");
-	if ((ret = nx_con_send_subcmd(con, req, 5, HZ))) {
-		hid_err(con->hdev, "failed reading SPI flash; ret=%d\n", ret);
+	if (time_before(jiffies, con->subcmd_deadline))
+		return false;
+
+	hid_dbg(con->hdev, "subcommand timed out\n");
+
+	/*
+	 * The controller occasionally seems to drop subcommands. In testing,
+	 * doing one retry after a timeout appears to always work.
+	 */
+	if (con->subcmd_retries-- > 0) {
+		hid_dbg(con->hdev, "retrying subcommand after timeout\n");
+		if ((ret = nx_con_send_subcmd_packet(con)) < 0)
+			nx_con_finish_subcmd(con, ret);
 	} else {
-		report = (struct nx_con_input_report *)con->input_buf;
-		/* The read data starts at the 6th byte */
-		*reply = &report->subcmd_reply.data[5];
+		nx_con_finish_subcmd(con, -ETIMEDOUT);
 	}
-	return ret;
+	return true;
 }
 
 /*
- * User calibration's presence is denoted with a magic byte preceding it.
- * returns 0 if magic val is present, 1 if not present, < 0 on error
+ * Takes the highest priority subcommand off the queue, if any, and puts it in
+ * flight. That happens under con->lock, so that nx_con_send_subcmd can always
+ * tell where its subcommand is. Called from the output worker, or once it can
+ * no longer run.
  */
-static int nx_con_check_for_cal_magic(struct nx_con *con, u32 flash_addr)
+static struct nx_con_subcmd *nx_con_dequeue_subcmd(struct nx_con *con)
 {
-	int ret;
-	u8 *reply;
+	struct nx_con_subcmd *cmd = NULL;
+	unsigned long flags;
+	int prio;
 
-	if ((ret = nx_con_request_spi_flash_read(con,
-						 flash_addr,
-						 NX_CON_CAL_USR_MAGIC_SIZE,
-						 &reply)))
-		return ret;
+	spin_lock_irqsave(&con->lock, flags);
+	for (prio = 0; prio < NX_CON_SUBCMD_NUM_PRIOS && !cmd; prio++) {
+		cmd = list_first_entry_or_null(&con->subcmd_queue[prio],
+					       struct nx_con_subcmd,
+					       node);
+		if (cmd) {
+			list_del_init(&cmd->node);
+			con->subcmd_inflight = cmd;
+		}
+	}
+	spin_unlock_irqrestore(&con->lock, flags);
 
-	return reply[0] != NX_CON_CAL_USR_MAGIC_0 ||
-	       reply[1] != NX_CON_CAL_USR_MAGIC_1;
+	return cmd;
 }
 
-static int nx_con_read_stick_calibration(struct nx_con *con,
-					 u16 cal_addr,
-					 struct nx_con_stick_cal *cal_x,
-					 struct nx_con_stick_cal *cal_y,
-					 bool left_stick)
+/*
+ * Fails the subcommand in flight and every one still in the queue. Only used
+ * on removal, once the output worker can no longer run.
+ */
+static void nx_con_flush_subcmds(struct nx_con *con, int ret)
 {
-	s32 x_max_above;
-	s32 x_min_below;
-	s32 y_max_above;
-	s32 y_min_below;
-	u8 *raw;
-	int ret;
+	if (con->subcmd_inflight)
+		nx_con_finish_subcmd(con, ret);
 
-	if ((ret = nx_con_request_spi_flash_read(con,
-						 cal_addr,
-						 NX_CON_CAL_STICK_DATA_SIZE,
-						 &raw)))
-		return ret;
+	while (nx_con_dequeue_subcmd(con))
+		nx_con_finish_subcmd(con, ret);
+}
 
-	/* stick calibration parsing: note the order differs based on stick */
-	if (left_stick) {
-		x_max_above = hid_field_extract(con->hdev, (raw + 0), 0, 12);
-		y_max_above = hid_field_extract(con->hdev, (raw + 1), 4, 12);
-		cal_x->center = hid_field_extract(con->hdev, (raw + 3), 0, 12);
-		cal_y->center = hid_field_extract(con->hdev, (raw + 4), 4, 12);
-		x_min_below = hid_field_extract(con->hdev, (raw + 6), 0, 12);
-		y_min_below = hid_field_extract(con->hdev, (raw + 7), 4, 12);
-	} else {
-		cal_x->center = hid_field_extract(con->hdev, (raw + 0), 0, 12);
-		cal_y->center = hid_field_extract(con->hdev, (raw + 1), 4, 12);
-		x_min_below = hid_field_extract(con->hdev, (raw + 3), 0, 12);
-		y_min_below = hid_field_extract(con->hdev, (raw + 4), 4, 12);
-		x_max_above = hid_field_extract(con->hdev, (raw + 6), 0, 12);
-		y_max_above = hid_field_extract(con->hdev, (raw + 7), 4, 12);
-	}
+/* May be called from atomic context */
+static int nx_con_submit_subcmd(struct nx_con *con, struct nx_con_subcmd *cmd)
+{
+	struct nx_con_subcmd_request *req;
+	unsigned long flags;
 
-	/* check if calibration values are plausible */
-	if (cal_x->min >= cal_x->center || 
-	    cal_x->center >= cal_x->max ||
-	    cal_y->min >= cal_y->center ||
-	    cal_y->center >= cal_y->max)
-		ret = -EINVAL;
+	if (cmd->data_len > NX_CON_SUBCMD_MAX_DATA_SIZE)
+		return -EINVAL;
 
-	return ret;
+	req = (struct nx_con_subcmd_request *)cmd->buf;
+
+	spin_lock_irqsave(&con->lock, flags);
+	if (con->state == NX_CON_STATE_REMOVED) {
+		spin_unlock_irqrestore(&con->lock, flags);
+		return -ENODEV;
+	}
+	list_add_tail(&cmd->node,
+		      &con->subcmd_queue[nx_con_subcmd_prio(req->subcmd_id)]);
+	spin_unlock_irqrestore(&con->lock, flags);
+
+	queue_work(nx_con_output_wq, &con->output_worker);
+	return 0;
 }
 
-static const u16 DFLT_STICK_CAL_CEN = 2000;
-static const u16 DFLT_STICK_CAL_MAX = 3500;
-static const u16 DFLT_STICK_CAL_MIN = 500;
+/* Called with con->lock held */
+static void nx_con_queue_rumble(struct nx_con *con)
+{
+	if (con->state == NX_CON_STATE_REMOVED)
+		return;
 
-static void nx_con_use_default_calibration(struct hid_device *hdev,
-					   struct nx_con_stick_cal *cal_x,
-					   struct nx_con_stick_cal *cal_y,
-					   const char *stick,
-					   int ret)
+	WRITE_ONCE(con->rumble_pending, true);
+	queue_work(nx_con_output_wq, &con->output_worker);
+	/* the output worker may be waiting on a subcommand reply */
+	wake_up(&con->wait);
+}
+
+/*
+ * Resends the current rumble frame every NX_CON_RUMBLE_PERIOD_MS while there's
+ * rumble to refresh, counted from whenever a frame last went out. The timer
+ * stops itself once there's nothing left to send; nx_con_arm_rumble_timer
+ * restarts it.
+ */
+static enum hrtimer_restart nx_con_rumble_timer(struct hrtimer *timer)
 {
-	hid_warn(hdev, "Failed to read %s stick cal, using defaults; e=%d\n", stick, ret);
+	struct nx_con *con = container_of(timer, struct nx_con, rumble_timer);
+	ktime_t period = ms_to_ktime(NX_CON_RUMBLE_PERIOD_MS);
+	enum hrtimer_restart restart = HRTIMER_NORESTART;
+	unsigned long flags;
+	ktime_t next;
+
+	spin_lock_irqsave(&con->lock, flags);
+	if (con->state != NX_CON_STATE_REMOVED &&
+	    (con->rumble_queue_head != con->rumble_queue_tail ||
+	     con->rumble_tail_unsent ||
+	     con->rumble_zero_countdown > 0)) {
+		next = ktime_add(con->rumble_last_sent, period);
+		if (ktime_before(ktime_get(), next)) {
+			hrtimer_set_expires(timer, next);
+		} else {
+			/*
+			 * When this value reaches 0, we know we've sent
+			 * multiple packets to the controller instructing it to
+			 * disable rumble. We can safely stop sending periodic
+			 * rumble packets until the next ff effect.
+			 */
+			if (con->rumble_zero_countdown > 0)
+				con->rumble_zero_countdown--;
+			nx_con_queue_rumble(con);
+			hrtimer_forward_now(timer, period);
+		}
+		restart = HRTIMER_RESTART;
+	}
+	con->rumble_timer_armed = restart == HRTIMER_RESTART;
+	spin_unlock_irqrestore(&con->lock, flags);
+
+	return restart;
+}
+
+/* Called with con->lock held */
+static void nx_con_arm_rumble_timer(struct nx_con *con)
+{
+	if (con->rumble_timer_armed || con->state == NX_CON_STATE_REMOVED)
+		return;
+
+	con->rumble_timer_armed = true;
+	hrtimer_start(&con->rumble_timer,
+		      ms_to_ktime(NX_CON_RUMBLE_PERIOD_MS),
+		      HRTIMER_MODE_REL);
+}
+
+static void nx_con_async_subcmd_done(struct nx_con *con,
+				     struct nx_con_subcmd *cmd)
+{
+	if (cmd->ret && cmd->ret != -ENODEV)
+		hid_warn(con->hdev, "subcommand 0x%02X failed; ret=%d\n",
+			 cmd->buf[offsetof(struct nx_con_subcmd_request, subcmd_id)],
+			 cmd->ret);
+	kfree(cmd);
+}
+
+/*
+ * The output worker answers or fails each subcommand within 2 * its timeout of
+ * sending it (it retries once). This also allows for waiting behind others in
+ * the queue, and only matters if the worker never gets to it at all.
+ */
+#define NX_CON_SUBCMD_QUEUE_WAIT	(5 * HZ)
+
+/*
+ * Sends a subcommand and sleeps until it has been answered. If @reply is not
+ * NULL, it receives the full reply report (NX_CON_MAX_RESP_SIZE bytes).
+ *
+ * This must not be called with output_mutex held, since the output worker
+ * needs it to send the request.
+ */
+static int nx_con_send_subcmd(struct nx_con *con,
+			      struct nx_con_subcmd_request *subcmd,
+			      size_t data_len,
+			      u32 timeout,
+			      u8 *reply)
+{
+	struct nx_con_subcmd *cmd;
+	unsigned long flags;
+	bool queued;
+	int ret;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 13, 0)
+	lockdep_assert_not_held(&con->output_mutex);
+#endif
+
+	if (data_len > NX_CON_SUBCMD_MAX_DATA_SIZE)
+		return -EINVAL;
+
+	/* not on the stack, so that it can be left behind if it never finishes */
+	if (!(cmd = kzalloc(sizeof(*cmd), GFP_KERNEL)))
+		return -ENOMEM;
+
+	memcpy(cmd->buf, subcmd, sizeof(*subcmd) + data_len);
+	cmd->data_len = data_len;
+	cmd->timeout = timeout;
+	INIT_LIST_HEAD(&cmd->node);
+	init_completion(&cmd->done);
+
+	if ((ret = nx_con_submit_subcmd(con, cmd))) {
+		kfree(cmd);
+		return ret;
+	}
+
+	if (!wait_for_completion_timeout(&cmd->done,
+					 2 * timeout + NX_CON_SUBCMD_QUEUE_WAIT)) {
+		hid_warn(con->hdev, "subcommand 0x%02X never finished\n",
+			 subcmd->subcmd_id);
+
+		spin_lock_irqsave(&con->lock, flags);
+		if (con->subcmd_inflight == cmd) {
+			/* the output worker frees it once it's done with it */
+			cmd->complete = nx_con_async_subcmd_done;
+			spin_unlock_irqrestore(&con->lock, flags);
+			return -ETIMEDOUT;
+		}
+		queued = !list_empty(&cmd->node);
+		list_del_init(&cmd->node);
+		spin_unlock_irqrestore(&con->lock, flags);
+
+		if (queued) {
+			kfree(cmd);
+			return -ETIMEDOUT;
+		}
+		/* otherwise, it's being completed right now */
+		wait_for_completion(&cmd->done);
+	}
+
+	if (!(ret = cmd->ret) && reply)
+		memcpy(reply, cmd->reply, NX_CON_MAX_RESP_SIZE);
+	kfree(cmd);
+	return ret;
+}
+
+/*
+ * Queues a subcommand without waiting for it. This is meant for subcommands
+ * which set some state on the controller (e.g., the LEDs), where only the
+ * newest request matters: if one with the same id is still waiting in the
+ * queue, it's overwritten instead of queueing another.
+ *
+ * May be called from atomic context.
+ */
+static int nx_con_send_subcmd_async(struct nx_con *con,
+				    struct nx_con_subcmd_request *subcmd,
+				    size_t data_len,
+				    u32 timeout)
+{
+	struct nx_con_subcmd_request *queued_req;
+	struct nx_con_subcmd *cmd;
+	unsigned long flags;
+	int ret;
+
+	if (data_len > NX_CON_SUBCMD_MAX_DATA_SIZE)
+		return -EINVAL;
+
+	spin_lock_irqsave(&con->lock, flags);
+	list_for_each_entry(cmd,
+			    &con->subcmd_queue[nx_con_subcmd_prio(subcmd->subcmd_id)],
+			    node) {
+		queued_req = (struct nx_con_subcmd_request *)cmd->buf;
+		if (cmd->coalesce && queued_req->subcmd_id == subcmd->subcmd_id) {
+			memcpy(cmd->buf, subcmd, sizeof(*subcmd) + data_len);
+			cmd->data_len = data_len;
+			cmd->timeout = timeout;
+			spin_unlock_irqrestore(&con->lock, flags);
+			return 0;
+		}
+	}
+	spin_unlock_irqrestore(&con->lock, flags);
+
+	if (!(cmd = kzalloc(sizeof(*cmd), GFP_ATOMIC)))
+		return -ENOMEM;
+
+	memcpy(cmd->buf, subcmd, sizeof(*subcmd) + data_len);
+	cmd->data_len = data_len;
+	cmd->timeout = timeout;
+	cmd->coalesce = true;
+	cmd->complete = nx_con_async_subcmd_done;
+
+	if ((ret = nx_con_submit_subcmd(con, cmd)))
+		kfree(cmd);
+	return ret;
+}
+
+/* Supply nibbles for flash and on. Ones correspond to active */
+static int nx_con_set_player_leds(struct nx_con *con, u8 flash, u8 on, bool async)
+{
+	struct nx_con_subcmd_request *req;
+	u8 buffer[sizeof(*req) + 1] = { 0 };
+
+	req = (struct nx_con_subcmd_request *)buffer;
+	req->subcmd_id = NX_CON_SUBCMD_SET_PLAYER_LIGHTS;
+	req->data[0] = (flash << 4) | on;
+
+	hid_dbg(con->hdev, "setting player leds\n");
+	if (async)
+		return nx_con_send_subcmd_async(con, req, 1, HZ/4);
+	return nx_con_send_subcmd(con, req, 1, HZ/4, NULL);
+}
+
+static int nx_con_request_spi_flash_read(struct nx_con *con,
+					 u32 start_addr,
+					 u8 size,
+					 u8 *buf)
+{
+	struct nx_con_subcmd_request *req;
+	struct nx_con_input_report *report;
+	u8 buffer[sizeof(*req) + 5] = { 0 };
+	u8 reply[NX_CON_MAX_RESP_SIZE];
+	u8 *data;
+	int ret;
+
+	if (!buf || size > NX_CON_SPI_READ_MAX_SIZE)
+		return -EINVAL;
+
+	req = (struct nx_con_subcmd_request *)buffer;
+	req->subcmd_id = NX_CON_SUBCMD_SPI_FLASH_READ;
+	data = req->data;
+	put_unaligned_le32(start_addr, data);
+	data[4] = size;
+
+	hid_dbg(con->hdev, "requesting SPI flash data\n");
+	if ((ret = nx_con_send_subcmd(con, req, 5, HZ, reply))) {
+		hid_err(con->hdev, "failed reading SPI flash; ret=%d\n", ret);
+	} else {
+		report = (struct nx_con_input_report *)reply;
+		/* The read data starts at the 6th byte */
+		memcpy(buf, &report->subcmd_reply.data[5], size);
+	}
+	return ret;
+}
+
+/*
+ * Reads [start, end) of an SPI flash region into its image, using the fewest
+ * SPI flash read subcommands possible. On failure, the region's image is left
+ * covering whatever was successfully read before the error.
+ */
+static int nx_con_read_cal_region(struct nx_con *con,
+				  struct nx_con_cal_region *region,
+				  u32 start,
+				  u32 end)
+{
+	u32 addr;
+	u8 size;
+	int ret;
+
+	region->start = start;
+	region->end = start;
+
+	for (addr = start; addr < end; addr += size) {
+		size = min_t(u32, end - addr, NX_CON_SPI_READ_MAX_SIZE);
+
+		if ((ret = nx_con_request_spi_flash_read(con,
+							 addr,
+							 size,
+							 region->data + (addr - region->base))))
+			return ret;
+
+		region->end = addr + size;
+	}
+
+	return 0;
+}
+
+/*
+ * Fills the calibration image with every byte of SPI flash the calibration
+ * parsers below need. Only the ranges the controller actually uses are read.
+ */
+static int nx_con_read_cal_image(struct nx_con *con)
+{
+	struct nx_con_cal_image *image = &con->cal_image;
+	u32 fct_start = NX_CON_CAL_FCT_DATA_LEFT_ADDR;
+	u32 fct_end = NX_CON_CAL_FCT_DATA_RIGHT_ADDR + NX_CON_CAL_STICK_DATA_SIZE;
+	u32 usr_start = NX_CON_CAL_USR_LEFT_MAGIC_ADDR;
+	u32 usr_end = NX_CON_CAL_USR_RIGHT_DATA_ADDR + NX_CON_CAL_STICK_DATA_SIZE;
+	int fct_ret;
+	int usr_ret;
+
+	BUILD_BUG_ON(NX_CON_IMU_CAL_FCT_DATA_ADDR < NX_CON_CAL_FCT_REGION_ADDR);
+	BUILD_BUG_ON(NX_CON_CAL_FCT_DATA_RIGHT_ADDR + NX_CON_CAL_STICK_DATA_SIZE >
+		     NX_CON_CAL_FCT_REGION_ADDR + NX_CON_CAL_REGION_SIZE);
+	BUILD_BUG_ON(NX_CON_CAL_USR_LEFT_MAGIC_ADDR < NX_CON_CAL_USR_REGION_ADDR);
+	BUILD_BUG_ON(NX_CON_IMU_CAL_USR_DATA_ADDR + NX_CON_IMU_CAL_DATA_SIZE >
+		     NX_CON_CAL_USR_REGION_ADDR + NX_CON_CAL_REGION_SIZE);
+
+	if (nx_con_has_imu(con)) {
+		fct_start = NX_CON_IMU_CAL_FCT_DATA_ADDR;
+		usr_end = NX_CON_IMU_CAL_USR_DATA_ADDR + NX_CON_IMU_CAL_DATA_SIZE;
+	}
+
+	image->factory.base = NX_CON_CAL_FCT_REGION_ADDR;
+	image->user.base = NX_CON_CAL_USR_REGION_ADDR;
+
+	hid_dbg(con->hdev, "reading cal image\n");
+	fct_ret = nx_con_read_cal_region(con, &image->factory, fct_start, fct_end);
+	usr_ret = nx_con_read_cal_region(con, &image->user, usr_start, usr_end);
+
+	return fct_ret ? fct_ret : usr_ret;
+}
+
+/* Returns the calibration image's copy of the given SPI flash range, if read */
+static u8 *nx_con_cal_image_get(struct nx_con *con, u32 addr, u32 size)
+{
+	struct nx_con_cal_region *regions[] = {
+		&con->cal_image.factory,
+		&con->cal_image.user,
+	};
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(regions); i++) {
+		struct nx_con_cal_region *region = regions[i];
+
+		if (addr >= region->start && addr + size <= region->end)
+			return region->data + (addr - region->base);
+	}
+
+	return NULL;
+}
+
+/*
+ * User calibration's presence is denoted with a magic byte preceding it.
+ * returns 0 if magic val is present, 1 if not present, < 0 on error
+ */
+static int nx_con_check_for_cal_magic(struct nx_con *con, u32 flash_addr)
+{
+	u8 *reply;
+
+	if (!(reply = nx_con_cal_image_get(con,
+					   flash_addr,
+					   NX_CON_CAL_USR_MAGIC_SIZE)))
+		return -ENODATA;
+
+	return reply[0] != NX_CON_CAL_USR_MAGIC_0 ||
+	       reply[1] != NX_CON_CAL_USR_MAGIC_1;
+}
+
+static int nx_con_read_stick_calibration(struct nx_con *con,
+					 u16 cal_addr,
+					 struct nx_con_stick_cal *cal_x,
+					 struct nx_con_stick_cal *cal_y,
+					 bool left_stick)
+{
+	s32 x_max_above;
+	s32 x_min_below;
+	s32 y_max_above;
+	s32 y_min_below;
+	u8 *raw;
+
+	if (!(raw = nx_con_cal_image_get(con,
+					 cal_addr,
+					 NX_CON_CAL_STICK_DATA_SIZE)))
+		return -ENODATA;
+
+	/* stick calibration parsing: note the order differs based on stick */
+	if (left_stick) {
+		x_max_above = hid_field_extract(con->hdev, (raw + 0), 0, 12);
+		y_max_above = hid_field_extract(con->hdev, (raw + 1), 4, 12);
+		cal_x->center = hid_field_extract(con->hdev, (raw + 3), 0, 12);
+		cal_y->center = hid_field_extract(con->hdev, (raw + 4), 4, 12);
+		x_min_below = hid_field_extract(con->hdev, (raw + 6), 0, 12);
+		y_min_below = hid_field_extract(con->hdev, (raw + 7), 4, 12);
+	} else {
+		cal_x->center = hid_field_extract(con->hdev, (raw + 0), 0, 12);
+		cal_y->center = hid_field_extract(con->hdev, (raw + 1), 4, 12);
+		x_min_below = hid_field_extract(con->hdev, (raw + 3), 0, 12);
+		y_min_below = hid_field_extract(con->hdev, (raw + 4), 4, 12);
+		x_max_above = hid_field_extract(con->hdev, (raw + 6), 0, 12);
+		y_max_above = hid_field_extract(con->hdev, (raw + 7), 4, 12);
+	}
+
+	cal_x->max = cal_x->center + x_max_above;
+	cal_x->min = cal_x->center - x_min_below;
+	cal_y->max = cal_y->center + y_max_above;
+	cal_y->min = cal_y->center - y_min_below;
+
+	/* check if calibration values are plausible */
+	if (cal_x->min >= cal_x->center || 
+	    cal_x->center >= cal_x->max ||
+	    cal_y->min >= cal_y->center ||
+	    cal_y->center >= cal_y->max)
+		return -EINVAL;
+
+	return 0;
+}
+
+static const u16 DFLT_STICK_CAL_CEN = 2000;
+static const u16 DFLT_STICK_CAL_MAX = 3500;
+static const u16 DFLT_STICK_CAL_MIN = 500;
 
+static void nx_con_set_default_stick_cal(struct nx_con_stick_cal *cal_x,
+					 struct nx_con_stick_cal *cal_y)
+{
 	cal_x->center = cal_y->center = DFLT_STICK_CAL_CEN;
 	cal_x->max = cal_y->max = DFLT_STICK_CAL_MAX;
 	cal_x->min = cal_y->min = DFLT_STICK_CAL_MIN;
 }
 
+static void nx_con_use_default_calibration(struct hid_device *hdev,
+					   struct nx_con_stick_cal *cal_x,
+					   struct nx_con_stick_cal *cal_y,
+					   const char *stick,
+					   int ret)
+{
+	hid_warn(hdev, "Failed to read %s stick cal, using defaults; e=%d\n", stick, ret);
+
+	nx_con_set_default_stick_cal(cal_x, cal_y);
+}
+
 static int nx_con_request_calibration(struct nx_con *con)
 {
 	u16 left_stick_addr = NX_CON_CAL_FCT_DATA_LEFT_ADDR;
 	u16 right_stick_addr = NX_CON_CAL_FCT_DATA_RIGHT_ADDR;
+	int err = 0;
 	int ret;
 
 	hid_dbg(con->hdev, "requesting cal data\n");
@@ -1088,6 +1983,9 @@ static int nx_con_request_calibration(struct nx_con *con)
 					       &con->left_stick_cal_y,
 					       "left",
 					       ret);
+		if (nx_con_type_has_left_controls(con) ||
+		    nx_con_type_is_n64con(con))
+			err = ret;
 	}
 
 	if ((ret = nx_con_read_stick_calibration(con,
@@ -1100,6 +1998,8 @@ static int nx_con_request_calibration(struct nx_con *con)
 					       &con->right_stick_cal_y,
 					       "right",
 					       ret);
+		if (nx_con_type_has_right_controls(con))
+			err = ret;
 	}
 
 	hid_dbg(con->hdev, "calibration:\n"
@@ -1120,65 +2020,203 @@ static int nx_con_request_calibration(struct nx_con *con)
 			   con->right_stick_cal_y.max,
 			   con->right_stick_cal_y.min);
 
-	return 0;
+	/* only report failure for the sticks this controller actually has */
+	return err;
 }
 
 /*
- * These divisors are calculated once rather than for each sample. They are only
- * dependent on the IMU calibration values. They are used when processing the
- * IMU input reports.
+ * Stick values are mapped as (d * mult) >> 32, where d is the raw value's
+ * distance from center and mult = ceil(NX_CON_MAX_STICK_MAG * 2^32 / range).
+ * For d and range below 2^12, as they are for 12-bit raw values, this is
+ * exactly d * NX_CON_MAX_STICK_MAG / range, without a division per report.
  */
-static void nx_con_calc_imu_cal_divisors(struct nx_con *con)
+static u64 nx_con_stick_mult(s32 range)
 {
-	int i;
+	/* the same fallback as a degenerate calibration always had */
+	if (range < 1)
+		range = 1;
 
-	for (i = 0; i < 3; i++) {
-		con->imu_cal_accel_divisor[i] = con->accel_cal.scale[i] -
-						con->accel_cal.offset[i];
-		con->imu_cal_gyro_divisor[i] = con->gyro_cal.scale[i] -
-					       con->gyro_cal.offset[i];
-	}
+	return div_u64(((u64)NX_CON_MAX_STICK_MAG << 32) + range - 1, range);
 }
 
-static const s16 DFLT_ACCEL_OFFSET /*= 0*/;
-static const s16 DFLT_ACCEL_SCALE = 16384;
-static const s16 DFLT_GYRO_OFFSET /*= 0*/;
-static const s16 DFLT_GYRO_SCALE  = 13371;
+static void nx_con_calc_stick_map(struct nx_con_stick_map *map,
+				  const struct nx_con_stick_cal *cal)
+{
+	map->center = cal->center;
+	map->mult_pos = nx_con_stick_mult(cal->max - cal->center);
+	map->mult_neg = nx_con_stick_mult(cal->center - cal->min);
+}
 
-static int nx_con_request_imu_calibration(struct nx_con *con)
+/*
+ * Each raw IMU sample is converted as ((raw - offset) * mult) >> 20, rounding
+ * toward zero, where mult folds together the axis's calibration, the output
+ * scaling and its sign:
+ *
+ *   accel: mult = scale * 2^20 / (scale - offset), and the offset isn't
+ *          subtracted (in testing, doing so decreased accuracy)
+ *   gyro:  mult = NX_CON_IMU_PREC_RANGE_SCALE * scale * 2^20 / (scale - offset)
+ *
+ * The gyro values are multiplied by the precision-saving scaling factor to
+ * prevent large inaccuracies due to truncation of the resolution value which
+ * would otherwise occur. The multipliers stay below 2^45 and the offset raw
+ * values below 2^17, so the products can't overflow. The results are within
+ * 1 LSB of dividing by (scale - offset) for each sample.
+ *
+ * The right joy-con has 2 axes negated, Y and Z. This is due to the
+ * orientation of the IMU in the controller. We negate those axes' values in
+ * order to be consistent with the left joy-con and the pro controller:
+ *   X: positive is pointing toward the triggers
+ *   Y: positive is pointing to the left
+ *   Z: positive is pointing up (out of the buttons/sticks)
+ * The axes follow the right-hand rule.
+ */
+static s64 nx_con_imu_mult(s64 scale, s16 cal_scale, s16 cal_offset, bool negate)
 {
-	u16 imu_cal_addr = NX_CON_IMU_CAL_FCT_DATA_ADDR;
-	u8 *raw_cal;
-	int ret;
-	int i;
+	s32 divisor = cal_scale - cal_offset;
+	s64 mult;
 
-	if (!nx_con_check_for_cal_magic(con, NX_CON_IMU_CAL_USR_MAGIC_ADDR)) {
-		imu_cal_addr = NX_CON_IMU_CAL_USR_DATA_ADDR;
-		hid_info(con->hdev, "using user cal for IMU\n");
-	} else {
-		hid_info(con->hdev, "using factory cal for IMU\n");
-	}
+	/* a blank calibration would have divided by zero */
+	if (!divisor)
+		divisor = 1;
 
-	hid_dbg(con->hdev, "requesting IMU cal data\n");
-	if ((ret = nx_con_request_spi_flash_read(con,
-						 imu_cal_addr,
-						 NX_CON_IMU_CAL_DATA_SIZE,
-						 &raw_cal))) {
-		hid_warn(con->hdev, "Failed to read IMU cal, using defaults; ret=%d\n", ret);
+	mult = div_s64((scale * cal_scale) << NX_CON_IMU_MULT_SHIFT, divisor);
 
-		for (i = 0; i < 3; i++) {
-			con->accel_cal.offset[i] = DFLT_ACCEL_OFFSET;
-			con->accel_cal.scale[i] = DFLT_ACCEL_SCALE;
-			con->gyro_cal.offset[i] = DFLT_GYRO_OFFSET;
-			con->gyro_cal.scale[i] = DFLT_GYRO_SCALE;
-		}
-		nx_con_calc_imu_cal_divisors(con);
-		return ret;
-	}
+	return negate ? -mult : mult;
+}
 
-	/* IMU calibration parsing */
-	for (i = 0; i < 3; i++) {
-		int j = i * 2;
+/* Converts a raw sample as described above */
+static inline int nx_con_imu_value(s16 sample, s32 offset, s64 mult)
+{
+	s64 product = (s64)(sample - offset) * mult;
+
+	/* round toward zero, as division would */
+	if (product < 0)
+		product += (1LL << NX_CON_IMU_MULT_SHIFT) - 1;
+	return product >> NX_CON_IMU_MULT_SHIFT;
+}
+
+static void nx_con_calc_imu_mults(struct nx_con *con, struct nx_con_cal_set *set)
+{
+	bool negate;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		negate = i > 0 && nx_con_type_is_right_joycon(con);
+
+		set->imu_mult[i] = nx_con_imu_mult(1,
+						   con->accel_cal.scale[i],
+						   con->accel_cal.offset[i],
+						   negate);
+		set->imu_offset[i] = 0;
+
+		set->imu_mult[i + 3] = nx_con_imu_mult(NX_CON_IMU_PREC_RANGE_SCALE,
+						       con->gyro_cal.scale[i],
+						       con->gyro_cal.offset[i],
+						       negate);
+		set->imu_offset[i + 3] = con->gyro_cal.offset[i];
+	}
+}
+
+/*
+ * Derives what reports are decoded with from the calibration, publishes it
+ * all at once, and has the next report decoded in full, even if it's
+ * unchanged, so that the new calibration takes effect. Call once the new
+ * calibration is in place. Reports may be arriving meanwhile, so none of them
+ * must see part of the old calibration and part of the new.
+ */
+static void nx_con_cal_changed(struct nx_con *con)
+{
+	struct nx_con_cal_set set;
+	unsigned long flags;
+
+	nx_con_calc_stick_map(&set.left_stick[0], &con->left_stick_cal_x);
+	nx_con_calc_stick_map(&set.left_stick[1], &con->left_stick_cal_y);
+	nx_con_calc_stick_map(&set.right_stick[0], &con->right_stick_cal_x);
+	nx_con_calc_stick_map(&set.right_stick[1], &con->right_stick_cal_y);
+	nx_con_calc_imu_mults(con, &set);
+
+	spin_lock_irqsave(&con->lock, flags);
+	write_seqcount_begin(&con->cal_seq);
+	con->cal = set;
+	write_seqcount_end(&con->cal_seq);
+	spin_unlock_irqrestore(&con->lock, flags);
+
+	/* pairs with smp_rmb() in nx_con_report_unchanged() */
+	smp_wmb();
+	WRITE_ONCE(con->cal_gen, con->cal_gen + 1);
+}
+
+/* Copies a stick's x and y maps, consistent with each other */
+static void nx_con_get_stick_maps(struct nx_con *con,
+				  const struct nx_con_stick_map *src,
+				  struct nx_con_stick_map *maps)
+{
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&con->cal_seq);
+		maps[0] = src[0];
+		maps[1] = src[1];
+	} while (read_seqcount_retry(&con->cal_seq, seq));
+}
+
+/* Copies the IMU's multipliers and offsets, consistent with each other */
+static void nx_con_get_imu_mults(struct nx_con *con, s64 *mult, s32 *offset)
+{
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&con->cal_seq);
+		memcpy(mult, con->cal.imu_mult, sizeof(con->cal.imu_mult));
+		memcpy(offset, con->cal.imu_offset, sizeof(con->cal.imu_offset));
+	} while (read_seqcount_retry(&con->cal_seq, seq));
+}
+
+static const s16 DFLT_ACCEL_OFFSET /*= 0*/;
+static const s16 DFLT_ACCEL_SCALE = 16384;
+static const s16 DFLT_GYRO_OFFSET /*= 0*/;
+static const s16 DFLT_GYRO_SCALE  = 13371;
+
+static void nx_con_set_default_imu_cal(struct nx_con *con)
+{
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		con->accel_cal.offset[i] = DFLT_ACCEL_OFFSET;
+		con->accel_cal.scale[i] = DFLT_ACCEL_SCALE;
+		con->gyro_cal.offset[i] = DFLT_GYRO_OFFSET;
+		con->gyro_cal.scale[i] = DFLT_GYRO_SCALE;
+	}
+}
+
+static int nx_con_request_imu_calibration(struct nx_con *con)
+{
+	u16 imu_cal_addr = NX_CON_IMU_CAL_FCT_DATA_ADDR;
+	u8 *raw_cal;
+	int ret;
+	int i;
+
+	if (!nx_con_check_for_cal_magic(con, NX_CON_IMU_CAL_USR_MAGIC_ADDR)) {
+		imu_cal_addr = NX_CON_IMU_CAL_USR_DATA_ADDR;
+		hid_info(con->hdev, "using user cal for IMU\n");
+	} else {
+		hid_info(con->hdev, "using factory cal for IMU\n");
+	}
+
+	hid_dbg(con->hdev, "parsing IMU cal data\n");
+	if (!(raw_cal = nx_con_cal_image_get(con,
+					     imu_cal_addr,
+					     NX_CON_IMU_CAL_DATA_SIZE))) {
+		ret = -ENODATA;
+		hid_warn(con->hdev, "Failed to read IMU cal, using defaults; ret=%d\n", ret);
+
+		nx_con_set_default_imu_cal(con);
+		return ret;
+	}
+
+	/* IMU calibration parsing */
+	for (i = 0; i < 3; i++) {
+		int j = i * 2;
 
 		con->accel_cal.offset[i] = get_unaligned_le16(raw_cal + j);
 		con->accel_cal.scale[i] = get_unaligned_le16(raw_cal + j + 6);
@@ -1186,8 +2224,6 @@ static int nx_con_request_imu_calibration(struct nx_con *con)
 		con->gyro_cal.scale[i] = get_unaligned_le16(raw_cal + j + 18);
 	}
 
-	nx_con_calc_imu_cal_divisors(con);
-
 	hid_dbg(con->hdev, "IMU calibration:\n"
 			   "a_o[0]=%d a_o[1]=%d a_o[2]=%d\n"
 			   "a_s[0]=%d a_s[1]=%d a_s[2]=%d\n"
@@ -1206,108 +2242,340 @@ static int nx_con_request_imu_calibration(struct nx_con *con)
 			   con->gyro_cal.scale[1],
 			   con->gyro_cal.scale[2]);
 
+	/* these would produce a zero divisor */
+	for (i = 0; i < 3; i++) {
+		if (con->accel_cal.offset[i] == con->accel_cal.scale[i] ||
+		    con->gyro_cal.offset[i] == con->gyro_cal.scale[i]) {
+			ret = -EINVAL;
+			hid_warn(con->hdev, "Implausible IMU cal, using defaults\n");
+
+			nx_con_set_default_imu_cal(con);
+			return ret;
+		}
+	}
+
 	return 0;
 }
 
-static int nx_con_set_report_mode(struct nx_con *con)
+static int nx_con_enable_rumble(struct nx_con *con, bool enable, bool async)
 {
 	struct nx_con_subcmd_request *req;
 	u8 buffer[sizeof(*req) + 1] = { 0 };
 
 	req = (struct nx_con_subcmd_request *)buffer;
-	req->subcmd_id = NX_CON_SUBCMD_SET_REPORT_MODE;
-	req->data[0] = 0x30; /* standard, full report mode */
+	req->subcmd_id = NX_CON_SUBCMD_ENABLE_VIBRATION;
+	req->data[0] = enable ? 0x01 : 0x00;
 
-	hid_dbg(con->hdev, "setting controller report mode\n");
-	return nx_con_send_subcmd(con, req, 1, HZ);
+	hid_dbg(con->hdev, "%s rumble\n", enable ? "enabling" : "disabling");
+	if (async)
+		return nx_con_send_subcmd_async(con, req, 1, HZ/4);
+	return nx_con_send_subcmd(con, req, 1, HZ/4, NULL);
 }
 
-static int nx_con_enable_rumble(struct nx_con *con)
+static int nx_con_enable_imu(struct nx_con *con, bool enable, bool async)
 {
 	struct nx_con_subcmd_request *req;
 	u8 buffer[sizeof(*req) + 1] = { 0 };
 
 	req = (struct nx_con_subcmd_request *)buffer;
-	req->subcmd_id = NX_CON_SUBCMD_ENABLE_VIBRATION;
-	req->data[0] = 0x01; /* note: 0x00 would disable */
+	req->subcmd_id = NX_CON_SUBCMD_ENABLE_IMU;
+	req->data[0] = enable ? 0x01 : 0x00;
 
-	hid_dbg(con->hdev, "enabling rumble\n");
-	return nx_con_send_subcmd(con, req, 1, HZ/4);
+	hid_dbg(con->hdev, "%s IMU\n", enable ? "enabling" : "disabling");
+	if (async)
+		return nx_con_send_subcmd_async(con, req, 1, HZ);
+	return nx_con_send_subcmd(con, req, 1, HZ, NULL);
 }
 
-static int nx_con_enable_imu(struct nx_con *con)
+static int nx_con_send_imu_settings(struct nx_con *con, const u8 *settings, bool async)
 {
 	struct nx_con_subcmd_request *req;
-	u8 buffer[sizeof(*req) + 1] = { 0 };
+	u8 buffer[sizeof(*req) + NX_CON_IMU_NUM_SETTINGS] = { 0 };
 
 	req = (struct nx_con_subcmd_request *)buffer;
-	req->subcmd_id = NX_CON_SUBCMD_ENABLE_IMU;
-	req->data[0] = 0x01; /* note: 0x00 would disable */
+	req->subcmd_id = NX_CON_SUBCMD_SET_IMU_SENSITIVITY;
+	memcpy(req->data, settings, NX_CON_IMU_NUM_SETTINGS);
+
+	hid_dbg(con->hdev, "setting IMU sensitivity\n");
+	if (async)
+		return nx_con_send_subcmd_async(con, req, NX_CON_IMU_NUM_SETTINGS, HZ);
+	return nx_con_send_subcmd(con, req, NX_CON_IMU_NUM_SETTINGS, HZ, NULL);
+}
+
+/*
+ * Has nx_con_idle_worker apply idle_wanted. The state is checked under
+ * con->lock so that nothing can queue it once removal has cancelled it.
+ */
+static void nx_con_queue_idle_worker(struct nx_con *con)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&con->lock, flags);
+	if (con->state == NX_CON_STATE_READ)
+		queue_work(system_wq, &con->idle_worker);
+	spin_unlock_irqrestore(&con->lock, flags);
+}
+
+/*
+ * Enables or disables the IMU and rumble on the controller to match whether
+ * anything is using them. Most programs never read the IMU, and while it's
+ * off, the controller doesn't sample it and the driver doesn't decode it.
+ *
+ * Until the controller has been set up (see nx_con_setup_features), users are
+ * only counted. Must be called from process context.
+ */
+static int nx_con_update_features(struct nx_con *con, bool async)
+{
+	bool imu;
+	bool rumble;
+	int ret = 0;
+
+	mutex_lock(&con->features_mutex);
+	/*
+	 * The input devices are managed, so they're closed after removal has
+	 * stopped all output. Nothing can be sent from then on.
+	 */
+	if (!con->features_ready || con->state == NX_CON_STATE_REMOVED)
+		goto out;
+
+	imu = nx_con_has_imu(con) && READ_ONCE(con->imu_users);
+	rumble = nx_con_has_rumble(con) && READ_ONCE(con->rumble_users);
+
+	if (imu != con->imu_on) {
+		if ((ret = nx_con_enable_imu(con, imu, async))) {
+			if (con->state != NX_CON_STATE_REMOVED)
+				hid_err(con->hdev, "Failed to %s the IMU; ret=%d\n",
+					imu ? "enable" : "disable", ret);
+			goto out;
+		}
+		con->imu_on = imu;
+
+		/* IMU data only comes in full reports */
+		if (imu && READ_ONCE(con->idle_wanted)) {
+			WRITE_ONCE(con->idle_wanted, false);
+			nx_con_queue_idle_worker(con);
+		}
+
+		/* enabling the IMU went back to the default settings */
+		if (imu && memcmp(con->imu_settings,
+				  nx_con_imu_dflt_settings,
+				  NX_CON_IMU_NUM_SETTINGS) &&
+		    (ret = nx_con_send_imu_settings(con, con->imu_settings, async))) {
+			if (con->state != NX_CON_STATE_REMOVED)
+				hid_err(con->hdev, "Failed to restore IMU settings; ret=%d\n", ret);
+			goto out;
+		}
+	}
 
-	hid_dbg(con->hdev, "enabling IMU\n");
-	return nx_con_send_subcmd(con, req, 1, HZ);
+	if (rumble != con->rumble_on) {
+		if ((ret = nx_con_enable_rumble(con, rumble, async))) {
+			if (con->state != NX_CON_STATE_REMOVED)
+				hid_err(con->hdev, "Failed to %s rumble; ret=%d\n",
+					rumble ? "enable" : "disable", ret);
+			goto out;
+		}
+		con->rumble_on = rumble;
+	}
+
+out:
+	mutex_unlock(&con->features_mutex);
+	return ret;
 }
 
-static s32 nx_con_map_stick_val(struct nx_con_stick_cal *cal, s32 val)
+/* See nx_con_stick_mult() */
+static s32 nx_con_map_stick_val(const struct nx_con_stick_map *map, s32 val)
 {
-	s32 center = cal->center;
-	s32 min = cal->min;
-	s32 max = cal->max;
-	s32 new_val;
+	s32 center = map->center;
+	u64 d;
 
+	/*
+	 * Only a nonsensical imported calibration would put center outside of
+	 * the 12-bit range; keep the product from overflowing all the same.
+	 */
 	if (val > center) {
-		new_val = (val - center) * NX_CON_MAX_STICK_MAG;
-		new_val /= (max - center);
-	} else {
-		new_val = (center - val) * -NX_CON_MAX_STICK_MAG;
-		new_val /= (center - min);
+		d = min_t(u32, val - center, 0xFFF);
+		d = min_t(u64, (d * map->mult_pos) >> 32, NX_CON_MAX_STICK_MAG);
+		return d;
 	}
-	new_val = clamp(new_val,
-			(s32)-NX_CON_MAX_STICK_MAG,
-			(s32)NX_CON_MAX_STICK_MAG);
-	return new_val;
+
+	d = min_t(u32, center - val, 0xFFF);
+	d = min_t(u64, (d * map->mult_neg) >> 32, NX_CON_MAX_STICK_MAG);
+	return -(s32)d;
 }
 
-static void nx_con_input_report_parse_imu_data(struct nx_con *con,
-					       struct nx_con_input_report *rep,
-					       struct nx_con_imu_data *imu_data)
+/*
+ * Incremented for each controller whose IMU is being traced (see
+ * nx_con_imu_trace_fops), so that while none is, each trace site in the IMU
+ * path is a single patched-out branch.
+ */
+static DEFINE_STATIC_KEY_FALSE(nx_con_imu_trace_key);
+
+static inline bool nx_con_imu_tracing(struct nx_con *con)
 {
-	u8 *raw = rep->imu_raw_bytes;
-	int i;
+	return static_branch_unlikely(&nx_con_imu_trace_key) &&
+	       test_bit(0, &con->imu_trace);
+}
 
-	for (i = 0; i < 3; i++) {
-		struct nx_con_imu_data *data = &imu_data[i];
-
-		data->accel_x = get_unaligned_le16(raw + 0);
-		data->accel_y = get_unaligned_le16(raw + 2);
-		data->accel_z = get_unaligned_le16(raw + 4);
-		data->gyro_x = get_unaligned_le16(raw + 6);
-		data->gyro_y = get_unaligned_le16(raw + 8);
-		data->gyro_z = get_unaligned_le16(raw + 10);
-		/* point to next imu sample */
-		raw += sizeof(struct nx_con_imu_data);
+static const unsigned int nx_con_imu_abs_codes[NX_CON_IMU_NUM_AXES] = {
+	ABS_X, ABS_Y, ABS_Z, ABS_RX, ABS_RY, ABS_RZ,
+};
+
+#if IS_ENABLED(CONFIG_IIO_KFIFO_BUF)
+/* One scan of the IIO device: the raw sample, in packet order, and its time */
+struct nx_con_imu_scan {
+	s16 chans[NX_CON_IMU_NUM_AXES];
+	s64 timestamp __aligned(8);
+};
+
+/* Pushes a raw sample taken at timestamp (in ktime_get() time) to the buffer */
+static void nx_con_imu_iio_push(struct nx_con *con, const s16 *sample, s64 timestamp)
+{
+	struct nx_con_imu_scan scan = {};
+
+	memcpy(scan.chans, sample, sizeof(scan.chans));
+
+	/* the IIO device's clock is chosen by userspace */
+	timestamp += iio_get_time_ns(con->imu_iio) - ktime_get_ns();
+
+	iio_push_to_buffers_with_timestamp(con->imu_iio, &scan, timestamp);
+}
+#else
+static inline void nx_con_imu_iio_push(struct nx_con *con, const s16 *sample, s64 timestamp)
+{
+}
+#endif /* IS_ENABLED(CONFIG_IIO_KFIFO_BUF) */
+
+/*
+ * Estimates the controller's clock from the arrival times of its IMU reports
+ * (taken on entry to nx_hid_event) and the report's 8-bit timer byte.
+ *
+ * The timer byte counts time on the controller, so the number of ticks
+ * between two reports says exactly how many reports were lost in between,
+ * regardless of how late either one arrived. Its period isn't documented, so
+ * it's estimated along with the controller's clock by a simple PLL: each
+ * report is expected one tick period per tick after the last one, and the
+ * error from its actual arrival nudges both the clock's phase and the tick
+ * period. This settles within a few reports of connecting, where a long-term
+ * average wouldn't, and isn't thrown off by Bluetooth latency on any single
+ * report.
+ *
+ * Returns how many reports were lost before this one. Sets *report_ns to the
+ * nominal time between reports.
+ */
+static unsigned int nx_con_imu_clock_update(struct nx_con_imu_clock *clk,
+					    u8 timer,
+					    s64 now,
+					    s64 *report_ns)
+{
+	u32 ticks = (u8)(timer - clk->last_timer);
+	s64 elapsed = now - clk->last_arrival_ns;
+	unsigned int spanned = 1;
+	s64 tick_ns;
+	s64 pred;
+	s64 err;
+	u64 est;
+	u32 gain;
+
+	*report_ns = NX_CON_IMU_DFLT_REPORT_NS;
+
+	if (!clk->synced) {
+		clk->synced = true;
+		clk->base_ns = now - NX_CON_IMU_DFLT_REPORT_NS;
+	}
+
+	if (clk->last_arrival_ns == 0 || elapsed > NSEC_PER_SEC) {
+		/* (re)start, e.g., after connecting or a long gap */
+		clk->tick_ns_q16 = 0;
+		clk->report_ticks_q8 = 0;
+		clk->phase_ns = now;
+		clk->updates = 0;
+		goto out;
+	}
+
+	if (!ticks)
+		goto out_report_ns;
+
+	if (!clk->tick_ns_q16) {
+		/* the first interval gives a first estimate */
+		clk->tick_ns_q16 = div_s64(elapsed << 16, ticks);
+		clk->report_ticks_q8 = ticks << 8;
+		clk->phase_ns = now;
+		goto out_clamp;
+	}
+
+	/* the timer byte wraps after 256 ticks; let the arrival time unwrap it */
+	est = div64_u64((u64)elapsed << 16, (u64)clk->tick_ns_q16);
+	if (est > ticks + 128)
+		ticks += ((est - ticks + 128) / 256) * 256;
+
+	spanned = DIV_ROUND_CLOSEST(ticks << 8, clk->report_ticks_q8);
+	if (spanned <= 1) {
+		spanned = 1;
+		/* the usual spacing of reports, learned from the unbroken ones */
+		clk->report_ticks_q8 += ((s32)(ticks << 8) -
+					 (s32)clk->report_ticks_q8) / 8;
+	}
+
+	pred = clk->phase_ns + (s64)((ticks * clk->tick_ns_q16) >> 16);
+	err = now - pred;
+	if (abs(err) > NX_CON_IMU_RESYNC_NS) {
+		clk->phase_ns = now;
+		goto out_clamp;
 	}
+
+	/*
+	 * Trust the arrival times a lot at first, so the estimate settles
+	 * within a few reports, then less and less so jitter averages out.
+	 */
+	if (clk->updates < 64)
+		clk->updates++;
+	gain = clk->updates + 1;
+
+	/* the phase must never go backwards */
+	clk->phase_ns = max(pred + div_s64(err, min(gain, 8U)), clk->phase_ns + 1);
+	clk->tick_ns_q16 += div_s64(div_s64(err * 65536, gain), ticks);
+
+out_clamp:
+	tick_ns = clk->tick_ns_q16 >> 16;
+	if (tick_ns < NX_CON_IMU_MIN_TICK_NS)
+		clk->tick_ns_q16 = (s64)NX_CON_IMU_MIN_TICK_NS << 16;
+	else if (tick_ns > NX_CON_IMU_MAX_TICK_NS)
+		clk->tick_ns_q16 = (s64)NX_CON_IMU_MAX_TICK_NS << 16;
+	if (!clk->report_ticks_q8)
+		clk->report_ticks_q8 = 1 << 8;
+out_report_ns:
+	if (clk->tick_ns_q16)
+		*report_ns = (clk->report_ticks_q8 * clk->tick_ns_q16) >> 24;
+out:
+	clk->last_timer = timer;
+	clk->last_arrival_ns = now;
+	clk->dropped += spanned - 1;
+	return spanned - 1;
 }
 
 static void nx_con_report_imu(struct nx_con *con, struct nx_con_input_report *rep)
 {
-	struct nx_con_imu_data imu_data[3] = {0}; /* 3 reports per packet */
-	struct input_dev *idev = con->imu_idev;
-	unsigned int msecs = jiffies_to_msecs(jiffies);
-	unsigned int last_msecs = con->imu_last_pkt_ms;
+	const u8 *raw = rep->imu_raw_bytes;
+	struct input_dev *idev = NULL;
+	bool iio = test_bit(NX_CON_IMU_USER_IIO, &con->imu_users);
+	struct nx_con_imu_clock *clk = &con->imu_clock;
+	unsigned int dropped;
+	s64 report_ns;
+	s64 timestamp;
+	s16 sample[NX_CON_IMU_NUM_AXES];
+	int value[NX_CON_IMU_NUM_AXES];
+	s64 mult[NX_CON_IMU_NUM_AXES];
+	s32 offset[NX_CON_IMU_NUM_AXES];
 	int i;
-	int value[6];
-
-	nx_con_input_report_parse_imu_data(con, rep, imu_data);
+	int j;
 
 	/*
 	 * There are complexities surrounding how we determine the timestamps we
 	 * associate with the samples we pass to userspace. The IMU input
 	 * reports do not provide us with a good timestamp. There's a quickly
-	 * incrementing 8-bit counter per input report, but it is not very
-	 * useful for this purpose (it is not entirely clear what rate it
-	 * increments at or if it varies based on packet push rate - more on
-	 * the push rate below...).
+	 * incrementing 8-bit counter per input report, but its rate isn't
+	 * documented, and it wraps every 256 ticks (more on the push rate
+	 * below...).
 	 *
 	 * The reverse engineering work done on the joy-cons and pro controllers
 	 * by the community seems to indicate the following:
@@ -1333,75 +2601,78 @@ static void nx_con_report_imu(struct nx_con *con, struct nx_con_input_report *re
 	 * are duplicates. This seems to indicate that the time deltas between
 	 * reported samples can vary based on the input report rate.
 	 *
-	 * The solution employed in this driver is to keep track of the average
-	 * time delta between IMU input reports. In testing, this value has
-	 * proven to be stable, staying at 15ms or 11ms, though other hardware
-	 * configurations and bluetooth stacks could potentially see other rates
-	 * (hopefully this will become more clear as more people use the
-	 * driver).
+	 * The solution employed in this driver is to estimate the controller's
+	 * clock from when each report arrived and from its timer byte (see
+	 * nx_con_imu_clock_update). The timer byte tells exactly how many
+	 * reports were lost, and the arrival times pin down the rate, whatever
+	 * it turns out to be for a given controller and bluetooth stack. The
+	 * newest sample in a report is timestamped with when the report was
+	 * sent, and the other two are spread evenly before it.
 	 *
-	 * Keeping track of the average report delta allows us to submit our
-	 * timestamps to userspace based on that. Each report contains 3
-	 * samples, so the IMU sampling rate should be avg_time_delta/3. We can
-	 * also use this average to detect events where we have dropped a
-	 * packet. The userspace timestamp for the samples will be adjusted
-	 * accordingly to prevent unwanted behvaior.
+	 * MSC_TIMESTAMP is a 32-bit count of microseconds since the first
+	 * report, so it wraps after about 71.6 minutes. Userspace is expected
+	 * to handle the wrap (as it must for any evdev timestamp).
 	 */
-	if (!con->imu_first_packet_received) {
-		con->imu_timestamp_us = 0;
-		con->imu_delta_samples_count = 0;
-		con->imu_delta_samples_sum = 0;
-		con->imu_avg_delta_ms = NX_CON_IMU_DFLT_AVG_DELTA_MS;
-		con->imu_first_packet_received = true;
-	} else {
-		unsigned int delta = msecs - last_msecs;
-		unsigned int dropped_pkts;
-		unsigned int dropped_threshold;
-
-		/* avg imu report delta housekeeping */
-		con->imu_delta_samples_sum += delta;
-		con->imu_delta_samples_count++;
-
-		if (con->imu_delta_samples_count >= NX_CON_IMU_SAMPLES_PER_DELTA_AVG) {
-			con->imu_avg_delta_ms = con->imu_delta_samples_sum /
-						con->imu_delta_samples_count;
-			/* don't ever want divide by zero shenanigans */
-			if (con->imu_avg_delta_ms == 0) {
-				con->imu_avg_delta_ms = 1;
-				hid_warn(con->hdev, "calculated avg imu delta of 0\n");
-			}
-			con->imu_delta_samples_count = 0;
-			con->imu_delta_samples_sum = 0;
-		}
-
-		/* useful for debugging IMU sample rate */
-		hid_dbg(con->hdev,
-			"imu_report: ms=%u last_ms=%u delta=%u avg_delta=%u\n",
-			msecs,
-			last_msecs,
-			delta,
-			con->imu_avg_delta_ms);
-
-		/* check if any packets have been dropped */
-		dropped_threshold = con->imu_avg_delta_ms * 3 / 2;
-		dropped_pkts = (delta - min(delta, dropped_threshold)) /
-				con->imu_avg_delta_ms;
-		con->imu_timestamp_us += 1000 * con->imu_avg_delta_ms;
-		if (dropped_pkts > NX_CON_IMU_DROPPED_PKT_WARNING) {
-			hid_warn(con->hdev,
-				 "compensating for %u dropped IMU reports\n",
-				 dropped_pkts);
-			hid_warn(con->hdev,
-				 "delta=%u avg_delta=%u\n",
-				 delta,
-				 con->imu_avg_delta_ms);
-		}
+	dropped = nx_con_imu_clock_update(clk,
+					  rep->timer,
+					  ktime_to_ns(con->event_time),
+					  &report_ns);
+	if (dropped > NX_CON_IMU_DROPPED_PKT_WARNING)
+		hid_warn(con->hdev,
+			 "compensating for %u dropped IMU reports\n",
+			 dropped);
+
+	/* useful for debugging IMU sample rate */
+	if (nx_con_imu_tracing(con))
+		hid_printk(KERN_DEBUG, con->hdev,
+			   "imu_report: timer=%u report_ns=%lld tick_ns=%lld dropped=%u total_dropped=%lu\n",
+			   rep->timer,
+			   report_ns,
+			   clk->tick_ns_q16 >> 16,
+			   dropped,
+			   clk->dropped);
+
+	if (test_bit(NX_CON_IMU_USER_EVDEV, &con->imu_users)) {
+		idev = con->imu_idev;
+		nx_con_get_imu_mults(con, mult, offset);
 	}
-	con->imu_last_pkt_ms = msecs;
+
+	timestamp = clk->phase_ns - clk->base_ns - 2 * div_s64(report_ns, 3);
+	/* in case the estimate moved backwards; samples must stay in order */
+	if (timestamp <= con->imu_timestamp_ns)
+		timestamp = con->imu_timestamp_ns + 1;
 
 	/* Each IMU input report contains three samples */
 	for (i = 0; i < 3; i++) {
-		input_event(idev, EV_MSC, MSC_TIMESTAMP, con->imu_timestamp_us);
+		con->imu_timestamp_ns = timestamp;
+
+		for (j = 0; j < NX_CON_IMU_NUM_AXES; j++)
+			sample[j] = get_unaligned_le16(raw + j * 2);
+		raw += sizeof(struct nx_con_imu_data);
+
+		if (nx_con_imu_tracing(con))
+			hid_printk(KERN_DEBUG, con->hdev,
+				   "imu_sample: ts=%lld a_x=%d a_y=%d a_z=%d g_x=%d g_y=%d g_z=%d\n",
+				   timestamp,
+				   sample[0],
+				   sample[1],
+				   sample[2],
+				   sample[3],
+				   sample[4],
+				   sample[5]);
+
+		if (iio)
+			nx_con_imu_iio_push(con, sample, clk->base_ns + timestamp);
+
+		timestamp += div_s64(report_ns, 3);
+
+		if (!idev)
+			continue;
+
+		input_event(idev,
+			    EV_MSC,
+			    MSC_TIMESTAMP,
+			    (u32)div_s64(con->imu_timestamp_ns, NSEC_PER_USEC));
 
 		/*
 		 * These calculations (which use the controller's calibration
@@ -1409,154 +2680,65 @@ static void nx_con_report_imu(struct nx_con *con, struct nx_con_input_report *re
 		 * found in the community's reverse-engineering repo (linked at
 		 * top of driver). For hid-nx, we make sure that the final
 		 * value given to userspace is always in terms of the axis
-		 * resolution we provided.
-		 *
-		 * Currently only the gyro calculations subtract the calibration
-		 * offsets from the raw value itself. In testing, doing the same
-		 * for the accelerometer raw values decreased accuracy.
-		 *
-		 * Note that the gyro values are multiplied by the
-		 * precision-saving scaling factor to prevent large inaccuracies
-		 * due to truncation of the resolution value which would
-		 * otherwise occur. To prevent overflow (without resorting to 64
-		 * bit integer math), the mult_frac macro is used.
-		 */
-		value[0] = mult_frac((NX_CON_IMU_PREC_RANGE_SCALE *
-				      (imu_data[i].gyro_x -
-				       con->gyro_cal.offset[0])),
-				     con->gyro_cal.scale[0],
-				     con->imu_cal_gyro_divisor[0]);
-		value[1] = mult_frac((NX_CON_IMU_PREC_RANGE_SCALE *
-				      (imu_data[i].gyro_y -
-				       con->gyro_cal.offset[1])),
-				     con->gyro_cal.scale[1],
-				     con->imu_cal_gyro_divisor[1]);
-		value[2] = mult_frac((NX_CON_IMU_PREC_RANGE_SCALE *
-				      (imu_data[i].gyro_z -
-				       con->gyro_cal.offset[2])),
-				     con->gyro_cal.scale[2],
-				     con->imu_cal_gyro_divisor[2]);
-
-		value[3] = ((s32)imu_data[i].accel_x *
-			    con->accel_cal.scale[0]) /
-			    con->imu_cal_accel_divisor[0];
-		value[4] = ((s32)imu_data[i].accel_y *
-			    con->accel_cal.scale[1]) /
-			    con->imu_cal_accel_divisor[1];
-		value[5] = ((s32)imu_data[i].accel_z *
-			    con->accel_cal.scale[2]) /
-			    con->imu_cal_accel_divisor[2];
-
-		hid_dbg(con->hdev,
-			"raw_gyro: g_x=%d g_y=%d g_z=%d\n",
-			imu_data[i].gyro_x,
-			imu_data[i].gyro_y,
-			imu_data[i].gyro_z);
-		hid_dbg(con->hdev,
-			"raw_accel: a_x=%d a_y=%d a_z=%d\n",
-			imu_data[i].accel_x,
-			imu_data[i].accel_y,
-			imu_data[i].accel_z);
-
-		/*
-		 * The right joy-con has 2 axes negated, Y and Z. This is due to
-		 * the orientation of the IMU in the controller. We negate those
-		 * axes' values in order to be consistent with the left joy-con
-		 * and the pro controller:
-		 *   X: positive is pointing toward the triggers
-		 *   Y: positive is pointing to the left
-		 *   Z: positive is pointing up (out of the buttons/sticks)
-		 * The axes follow the right-hand rule.
+		 * resolution we provided. See nx_con_calc_imu_mults.
 		 */
-		if (nx_con_type_is_right_joycon(con)) {
-			int j;
-
-			/* negate all but x axis */
-			for (j = 1; j < 6; ++j) {
-				if (j == 3)
-					continue;
-				value[j] *= -1;
-			}
-		}
+		for (j = 0; j < NX_CON_IMU_NUM_AXES; j++)
+			value[j] = nx_con_imu_value(sample[j], offset[j], mult[j]);
 
-		input_report_abs(idev, ABS_RX, value[0]);
-		input_report_abs(idev, ABS_RY, value[1]);
-		input_report_abs(idev, ABS_RZ, value[2]);
-		input_report_abs(idev, ABS_X, value[3]);
-		input_report_abs(idev, ABS_Y, value[4]);
-		input_report_abs(idev, ABS_Z, value[5]);
+		for (j = 0; j < NX_CON_IMU_NUM_AXES; j++)
+			input_report_abs(idev, nx_con_imu_abs_codes[j], value[j]);
 		input_sync(idev);
-
-		/* convert to micros and divide by 3 (3 samples per report). */
-		con->imu_timestamp_us += con->imu_avg_delta_ms * 1000 / 3;
-	}
-}
-
-static void nx_con_handle_rumble_report(struct nx_con *con, struct nx_con_input_report *rep)
-{
-	unsigned long flags;
-	unsigned long msecs = jiffies_to_msecs(jiffies);
-
-	spin_lock_irqsave(&con->lock, flags);
-
-	if (IS_ENABLED(CONFIG_NINTENDO_FF) && rep->vibrator_report &&
-	    (msecs - con->rumble_msecs) >= NX_CON_RUMBLE_PERIOD_MS &&
-	    (con->rumble_queue_head != con->rumble_queue_tail ||
-	     con->rumble_zero_countdown > 0)) {
-		/*
-		 * When this value reaches 0, we know we've sent multiple
-		 * packets to the controller instructing it to disable rumble.
-		 * We can safely stop sending periodic rumble packets until the
-		 * next ff effect.
-		 */
-		if (con->rumble_zero_countdown > 0)
-			con->rumble_zero_countdown--;
-		queue_work(con->rumble_queue, &con->rumble_worker);
 	}
 
-	spin_unlock_irqrestore(&con->lock, flags);
+	/* the newest sample, for reads of the IIO device's raw values */
+	for (j = 0; j < NX_CON_IMU_NUM_AXES; j++)
+		WRITE_ONCE(con->imu_raw[j], sample[j]);
 }
 
-static void nx_con_parse_battery_status(struct nx_con *con, struct nx_con_input_report *rep)
-{
-	u8 tmp;
-	unsigned long flags;
-
-	spin_lock_irqsave(&con->lock, flags);
-
-	tmp = rep->bat_con;
-	con->host_powered = tmp & BIT(0);
-	con->battery_charging = tmp & BIT(4);
-	tmp = tmp >> 5;
+#define NX_CON_BAT_CON_POWERED		BIT(0)
+#define NX_CON_BAT_CON_CHARGING		BIT(4)
+#define NX_CON_BAT_CON_LEVEL_SHIFT	5
+/* what bat_con holds until the first report; the level is invalid */
+#define NX_CON_BAT_CON_UNKNOWN		(7 << NX_CON_BAT_CON_LEVEL_SHIFT)
 
-	switch (tmp) {
+static int nx_con_battery_capacity(u8 bat_con)
+{
+	switch (bat_con >> NX_CON_BAT_CON_LEVEL_SHIFT) {
 	case 0: /* empty */
-		con->battery_capacity = POWER_SUPPLY_CAPACITY_LEVEL_CRITICAL;
-		break;
+		return POWER_SUPPLY_CAPACITY_LEVEL_CRITICAL;
 	case 1: /* low */
-		con->battery_capacity = POWER_SUPPLY_CAPACITY_LEVEL_LOW;
-		break;
+		return POWER_SUPPLY_CAPACITY_LEVEL_LOW;
 	case 2: /* medium */
-		con->battery_capacity = POWER_SUPPLY_CAPACITY_LEVEL_NORMAL;
-		break;
+		return POWER_SUPPLY_CAPACITY_LEVEL_NORMAL;
 	case 3: /* high */
-		con->battery_capacity = POWER_SUPPLY_CAPACITY_LEVEL_HIGH;
-		break;
+		return POWER_SUPPLY_CAPACITY_LEVEL_HIGH;
 	case 4: /* full */
-		con->battery_capacity = POWER_SUPPLY_CAPACITY_LEVEL_FULL;
-		break;
+		return POWER_SUPPLY_CAPACITY_LEVEL_FULL;
 	default:
-		con->battery_capacity = POWER_SUPPLY_CAPACITY_LEVEL_UNKNOWN;
-		hid_warn(con->hdev, "Invalid battery status\n");
-		break;
+		return POWER_SUPPLY_CAPACITY_LEVEL_UNKNOWN;
 	}
+}
 
-	spin_unlock_irqrestore(&con->lock, flags);
+/*
+ * The battery status is kept as the raw byte, so that the power supply
+ * getter can read all of it at once without a lock; it's decoded there.
+ */
+static void nx_con_parse_battery_status(struct nx_con *con, struct nx_con_input_report *rep)
+{
+	u8 bat_con = rep->bat_con;
+
+	if (bat_con == con->bat_con)
+		return;
+
+	if (nx_con_battery_capacity(bat_con) == POWER_SUPPLY_CAPACITY_LEVEL_UNKNOWN)
+		hid_warn(con->hdev, "Invalid battery status\n");
+	WRITE_ONCE(con->bat_con, bat_con);
 }
 
 static void nx_con_report_left_stick(struct nx_con *con,
 				     struct nx_con_input_report *rep)
 {
+	struct nx_con_stick_map maps[2];
 	u16 raw_x;
 	u16 raw_y;
 	s32 x;
@@ -1565,8 +2747,9 @@ static void nx_con_report_left_stick(struct nx_con *con,
 	raw_x = hid_field_extract(con->hdev, rep->left_stick, 0, 12);
 	raw_y = hid_field_extract(con->hdev, rep->left_stick + 1, 4, 12);
 
-	x = nx_con_map_stick_val(&con->left_stick_cal_x, raw_x);
-	y = -nx_con_map_stick_val(&con->left_stick_cal_y, raw_y);
+	nx_con_get_stick_maps(con, con->cal.left_stick, maps);
+	x = nx_con_map_stick_val(&maps[0], raw_x);
+	y = -nx_con_map_stick_val(&maps[1], raw_y);
 
 	input_report_abs(con->idev, ABS_X, x);
 	input_report_abs(con->idev, ABS_Y, y);
@@ -1575,6 +2758,7 @@ static void nx_con_report_left_stick(struct nx_con *con,
 static void nx_con_report_right_stick(struct nx_con *con,
 				      struct nx_con_input_report *rep)
 {
+	struct nx_con_stick_map maps[2];
 	u16 raw_x;
 	u16 raw_y;
 	s32 x;
@@ -1583,19 +2767,21 @@ static void nx_con_report_right_stick(struct nx_con *con,
 	raw_x = hid_field_extract(con->hdev, rep->right_stick, 0, 12);
 	raw_y = hid_field_extract(con->hdev, rep->right_stick + 1, 4, 12);
 
-	x = nx_con_map_stick_val(&con->right_stick_cal_x, raw_x);
-	y = -nx_con_map_stick_val(&con->right_stick_cal_y, raw_y);
+	nx_con_get_stick_maps(con, con->cal.right_stick, maps);
+	x = nx_con_map_stick_val(&maps[0], raw_x);
+	y = -nx_con_map_stick_val(&maps[1], raw_y);
 
 	input_report_abs(con->idev, ABS_RX, x);
 	input_report_abs(con->idev, ABS_RY, y);
 }
 
-static void nx_con_report_dpad(struct nx_con *con,
-			       struct nx_con_input_report *rep)
+static void nx_con_report_dpad(struct nx_con *con, u32 btns, u32 changed)
 {
 	int hatx = 0;
 	int haty = 0;
-	u32 btns = hid_field_extract(con->hdev, rep->button_status, 0, 24);
+
+	if (!(changed & NX_CON_BTN_DPAD))
+		return;
 
 	if (btns & NX_CON_BTN_LEFT)
 		hatx = -1;
@@ -1611,264 +2797,1520 @@ static void nx_con_report_dpad(struct nx_con *con,
 	input_report_abs(con->idev, ABS_HAT0Y, haty);
 }
 
-static void nx_con_report_buttons(struct nx_con *con,
+/* Reports only the buttons which changed, using the map nx_con_config_buttons built */
+static void nx_con_report_buttons(struct nx_con *con, u32 btns, u32 changed)
+{
+	unsigned int bit;
+	u16 code;
+
+	while (changed) {
+		bit = __ffs(changed);
+		changed &= changed - 1;
+
+		if ((code = con->button_codes[bit]))
+			input_report_key(con->idev, code, btns & BIT(bit));
+	}
+}
+
+/* Tracks how often the controller sends input reports, for output pacing */
+static void nx_con_update_report_interval(struct nx_con *con)
+{
+	ktime_t now = con->event_time;
+	s64 delta_us = ktime_us_delta(now, con->last_report_time);
+	u32 interval_us = con->report_interval_us;
+
+	con->last_report_time = now;
+
+	/* ignore gaps, e.g., while the controller was asleep */
+	if (delta_us <= 0 || delta_us > USEC_PER_SEC)
+		return;
+
+	if (interval_us)
+		interval_us = (7 * interval_us + (u32)delta_us) / 8;
+	else
+		interval_us = delta_us;
+	WRITE_ONCE(con->report_interval_us, interval_us);
+}
+
+/*
+ * Returns true if the report's battery, buttons and sticks are the same as in
+ * the last one decoded, with the same calibration, so that there's nothing new
+ * to report. The timer byte and IMU samples don't count. Otherwise, remembers
+ * them for the next report.
+ */
+static bool nx_con_report_unchanged(struct nx_con *con,
+				    struct nx_con_input_report *rep)
+{
+	const u8 *state = (const u8 *)rep + NX_CON_REPORT_STATE_OFFSET;
+	unsigned int cal_gen = READ_ONCE(con->cal_gen);
+
+	/* pairs with smp_wmb() in nx_con_cal_changed() */
+	smp_rmb();
+
+	if (con->last_report_valid &&
+	    con->last_report_cal_gen == cal_gen &&
+	    !memcmp(con->last_report_state, state, NX_CON_REPORT_STATE_SIZE)) {
+		con->reports_unchanged++;
+		return true;
+	}
+
+	memcpy(con->last_report_state, state, NX_CON_REPORT_STATE_SIZE);
+	con->last_report_cal_gen = cal_gen;
+	con->last_report_valid = true;
+	return false;
+}
+
+/*
+ * Per-type decoders for whatever each type has besides buttons, which are
+ * handled alike for all types by nx_con_report_buttons.
+ */
+static void nx_con_report_left_joycon(struct nx_con *con,
+				      struct nx_con_input_report *rep,
+				      u32 btns,
+				      u32 changed)
+{
+	nx_con_report_left_stick(con, rep);
+}
+
+static void nx_con_report_right_joycon(struct nx_con *con,
+				       struct nx_con_input_report *rep,
+				       u32 btns,
+				       u32 changed)
+{
+	nx_con_report_right_stick(con, rep);
+}
+
+static void nx_con_report_procon(struct nx_con *con,
+				 struct nx_con_input_report *rep,
+				 u32 btns,
+				 u32 changed)
+{
+	nx_con_report_left_stick(con, rep);
+	nx_con_report_right_stick(con, rep);
+	nx_con_report_dpad(con, btns, changed);
+}
+
+/* NES, SNES and Genesis controllers */
+static void nx_con_report_dpad_only(struct nx_con *con,
+				    struct nx_con_input_report *rep,
+				    u32 btns,
+				    u32 changed)
+{
+	nx_con_report_dpad(con, btns, changed);
+}
+
+static void nx_con_report_n64con(struct nx_con *con,
+				 struct nx_con_input_report *rep,
+				 u32 btns,
+				 u32 changed)
+{
+	nx_con_report_left_stick(con, rep);
+	nx_con_report_dpad(con, btns, changed);
+}
+
+static void nx_con_report_nothing(struct nx_con *con,
 				  struct nx_con_input_report *rep,
-				  const struct nx_con_button_mapping button_mappings[])
+				  u32 btns,
+				  u32 changed)
 {
-	const struct nx_con_button_mapping *button;
-	u32 status = hid_field_extract(con->hdev, rep->button_status, 0, 24);
+}
+
+/* What each type of controller has, and how its reports are decoded */
+struct nx_con_desc {
+	enum nx_con_type type;
+	u32 caps; /* NX_CON_CAP_* */
+	const struct nx_con_button_mapping *buttons;
+	/* SL/SR, which are only usable outside of the charging grip */
+	const struct nx_con_button_mapping *side_buttons;
+	/* for the simple report mode (and idling); NULL if it's not supported */
+	const u32 *simple_buttons;
+	void (*report)(struct nx_con *con,
+		       struct nx_con_input_report *rep,
+		       u32 btns,
+		       u32 changed);
+};
+
+static const struct nx_con_desc nx_con_descs[] = {
+	{
+		.type		= NX_CON_TYPE_JCL,
+		.caps		= NX_CON_CAP_LEFT_STICK |
+				  NX_CON_CAP_IMU |
+				  NX_CON_CAP_RUMBLE,
+		.buttons	= left_joycon_button_mappings,
+		.side_buttons	= left_joycon_s_button_mappings,
+		.simple_buttons	= nx_con_simple_left_joycon_buttons,
+		.report		= nx_con_report_left_joycon,
+	},
+	{
+		.type		= NX_CON_TYPE_JCR,
+		.caps		= NX_CON_CAP_RIGHT_STICK |
+				  NX_CON_CAP_IMU |
+				  NX_CON_CAP_RUMBLE,
+		.buttons	= right_joycon_button_mappings,
+		.side_buttons	= right_joycon_s_button_mappings,
+		.simple_buttons	= nx_con_simple_right_joycon_buttons,
+		.report		= nx_con_report_right_joycon,
+	},
+	{
+		.type		= NX_CON_TYPE_PRO,
+		.caps		= NX_CON_CAP_LEFT_STICK |
+				  NX_CON_CAP_RIGHT_STICK |
+				  NX_CON_CAP_DPAD |
+				  NX_CON_CAP_IMU |
+				  NX_CON_CAP_RUMBLE,
+		.buttons	= procon_button_mappings,
+		.simple_buttons	= nx_con_simple_procon_buttons,
+		.report		= nx_con_report_procon,
+	},
+	{
+		.type		= NX_CON_TYPE_NESL,
+		.caps		= NX_CON_CAP_DPAD,
+		.buttons	= nescon_button_mappings,
+		.simple_buttons	= nx_con_simple_procon_buttons,
+		.report		= nx_con_report_dpad_only,
+	},
+	{
+		.type		= NX_CON_TYPE_NESR,
+		.caps		= NX_CON_CAP_DPAD,
+		.buttons	= nescon_button_mappings,
+		.simple_buttons	= nx_con_simple_procon_buttons,
+		.report		= nx_con_report_dpad_only,
+	},
+	{
+		.type		= NX_CON_TYPE_SNES,
+		.caps		= NX_CON_CAP_DPAD,
+		.buttons	= snescon_button_mappings,
+		.simple_buttons	= nx_con_simple_procon_buttons,
+		.report		= nx_con_report_dpad_only,
+	},
+	{
+		.type		= NX_CON_TYPE_GEN,
+		.caps		= NX_CON_CAP_DPAD,
+		.buttons	= gencon_button_mappings,
+		.simple_buttons	= nx_con_simple_procon_buttons,
+		.report		= nx_con_report_dpad_only,
+	},
+	{
+		.type		= NX_CON_TYPE_N64,
+		.caps		= NX_CON_CAP_LEFT_STICK |
+				  NX_CON_CAP_DPAD |
+				  NX_CON_CAP_RUMBLE,
+		.buttons	= n64con_button_mappings,
+		.report		= nx_con_report_n64con,
+	},
+};
+
+/* For a controller of a type we don't know, which has nothing to report */
+static const struct nx_con_desc nx_con_unknown_desc = {
+	.report		= nx_con_report_nothing,
+};
+
+/* Resolves the controller's capabilities, once `con->type` is known */
+static void nx_con_select_desc(struct nx_con *con)
+{
+	int i;
+
+	con->desc = &nx_con_unknown_desc;
+	for (i = 0; i < ARRAY_SIZE(nx_con_descs); i++) {
+		if (nx_con_descs[i].type == con->type) {
+			con->desc = &nx_con_descs[i];
+			break;
+		}
+	}
+
+	con->caps = con->desc->caps;
+
+	/*
+	 * The charging grip always holds Joy-Cons, so it has their IMU and
+	 * rumble even if its type reply was unexpected. Its sticks and buttons
+	 * still depend on the type, which says how to decode them.
+	 */
+	if (nx_con_device_is_chrggrip(con))
+		con->caps |= NX_CON_CAP_IMU | NX_CON_CAP_RUMBLE;
+}
+
+/*
+ * The controller is asked for full reports (NX_CON_INPUT_IMU_DATA), which it
+ * sends continuously, unless it has a simple report layout and either it's
+ * idle (see nx_con_update_idle) or, for pads with nothing analog, the user
+ * asked for it. Simple reports (NX_CON_INPUT_BUTTON_EVENT) are only sent when
+ * an input changes, which saves a great deal of airtime and wakeups. "auto"
+ * never picks them for a pad that isn't idle.
+ */
+static u8 nx_con_choose_report_mode(struct nx_con *con)
+{
+	if (!con->desc || !con->desc->simple_buttons)
+		return NX_CON_INPUT_IMU_DATA;
+
+	/* otherwise analog inputs would go unreported; see nx_con_update_idle */
+	if (!nx_con_is_digital_only(con))
+		return con->idle ? NX_CON_INPUT_BUTTON_EVENT : NX_CON_INPUT_IMU_DATA;
+
+	/*
+	 * The NSO pads' simple reports are assumed to be laid out like the Pro
+	 * Controller's, which hasn't been verified on hardware. Until it has,
+	 * they only use the simple mode when asked to.
+	 */
+	switch (con->report_mode_pref) {
+	case NX_CON_REPORT_MODE_SIMPLE:
+		return NX_CON_INPUT_BUTTON_EVENT;
+	default:
+		return NX_CON_INPUT_IMU_DATA;
+	}
+}
+
+static int nx_con_set_report_mode(struct nx_con *con)
+{
+	struct nx_con_subcmd_request *req;
+	u8 buffer[sizeof(*req) + 1] = { 0 };
+	u8 mode = nx_con_choose_report_mode(con);
+	int ret;
+
+	req = (struct nx_con_subcmd_request *)buffer;
+	req->subcmd_id = NX_CON_SUBCMD_SET_REPORT_MODE;
+	req->data[0] = mode;
+
+	hid_dbg(con->hdev, "setting controller report mode 0x%02X\n", mode);
+	if (!(ret = nx_con_send_subcmd(con, req, 1, HZ, NULL)))
+		WRITE_ONCE(con->report_mode, mode);
+	return ret;
+}
+
+/*
+ * When set, a controller with analog inputs which sees no input for this many
+ * seconds (and whose IMU isn't in use) is switched to the simple report mode,
+ * like the NSO pads, until its next input. See nx_con_update_idle.
+ */
+static unsigned int idle_timeout;
+module_param(idle_timeout, uint, 0644);
+MODULE_PARM_DESC(idle_timeout, "Seconds without input before a controller only reports changes; 0 disables (default: 0)");
+
+/* How far a stick must move, in raw units, to count as input */
+#define NX_CON_IDLE_STICK_FUZZ		64
+
+static void nx_con_idle_worker(struct work_struct *work)
+{
+	struct nx_con *con = container_of(work, struct nx_con, idle_worker);
+	int ret;
+
+	mutex_lock(&con->features_mutex);
+	con->idle = READ_ONCE(con->idle_wanted);
+	if (nx_con_choose_report_mode(con) != con->report_mode) {
+		hid_dbg(con->hdev, "%s idle mode\n", con->idle ? "entering" : "leaving");
+		if ((ret = nx_con_set_report_mode(con)) && con->state != NX_CON_STATE_REMOVED)
+			hid_warn(con->hdev, "Failed to change report mode; ret=%d\n", ret);
+	}
+	mutex_unlock(&con->features_mutex);
+}
+
+static void nx_con_set_idle(struct nx_con *con, bool idle)
+{
+	if (con->idle_wanted == idle)
+		return;
+
+	WRITE_ONCE(con->idle_wanted, idle);
+	nx_con_queue_idle_worker(con);
+}
+
+static inline bool nx_con_can_idle(struct nx_con *con)
+{
+	return READ_ONCE(idle_timeout) &&
+	       con->desc->simple_buttons &&
+	       !nx_con_is_digital_only(con) &&
+	       !nx_con_using_usb(con) &&
+	       !READ_ONCE(con->imu_users);
+}
+
+/* Compares a stick to the reference, which is updated if it has moved */
+static bool nx_con_stick_moved(u16 *ref, u16 x, u16 y, int fuzz)
+{
+	if (abs(x - ref[0]) <= fuzz && abs(y - ref[1]) <= fuzz)
+		return false;
+
+	ref[0] = x;
+	ref[1] = y;
+	return true;
+}
+
+/*
+ * Tracks input activity in full reports, and puts the controller in idle mode
+ * once there hasn't been any for idle_timeout seconds. Stick noise within
+ * NX_CON_IDLE_STICK_FUZZ doesn't count as activity.
+ */
+static void nx_con_update_idle(struct nx_con *con,
+			       struct nx_con_input_report *rep,
+			       bool unchanged)
+{
+	bool active = !nx_con_can_idle(con);
+	u16 x;
+	u16 y;
+
+	if (!unchanged && !active) {
+		active = get_unaligned_le24(rep->button_status) != con->button_status;
+
+		if (con->caps & NX_CON_CAP_LEFT_STICK) {
+			x = hid_field_extract(con->hdev, rep->left_stick, 0, 12);
+			y = hid_field_extract(con->hdev, rep->left_stick + 1, 4, 12);
+			active |= nx_con_stick_moved(&con->idle_stick_ref[0], x, y,
+						     NX_CON_IDLE_STICK_FUZZ);
+		}
+		if (con->caps & NX_CON_CAP_RIGHT_STICK) {
+			x = hid_field_extract(con->hdev, rep->right_stick, 0, 12);
+			y = hid_field_extract(con->hdev, rep->right_stick + 1, 4, 12);
+			active |= nx_con_stick_moved(&con->idle_stick_ref[2], x, y,
+						     NX_CON_IDLE_STICK_FUZZ);
+		}
+	}
+
+	if (active) {
+		con->last_activity = con->event_time;
+		nx_con_set_idle(con, false);
+	} else if (!con->idle_wanted &&
+		   ktime_ms_delta(con->event_time, con->last_activity) >
+		   (s64)READ_ONCE(idle_timeout) * MSEC_PER_SEC) {
+		con->simple_stick_valid = false;
+		con->simple_hat = ARRAY_SIZE(nx_con_simple_hat_dpad);
+		nx_con_set_idle(con, true);
+	}
+}
+
+/*
+ * Any new input in a simple report ends idle mode. Sticks are compared with
+ * the first simple report after idling began, at the 16-bit scale simple
+ * reports use.
+ */
+static void nx_con_update_idle_simple(struct nx_con *con, const u8 *data, int size, bool changed)
+{
+	bool active = changed || data[3] != con->simple_hat;
+	int i;
+
+	con->simple_hat = data[3];
+
+	if (size >= 12) {
+		if (!con->simple_stick_valid) {
+			for (i = 0; i < 4; i++)
+				con->simple_stick_ref[i] = get_unaligned_le16(data + 4 + 2 * i);
+			con->simple_stick_valid = true;
+		} else {
+			for (i = 0; i < 4; i += 2)
+				active |= nx_con_stick_moved(&con->simple_stick_ref[i],
+							     get_unaligned_le16(data + 4 + 2 * i),
+							     get_unaligned_le16(data + 6 + 2 * i),
+							     NX_CON_IDLE_STICK_FUZZ << 4);
+		}
+	}
+
+	if (active) {
+		con->last_activity = con->event_time;
+		nx_con_set_idle(con, false);
+	}
+}
+
+static void nx_con_report_inputs(struct nx_con *con,
+				 struct nx_con_input_report *rep)
+{
+	u32 btns = get_unaligned_le24(rep->button_status);
+	u32 changed = btns ^ con->button_status;
+
+	con->button_status = btns;
+
+	con->desc->report(con, rep, btns, changed);
+	nx_con_report_buttons(con, btns, changed);
+
+	input_sync(con->idev);
+}
+
+static void nx_con_parse_report(struct nx_con *con, struct nx_con_input_report *rep)
+{
+	bool unchanged;
+
+	/* while nothing uses the IMU, it's off, and there's nothing to decode */
+	if (rep->id == NX_CON_INPUT_IMU_DATA && READ_ONCE(con->imu_users))
+		nx_con_report_imu(con, rep);
+
+	/* idle controllers send the same report over and over */
+	unchanged = nx_con_report_unchanged(con, rep);
+	nx_con_update_idle(con, rep, unchanged);
+	if (!unchanged) {
+		nx_con_parse_battery_status(con, rep);
+		nx_con_report_inputs(con, rep);
+	}
+
+	nx_con_update_report_interval(con);
+
+	/*
+	 * Immediately after receiving a report is the most reliable time to
+	 * send a subcommand to the controller. Wake any subcommand senders
+	 * waiting for a report.
+	 */
+	if (unlikely(smp_load_acquire(&con->input_report_wanted))) {
+		WRITE_ONCE(con->input_report_wanted, false);
+		complete(&con->input_report);
+	}
+}
+
+/* Decodes a report of the simple mode (see nx_con_choose_report_mode) */
+static void nx_con_parse_simple_report(struct nx_con *con, const u8 *data, int size)
+{
+	unsigned long raw = get_unaligned_le16(data + 1);
+	u8 hat = data[3];
+	u32 btns = 0;
+	u32 changed;
+	unsigned int bit;
+
+	for_each_set_bit(bit, &raw, NX_CON_NUM_SIMPLE_BUTTON_BITS)
+		btns |= con->desc->simple_buttons[bit];
+	if ((con->caps & NX_CON_CAP_DPAD) && hat < ARRAY_SIZE(nx_con_simple_hat_dpad))
+		btns |= nx_con_simple_hat_dpad[hat];
+
+	/* the next full report can't be compared with one from before this */
+	con->last_report_valid = false;
+
+	changed = btns ^ con->button_status;
+	if (READ_ONCE(con->idle))
+		nx_con_update_idle_simple(con, data, size, changed);
+	if (!changed)
+		return;
+	con->button_status = btns;
+
+	if (con->caps & NX_CON_CAP_DPAD)
+		nx_con_report_dpad(con, btns, changed);
+	nx_con_report_buttons(con, btns, changed);
+
+	input_sync(con->idev);
+}
+
+static int nx_con_send_rumble_data(struct nx_con *con)
+{
+	unsigned long flags;
+	struct nx_con_rumble_output rumble_output = { 0 };
+
+	spin_lock_irqsave(&con->lock, flags);
+	/*
+	 * If the controller has been removed, just return ENODEV so the LED
+	 * subsystem doesn't print invalid errors on removal.
+	 */
+	if (con->state == NX_CON_STATE_REMOVED) {
+		spin_unlock_irqrestore(&con->lock, flags);
+		return -ENODEV;
+	}
+	/* move on to the next queued frame, or else resend the last one */
+	if (!con->rumble_tail_unsent &&
+	    con->rumble_queue_tail != con->rumble_queue_head) {
+		if (++con->rumble_queue_tail >= NX_CON_RUMBLE_QUEUE_SIZE)
+			con->rumble_queue_tail = 0;
+	}
+	memcpy(rumble_output.rumble_data,
+	       con->rumble_data[con->rumble_queue_tail],
+	       NX_CON_RUMBLE_DATA_SIZE);
+	con->rumble_tail_unsent = false;
+	spin_unlock_irqrestore(&con->lock, flags);
+
+	rumble_output.output_id = NX_CON_OUTPUT_RUMBLE_ONLY;
+	rumble_output.packet_num = con->subcmd_num;
+	if (++con->subcmd_num > 0xF)
+		con->subcmd_num = 0;
+
+	nx_con_enforce_subcmd_rate(con);
+
+	return __nx_con_hid_send(con->hdev,
+				 (u8 *)&rumble_output,
+				 sizeof(rumble_output));
+}
+
+/*
+ * Sends the next rumble frame, or resends the last one if none are left.
+ * Called with output_mutex held.
+ */
+static void nx_con_output_rumble(struct nx_con *con)
+{
+	unsigned long flags;
+	int ret;
+
+	ret = nx_con_send_rumble_data(con);
+
+	/* -ENODEV means the controller was just unplugged */
+	spin_lock_irqsave(&con->lock, flags);
+	if (ret < 0 && ret != -ENODEV && con->state != NX_CON_STATE_REMOVED)
+		hid_warn(con->hdev, "Failed to set rumble; e=%d", ret);
+
+	con->rumble_last_sent = ktime_get();
+	/* frames pushed meanwhile are still due */
+	if (con->rumble_queue_tail == con->rumble_queue_head &&
+	    !con->rumble_tail_unsent)
+		WRITE_ONCE(con->rumble_pending, false);
+	spin_unlock_irqrestore(&con->lock, flags);
+}
+
+/*
+ * All output to the controller goes through here, so that it can be
+ * arbitrated. Rumble always goes first: while a subcommand is waiting on its
+ * reply, rumble frames keep going out on their own. Subcommands are sent one
+ * at a time in order of priority, each carrying the newest rumble frame.
+ */
+static void nx_con_output_worker(struct work_struct *work)
+{
+	struct nx_con *con = container_of(work, struct nx_con, output_worker);
+	struct nx_con_subcmd *cmd;
+	long timeout;
+	int ret;
+
+	mutex_lock(&con->output_mutex);
+	while (con->state != NX_CON_STATE_REMOVED) {
+		if (nx_con_poll_subcmd(con))
+			continue;
+
+		if (READ_ONCE(con->rumble_pending)) {
+			nx_con_output_rumble(con);
+			continue;
+		}
+
+		if (!con->subcmd_inflight) {
+			if (!(cmd = nx_con_dequeue_subcmd(con)))
+				break;
+
+			con->subcmd_retries = 1;
+			if ((ret = nx_con_send_subcmd_packet(con)) < 0)
+				nx_con_finish_subcmd(con, ret);
+			continue;
+		}
+
+		timeout = max_t(long, con->subcmd_deadline - jiffies, 1);
+		wait_event_timeout(con->wait,
+				   con->received_resp ||
+				   READ_ONCE(con->rumble_pending) ||
+				   con->state == NX_CON_STATE_REMOVED,
+				   timeout);
+	}
+	mutex_unlock(&con->output_mutex);
+}
+
+#if IS_ENABLED(CONFIG_NINTENDO_FF)
+/*
+ * Rather than searching the tables above for every rumble frame, these map
+ * each frequency (in Hz, from NX_CON_RUMBLE_TABLE_MIN_FREQ) and each amplitude
+ * directly to the index of the table entry to use. They are filled in once at
+ * module init by nx_con_init_rumble_tables.
+ */
+#define NX_CON_RUMBLE_TABLE_MIN_FREQ	41
+#define NX_CON_RUMBLE_TABLE_MAX_FREQ	1253
+
+static u8 nx_con_rumble_freq_index[NX_CON_RUMBLE_TABLE_MAX_FREQ -
+				   NX_CON_RUMBLE_TABLE_MIN_FREQ + 1] __ro_after_init;
+static u8 nx_con_rumble_amp_index[nx_con_max_rumble_amp + 1] __ro_after_init;
+
+/*
+ * Each frequency or amplitude maps to the first table entry which is greater
+ * than or equal to it, or to the last entry if there is none.
+ */
+static void __init nx_con_init_rumble_tables(void)
+{
+	const size_t freq_len = ARRAY_SIZE(nx_con_rumble_frequencies);
+	const size_t amp_len = ARRAY_SIZE(nx_con_rumble_amplitudes);
+	u16 freq;
+	u16 amp;
+	u8 i;
+
+	BUILD_BUG_ON(ARRAY_SIZE(nx_con_rumble_frequencies) > U8_MAX + 1);
+	BUILD_BUG_ON(ARRAY_SIZE(nx_con_rumble_amplitudes) > U8_MAX + 1);
+
+	i = 0;
+	for (freq = NX_CON_RUMBLE_TABLE_MIN_FREQ;
+	     freq <= NX_CON_RUMBLE_TABLE_MAX_FREQ;
+	     freq++) {
+		while (i < freq_len - 1 && freq > nx_con_rumble_frequencies[i].freq)
+			i++;
+		nx_con_rumble_freq_index[freq - NX_CON_RUMBLE_TABLE_MIN_FREQ] = i;
+	}
+
+	i = 0;
+	for (amp = 0; amp <= nx_con_max_rumble_amp; amp++) {
+		while (i < amp_len - 1 && amp > nx_con_rumble_amplitudes[i].amp)
+			i++;
+		nx_con_rumble_amp_index[amp] = i;
+	}
+}
+
+static const struct nx_con_rumble_freq_data *nx_con_find_rumble_freq(u16 freq)
+{
+	freq = clamp_t(u16, freq,
+		       NX_CON_RUMBLE_TABLE_MIN_FREQ,
+		       NX_CON_RUMBLE_TABLE_MAX_FREQ);
+
+	return &nx_con_rumble_frequencies[
+		nx_con_rumble_freq_index[freq - NX_CON_RUMBLE_TABLE_MIN_FREQ]];
+}
+
+static const struct nx_con_rumble_amp_data *nx_con_find_rumble_amp(u16 amp)
+{
+	amp = min_t(u16, amp, nx_con_max_rumble_amp);
+
+	return &nx_con_rumble_amplitudes[nx_con_rumble_amp_index[amp]];
+}
+
+static void nx_con_encode_rumble(u8 *data, const struct nx_con_rumble_side *side)
+{
+	const struct nx_con_rumble_freq_data *freq_data_low;
+	const struct nx_con_rumble_freq_data *freq_data_high;
+	const struct nx_con_rumble_amp_data *amp_data_low;
+	const struct nx_con_rumble_amp_data *amp_data_high;
+
+	freq_data_low = nx_con_find_rumble_freq(side->freq_low);
+	freq_data_high = nx_con_find_rumble_freq(side->freq_high);
+	amp_data_low = nx_con_find_rumble_amp(side->amp_low);
+	amp_data_high = nx_con_find_rumble_amp(side->amp_high);
+
+	data[0] = (freq_data_high->high >> 8) & 0xFF;
+	data[1] = (freq_data_high->high & 0xFF) + amp_data_high->high;
+	data[2] = freq_data_low->low + ((amp_data_low->low >> 8) & 0xFF);
+	data[3] = amp_data_low->low & 0xFF;
+}
+
+static const u16 NX_CON_MAX_RUMBLE_HIGH_FREQ	= 1253;
+static const u16 NX_CON_MIN_RUMBLE_HIGH_FREQ	= 82;
+static const u16 NX_CON_MAX_RUMBLE_LOW_FREQ	= 626;
+static const u16 NX_CON_MIN_RUMBLE_LOW_FREQ	= 41;
+
+static void nx_con_clamp_rumble_freqs(struct nx_con *con)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&con->lock, flags);
+	con->rumble_ll_freq = clamp(con->rumble_ll_freq,
+				    NX_CON_MIN_RUMBLE_LOW_FREQ,
+				    NX_CON_MAX_RUMBLE_LOW_FREQ);
+	con->rumble_lh_freq = clamp(con->rumble_lh_freq,
+				    NX_CON_MIN_RUMBLE_HIGH_FREQ,
+				    NX_CON_MAX_RUMBLE_HIGH_FREQ);
+	con->rumble_rl_freq = clamp(con->rumble_rl_freq,
+				    NX_CON_MIN_RUMBLE_LOW_FREQ,
+				    NX_CON_MAX_RUMBLE_LOW_FREQ);
+	con->rumble_rh_freq = clamp(con->rumble_rh_freq,
+				    NX_CON_MIN_RUMBLE_HIGH_FREQ,
+				    NX_CON_MAX_RUMBLE_HIGH_FREQ);
+	spin_unlock_irqrestore(&con->lock, flags);
+}
+
+/* Fills in default frequencies and keeps them within each band's range */
+static void nx_con_fixup_rumble_side(struct nx_con_rumble_side *side,
+				     u16 default_freq_low,
+				     u16 default_freq_high)
+{
+	if (!side->freq_low)
+		side->freq_low = default_freq_low;
+	if (!side->freq_high)
+		side->freq_high = default_freq_high;
+
+	side->freq_low = clamp(side->freq_low,
+			       NX_CON_MIN_RUMBLE_LOW_FREQ,
+			       NX_CON_MAX_RUMBLE_LOW_FREQ);
+	side->freq_high = clamp(side->freq_high,
+				NX_CON_MIN_RUMBLE_HIGH_FREQ,
+				NX_CON_MAX_RUMBLE_HIGH_FREQ);
+	side->amp_low = min_t(u16, side->amp_low, nx_con_max_rumble_amp);
+	side->amp_high = min_t(u16, side->amp_high, nx_con_max_rumble_amp);
+}
+
+/*
+ * Adds an encoded frame to the rumble queue and gets it on its way. Called
+ * with con->lock held.
+ */
+static void nx_con_push_rumble_frame(struct nx_con *con,
+				     const u8 *data,
+				     bool schedule_now)
+{
+	if (++con->rumble_queue_head >= NX_CON_RUMBLE_QUEUE_SIZE)
+		con->rumble_queue_head = 0;
+	memcpy(con->rumble_data[con->rumble_queue_head], data, NX_CON_RUMBLE_DATA_SIZE);
+
+	/*
+	 * In latest mode, frames which haven't gone out yet are dropped in
+	 * favor of this one, so that the controller never lags behind. Those
+	 * are the ones queued after the tail (left over from queue mode) and
+	 * the tail itself, unless it has been sent.
+	 */
+	if (con->rumble_mode == NX_CON_RUMBLE_MODE_LATEST) {
+		con->rumble_coalesced += (con->rumble_queue_head -
+					  con->rumble_queue_tail - 1 +
+					  NX_CON_RUMBLE_QUEUE_SIZE) %
+					 NX_CON_RUMBLE_QUEUE_SIZE;
+		if (con->rumble_tail_unsent)
+			con->rumble_coalesced++;
+		con->rumble_queue_tail = con->rumble_queue_head;
+		con->rumble_tail_unsent = true;
+	}
+
+	/* don't wait for the periodic send (reduces latency) */
+	if (schedule_now)
+		nx_con_queue_rumble(con);
+	nx_con_arm_rumble_timer(con);
+}
+
+/* Queues a rumble frame for both sides. Called with con->lock held. */
+static void nx_con_set_rumble_sides(struct nx_con *con,
+				    struct nx_con_rumble_side *left,
+				    struct nx_con_rumble_side *right,
+				    bool schedule_now)
+{
+	struct nx_con_rumble_memo *memo = &con->rumble_memo;
+	u8 data[NX_CON_RUMBLE_DATA_SIZE];
+	bool valid;
+
+	nx_con_fixup_rumble_side(left, con->rumble_ll_freq, con->rumble_lh_freq);
+	nx_con_fixup_rumble_side(right, con->rumble_rl_freq, con->rumble_rh_freq);
+
+	/* limit number of silent rumble packets to reduce traffic */
+	if (left->amp_low || left->amp_high || right->amp_low || right->amp_high)
+		con->rumble_zero_countdown = NX_CON_RUMBLE_ZERO_AMP_PKT_CNT;
+
+	/*
+	 * Games tend to set the same rumble over and over. If nothing has
+	 * changed since the last frame, the controller already has it, so
+	 * there's nothing to encode or send; the periodic refresh still
+	 * resends it as usual.
+	 */
+	valid = memo->valid;
+	if (valid &&
+	    !memcmp(&memo->left, left, sizeof(*left)) &&
+	    !memcmp(&memo->right, right, sizeof(*right))) {
+		nx_con_arm_rumble_timer(con);
+		return;
+	}
+
+	memo->left = *left;
+	memo->right = *right;
+	memo->valid = true;
+
+	/* right joy-con */
+	nx_con_encode_rumble(data + 4, right);
+
+	/* left joy-con */
+	nx_con_encode_rumble(data, left);
+
+	/* nearby amplitudes can still encode to the very same frame */
+	if (valid && !memcmp(data, memo->data, NX_CON_RUMBLE_DATA_SIZE)) {
+		nx_con_arm_rumble_timer(con);
+		return;
+	}
+	memcpy(memo->data, data, NX_CON_RUMBLE_DATA_SIZE);
+
+	nx_con_push_rumble_frame(con, data, schedule_now);
+}
+
+/* Sets both bands of each side to the same amplitude (0 to 0xFFFF) */
+static int nx_con_set_rumble(struct nx_con *con,
+			     u16 amp_r,
+			     u16 amp_l,
+			     bool schedule_now)
+{
+	struct nx_con_rumble_side left = { 0 };
+	struct nx_con_rumble_side right = { 0 };
+	unsigned long flags;
+
+	/* scale to the range of the amplitude table */
+	right.amp_low = amp_r * (u32)nx_con_max_rumble_amp / 65535;
+	right.amp_high = right.amp_low;
+	left.amp_low = amp_l * (u32)nx_con_max_rumble_amp / 65535;
+	left.amp_high = left.amp_low;
+
+	spin_lock_irqsave(&con->lock, flags);
+	nx_con_set_rumble_sides(con, &left, &right, schedule_now);
+	spin_unlock_irqrestore(&con->lock, flags);
+
+	return 0;
+}
+
+/*
+ * Force feedback
+ *
+ * Rather than going through ff-memless, effects are kept in a per-controller
+ * table and rendered straight into rumble frames: once whenever an effect is
+ * started, stopped or changed, and then every NX_CON_FF_PERIOD_US by ff_timer
+ * for as long as any effect is playing.
+ *
+ * FF_RUMBLE keeps its usual meaning here: the strong motor is the left side
+ * and the weak motor the right side, with both bands of each side driven
+ * alike. The other effects are panned between the sides by their direction.
+ * Periodic effects short enough to be heard as a tone (NX_CON_FF_MAX_TONE_MS)
+ * are played as one, at their own frequency on whichever band covers it;
+ * longer ones modulate the amplitude of both bands.
+ */
+static const u32 NX_CON_FF_PERIOD_US		= 25000;
+static const u16 NX_CON_FF_MAX_TONE_MS		= 1000 / 41;
+
+enum {
+	NX_CON_FF_LEFT,
+	NX_CON_FF_RIGHT,
+	NX_CON_FF_NUM_SIDES,
+};
+
+enum {
+	NX_CON_FF_BAND_LOW,
+	NX_CON_FF_BAND_HIGH,
+	NX_CON_FF_NUM_BANDS,
+};
+
+/* The sum of all playing effects, before gain */
+struct nx_con_ff_mix {
+	u32 amp[NX_CON_FF_NUM_SIDES][NX_CON_FF_NUM_BANDS]; /* 0xFFFF is full */
+	u16 freq[NX_CON_FF_NUM_SIDES][NX_CON_FF_NUM_BANDS]; /* 0 for default */
+	u32 freq_amp[NX_CON_FF_NUM_SIDES][NX_CON_FF_NUM_BANDS]; /* of freq's tone */
+};
+
+/* Applies an envelope to @level (0 to 0x7FFF), @t ms into a replay */
+static u32 nx_con_ff_envelope(const struct ff_envelope *env,
+			      u32 level,
+			      u32 t,
+			      u32 length)
+{
+	s32 attack_level = min_t(u32, env->attack_level, 0x7FFF);
+	s32 fade_level = min_t(u32, env->fade_level, 0x7FFF);
+	u32 remaining;
+
+	if (t < env->attack_length)
+		return attack_level +
+		       div_s64((s64)((s32)level - attack_level) * t,
+			       env->attack_length);
+
+	if (length && env->fade_length && t + env->fade_length > length) {
+		remaining = length > t ? length - t : 0;
+		return fade_level +
+		       div_s64((s64)((s32)level - fade_level) * remaining,
+			       env->fade_length);
+	}
+
+	return level;
+}
+
+/* Returns a waveform's value (-0x7FFF to 0x7FFF) at @phase (0 to 0xFFFF) */
+static s32 nx_con_ff_waveform(u16 waveform, u32 phase)
+{
+	switch (waveform) {
+	case FF_SQUARE:
+		return phase < 0x8000 ? 0x7FFF : -0x7FFF;
+	case FF_TRIANGLE:
+		if (phase < 0x8000)
+			return -0x7FFF + (s32)phase * 2;
+		return 0x7FFF - ((s32)phase - 0x8000) * 2;
+	case FF_SAW_UP:
+		return min_t(s32, (s32)phase - 0x7FFF, 0x7FFF);
+	case FF_SAW_DOWN:
+		return max_t(s32, 0x7FFF - (s32)phase, -0x7FFF);
+	case FF_SINE:
+	default:
+		return fixp_sin16(phase * 360 / 0x10000);
+	}
+}
+
+/* Adds @amp (0 to 0xFFFF) to both bands, panned by @direction */
+static void nx_con_ff_mix_panned(struct nx_con_ff_mix *mix,
+				 u16 direction,
+				 u32 amp,
+				 int band_mask)
+{
+	/* 0x4000 is to the left and 0xC000 to the right */
+	s32 pan = fixp_sin16(direction * 360 / 0x10000);
+	u32 weight[NX_CON_FF_NUM_SIDES];
+	int side;
+	int band;
+
+	weight[NX_CON_FF_LEFT] = pan < 0 ? 0x7FFF + pan : 0x7FFF;
+	weight[NX_CON_FF_RIGHT] = pan > 0 ? 0x7FFF - pan : 0x7FFF;
+
+	for (side = 0; side < NX_CON_FF_NUM_SIDES; side++) {
+		for (band = 0; band < NX_CON_FF_NUM_BANDS; band++) {
+			if (band_mask & BIT(band))
+				mix->amp[side][band] +=
+					amp * weight[side] / 0x7FFF;
+		}
+	}
+}
+
+static void nx_con_ff_mix_tone(struct nx_con_ff_mix *mix,
+			       u16 direction,
+			       u16 freq,
+			       u32 amp)
+{
+	int band = freq <= NX_CON_MAX_RUMBLE_LOW_FREQ ?
+		   NX_CON_FF_BAND_LOW : NX_CON_FF_BAND_HIGH;
+	int side;
+
+	nx_con_ff_mix_panned(mix, direction, amp, BIT(band));
+
+	/* the strongest tone on each band gets to pick its frequency */
+	for (side = 0; side < NX_CON_FF_NUM_SIDES; side++) {
+		if (amp > mix->freq_amp[side][band]) {
+			mix->freq_amp[side][band] = amp;
+			mix->freq[side][band] = freq;
+		}
+	}
+}
+
+/* Adds an effect's contribution, @t ms into its current replay */
+static void nx_con_ff_mix_effect(struct nx_con_ff_mix *mix,
+				 const struct ff_effect *effect,
+				 u32 t)
+{
+	const int both_bands = BIT(NX_CON_FF_BAND_LOW) | BIT(NX_CON_FF_BAND_HIGH);
+	u32 length = effect->replay.length;
+	const struct ff_periodic_effect *periodic;
+	s32 level;
+	u32 phase;
+
+	switch (effect->type) {
+	case FF_RUMBLE:
+		mix->amp[NX_CON_FF_LEFT][NX_CON_FF_BAND_LOW] +=
+			effect->u.rumble.strong_magnitude;
+		mix->amp[NX_CON_FF_LEFT][NX_CON_FF_BAND_HIGH] +=
+			effect->u.rumble.strong_magnitude;
+		mix->amp[NX_CON_FF_RIGHT][NX_CON_FF_BAND_LOW] +=
+			effect->u.rumble.weak_magnitude;
+		mix->amp[NX_CON_FF_RIGHT][NX_CON_FF_BAND_HIGH] +=
+			effect->u.rumble.weak_magnitude;
+		break;
+	case FF_CONSTANT:
+		level = nx_con_ff_envelope(&effect->u.constant.envelope,
+					   abs(effect->u.constant.level),
+					   t, length);
+		nx_con_ff_mix_panned(mix, effect->direction, level * 2, both_bands);
+		break;
+	case FF_RAMP:
+		level = effect->u.ramp.start_level;
+		if (length)
+			level += div_s64((s64)((s32)effect->u.ramp.end_level - level) *
+					 min(t, length),
+					 length);
+		level = nx_con_ff_envelope(&effect->u.ramp.envelope,
+					   abs(level), t, length);
+		nx_con_ff_mix_panned(mix, effect->direction, level * 2, both_bands);
+		break;
+	case FF_PERIODIC:
+		periodic = &effect->u.periodic;
+		level = nx_con_ff_envelope(&periodic->envelope,
+					   abs(periodic->magnitude),
+					   t, length);
+
+		if (periodic->period && periodic->period <= NX_CON_FF_MAX_TONE_MS) {
+			nx_con_ff_mix_tone(mix, effect->direction,
+					   1000 / periodic->period, level * 2);
+			break;
+		}
+
+		phase = periodic->phase;
+		if (periodic->period)
+			phase += t % periodic->period * 0x10000 / periodic->period;
+		level = periodic->offset +
+			level * nx_con_ff_waveform(periodic->waveform,
+						   phase & 0xFFFF) / 0x7FFF;
+		level = min(abs(level), 0x7FFF);
+		nx_con_ff_mix_panned(mix, effect->direction, level * 2, both_bands);
+		break;
+	}
+}
+
+/*
+ * Renders every playing effect into a rumble frame. Returns true for as long
+ * as any effect is still playing (or waiting out its delay), i.e., for as long
+ * as it needs to be called again. Called with con->lock held.
+ */
+static bool nx_con_ff_render(struct nx_con *con)
+{
+	struct nx_con_rumble_side sides[NX_CON_FF_NUM_SIDES] = { 0 };
+	struct nx_con_ff_mix mix = { 0 };
+	struct nx_con_ff_effect *ffe;
+	ktime_t now = ktime_get();
+	bool active = false;
+	u32 length;
+	u32 amp;
+	int side;
+	int i;
+
+	for (i = 0; i < NX_CON_FF_MAX_EFFECTS; i++) {
+		ffe = &con->ff_effects[i];
+		if (!ffe->playing)
+			continue;
+
+		length = ffe->effect.replay.length;
+		if (length && !ktime_before(now, ktime_add_ms(ffe->start, length))) {
+			/* this replay is over; start the next, if any */
+			if (--ffe->repeat <= 0) {
+				ffe->playing = false;
+				continue;
+			}
+			ffe->start = ktime_add_ms(ffe->start,
+						  length + ffe->effect.replay.delay);
+		}
+
+		active = true;
+		if (ktime_before(now, ffe->start))
+			continue;
+
+		nx_con_ff_mix_effect(&mix, &ffe->effect,
+				     ktime_ms_delta(now, ffe->start));
+	}
+
+	for (side = 0; side < NX_CON_FF_NUM_SIDES; side++) {
+		amp = min_t(u32, mix.amp[side][NX_CON_FF_BAND_LOW], 0xFFFF);
+		amp = amp * con->ff_gain / 0xFFFF;
+		sides[side].amp_low = amp * nx_con_max_rumble_amp / 0xFFFF;
+		sides[side].freq_low = mix.freq[side][NX_CON_FF_BAND_LOW];
+
+		amp = min_t(u32, mix.amp[side][NX_CON_FF_BAND_HIGH], 0xFFFF);
+		amp = amp * con->ff_gain / 0xFFFF;
+		sides[side].amp_high = amp * nx_con_max_rumble_amp / 0xFFFF;
+		sides[side].freq_high = mix.freq[side][NX_CON_FF_BAND_HIGH];
+	}
+
+	/* effects keep playing, unheard, while userspace streams rumble */
+	if (!con->rumble_streaming)
+		nx_con_set_rumble_sides(con,
+					&sides[NX_CON_FF_LEFT],
+					&sides[NX_CON_FF_RIGHT],
+					true);
+
+	return active;
+}
+
+static enum hrtimer_restart nx_con_ff_timer(struct hrtimer *timer)
+{
+	struct nx_con *con = container_of(timer, struct nx_con, ff_timer);
+	enum hrtimer_restart restart = HRTIMER_NORESTART;
+	unsigned long flags;
+
+	spin_lock_irqsave(&con->lock, flags);
+	if (con->state != NX_CON_STATE_REMOVED && nx_con_ff_render(con)) {
+		hrtimer_forward_now(timer, us_to_ktime(NX_CON_FF_PERIOD_US));
+		restart = HRTIMER_RESTART;
+	}
+	con->ff_timer_armed = restart == HRTIMER_RESTART;
+	spin_unlock_irqrestore(&con->lock, flags);
+
+	return restart;
+}
+
+/*
+ * Renders a frame right away, so that changes don't wait for the next tick,
+ * and keeps ff_timer going while anything is playing. Called with con->lock
+ * held.
+ */
+static void nx_con_ff_update(struct nx_con *con)
+{
+	if (!nx_con_ff_render(con) ||
+	    con->ff_timer_armed ||
+	    con->state == NX_CON_STATE_REMOVED)
+		return;
+
+	con->ff_timer_armed = true;
+	hrtimer_start(&con->ff_timer,
+		      us_to_ktime(NX_CON_FF_PERIOD_US),
+		      HRTIMER_MODE_REL);
+}
+
+static int nx_con_ff_upload(struct input_dev *idev,
+			    struct ff_effect *effect,
+			    struct ff_effect *old)
+{
+	struct nx_con *con = input_get_drvdata(idev);
+	struct nx_con_ff_effect *ffe;
+	unsigned long flags;
+
+	if (effect->id < 0 || effect->id >= NX_CON_FF_MAX_EFFECTS)
+		return -EINVAL;
+
+	if (effect->type == FF_PERIODIC &&
+	    effect->u.periodic.waveform == FF_CUSTOM)
+		return -EINVAL;
+
+	if (!test_and_set_bit(NX_CON_RUMBLE_USER_FF, &con->rumble_users))
+		nx_con_update_features(con, true);
+
+	spin_lock_irqsave(&con->lock, flags);
+	ffe = &con->ff_effects[effect->id];
+	ffe->effect = *effect;
+	/* an effect that's playing is changed in place */
+	if (ffe->playing)
+		nx_con_ff_update(con);
+	spin_unlock_irqrestore(&con->lock, flags);
+
+	return 0;
+}
+
+static int nx_con_ff_erase(struct input_dev *idev, int effect_id)
+{
+	struct nx_con *con = input_get_drvdata(idev);
+	struct nx_con_ff_effect *ffe;
+	unsigned long flags;
+	bool was_playing;
+
+	spin_lock_irqsave(&con->lock, flags);
+	ffe = &con->ff_effects[effect_id];
+	was_playing = ffe->playing;
+	memset(ffe, 0, sizeof(*ffe));
+	if (was_playing)
+		nx_con_ff_update(con);
+	spin_unlock_irqrestore(&con->lock, flags);
+
+	return 0;
+}
+
+static int nx_con_ff_playback(struct input_dev *idev, int effect_id, int value)
+{
+	struct nx_con *con = input_get_drvdata(idev);
+	struct nx_con_ff_effect *ffe;
+	unsigned long flags;
+
+	spin_lock_irqsave(&con->lock, flags);
+	ffe = &con->ff_effects[effect_id];
+	if (value > 0) {
+		ffe->playing = true;
+		ffe->repeat = value;
+		ffe->start = ktime_add_ms(ktime_get(), ffe->effect.replay.delay);
+	} else {
+		ffe->playing = false;
+	}
+	nx_con_ff_update(con);
+	spin_unlock_irqrestore(&con->lock, flags);
+
+	return 0;
+}
+
+/* The input core has erased every effect by now; see input_ff_flush() */
+static void nx_con_idev_close(struct input_dev *idev)
+{
+	struct nx_con *con = input_get_drvdata(idev);
+
+	if (test_and_clear_bit(NX_CON_RUMBLE_USER_FF, &con->rumble_users))
+		nx_con_update_features(con, true);
+}
+
+static void nx_con_ff_set_gain(struct input_dev *idev, u16 gain)
+{
+	struct nx_con *con = input_get_drvdata(idev);
+	unsigned long flags;
 
-	for (button = button_mappings; button->code; button++)
-		input_report_key(con->idev, button->code, status & button->bit);
+	spin_lock_irqsave(&con->lock, flags);
+	con->ff_gain = gain;
+	nx_con_ff_update(con);
+	spin_unlock_irqrestore(&con->lock, flags);
 }
 
-static void nx_con_parse_report(struct nx_con *con, struct nx_con_input_report *rep)
+/*
+ * Rumble streaming
+ *
+ * Each controller with rumble gets a misc device, /dev/hid-nx-rumble<N>, to
+ * which userspace can write raw, pre-encoded rumble frames, each with the time
+ * at which it should be sent. The frames are queued in order and stream_timer
+ * hands each one to the output worker when it falls due, so they go out
+ * through the same path as any other rumble frame, in step with subcommands,
+ * and no faster than the link allows. If several frames are due at once, only
+ * the newest is sent.
+ *
+ * Only one process may hold the device open. Force feedback is muted while it
+ * does, and picks up where it is once the device is closed. Reading the device
+ * returns a struct nx_con_rumble_stream_stats.
+ */
+static enum hrtimer_restart nx_con_stream_timer(struct hrtimer *timer)
 {
+	struct nx_con *con = container_of(timer, struct nx_con, stream_timer);
+	struct nx_con_rumble_stream *stream = con->stream;
+	struct nx_con_rumble_stream_frame frame;
+	struct nx_con_rumble_stream_frame next;
+	enum hrtimer_restart restart = HRTIMER_NORESTART;
+	u64 now = ktime_get_ns();
 	unsigned long flags;
+	bool due = false;
+
+	spin_lock_irqsave(&stream->lock, flags);
+	while (kfifo_peek(&stream->fifo, &next) && next.timestamp_ns <= now) {
+		kfifo_skip(&stream->fifo);
+		if (due)
+			stream->stats.dropped++;
+		frame = next;
+		due = true;
+	}
+
+	if (due) {
+		stream->stats.sent++;
+		if (now - frame.timestamp_ns > NX_CON_OUTPUT_PERIOD_US * NSEC_PER_USEC)
+			stream->stats.late++;
+	}
 
-	if (nx_con_has_rumble(con))
-		nx_con_handle_rumble_report(con, rep);
+	if (!kfifo_is_empty(&stream->fifo)) {
+		hrtimer_set_expires(timer, ns_to_ktime(next.timestamp_ns));
+		restart = HRTIMER_RESTART;
+	} else if (due) {
+		stream->stats.underruns++;
+	}
+	con->stream_timer_armed = restart == HRTIMER_RESTART;
+	spin_unlock_irqrestore(&stream->lock, flags);
 
-	nx_con_parse_battery_status(con, rep);
+	if (!due)
+		return restart;
 
-	if (rep->id == NX_CON_INPUT_IMU_DATA && nx_con_has_imu(con))
-		nx_con_report_imu(con, rep);
+	wake_up(&stream->wait);
 
-	if (nx_con_type_is_left_joycon(con)) {
-		nx_con_report_left_stick(con, rep);
-		nx_con_report_buttons(con, rep, left_joycon_button_mappings);
-		if (!nx_con_device_is_chrggrip(con))
-			nx_con_report_buttons(con, rep, left_joycon_s_button_mappings);
-	} else if (nx_con_type_is_right_joycon(con)) {
-		nx_con_report_right_stick(con, rep);
-		nx_con_report_buttons(con, rep, right_joycon_button_mappings);
-		if (!nx_con_device_is_chrggrip(con))
-			nx_con_report_buttons(con, rep, right_joycon_s_button_mappings);
-	} else if (nx_con_type_is_procon(con)) {
-		nx_con_report_left_stick(con, rep);
-		nx_con_report_right_stick(con, rep);
-		nx_con_report_dpad(con, rep);
-		nx_con_report_buttons(con, rep, procon_button_mappings);
-	} else if (nx_con_type_is_any_nescon(con)) {
-		nx_con_report_dpad(con, rep);
-		nx_con_report_buttons(con, rep, nescon_button_mappings);
-	} else if (nx_con_type_is_snescon(con)) {
-		nx_con_report_dpad(con, rep);
-		nx_con_report_buttons(con, rep, snescon_button_mappings);
-	} else if (nx_con_type_is_gencon(con)) {
-		nx_con_report_dpad(con, rep);
-		nx_con_report_buttons(con, rep, gencon_button_mappings);
-	} else if (nx_con_type_is_n64con(con)) {
-		nx_con_report_left_stick(con, rep);
-		nx_con_report_dpad(con, rep);
-		nx_con_report_buttons(con, rep, n64con_button_mappings);
+	spin_lock_irqsave(&con->lock, flags);
+	if (con->state != NX_CON_STATE_REMOVED) {
+		/* the memo only describes frames encoded by the driver */
+		con->rumble_memo.valid = false;
+		con->rumble_zero_countdown = NX_CON_RUMBLE_ZERO_AMP_PKT_CNT;
+		nx_con_push_rumble_frame(con, frame.data, true);
 	}
+	spin_unlock_irqrestore(&con->lock, flags);
 
-	input_sync(con->idev);
+	return restart;
+}
 
-	/*
-	 * Immediately after receiving a report is the most reliable time to
-	 * send a subcommand to the controller. Wake any subcommand senders
-	 * waiting for a report.
-	 */
-	if (unlikely(mutex_is_locked(&con->output_mutex))) {
-		spin_lock_irqsave(&con->lock, flags);
-		con->received_input_report = true;
-		spin_unlock_irqrestore(&con->lock, flags);
-		wake_up(&con->wait);
-	}
+static void nx_con_stream_free(struct kref *kref)
+{
+	kfree(container_of(kref, struct nx_con_rumble_stream, kref));
 }
 
-static int nx_con_send_rumble_data(struct nx_con *con)
+static int nx_con_stream_open(struct inode *inode, struct file *file)
 {
+	struct nx_con_rumble_stream *stream = container_of(file->private_data,
+							   struct nx_con_rumble_stream,
+							   misc);
+	struct nx_con *con;
 	unsigned long flags;
-	struct nx_con_rumble_output rumble_output = { 0 };
+	int ret = 0;
 
-	spin_lock_irqsave(&con->lock, flags);
-	/*
-	 * If the controller has been removed, just return ENODEV so the LED
-	 * subsystem doesn't print invalid errors on removal.
-	 */
-	if (con->state == NX_CON_STATE_REMOVED) {
+	if (test_and_set_bit(0, &stream->open))
+		return -EBUSY;
+
+	mutex_lock(&stream->mutex);
+	if ((con = stream->con)) {
+		/* once con is cleared, nx_con_stream_destroy may free the stream */
+		kref_get(&stream->kref);
+
+		spin_lock_irqsave(&stream->lock, flags);
+		memset(&stream->stats, 0, sizeof(stream->stats));
+		spin_unlock_irqrestore(&stream->lock, flags);
+
+		spin_lock_irqsave(&con->lock, flags);
+		con->rumble_streaming = true;
 		spin_unlock_irqrestore(&con->lock, flags);
-		return -ENODEV;
+
+		set_bit(NX_CON_RUMBLE_USER_STREAM, &con->rumble_users);
+		nx_con_update_features(con, true);
+	} else {
+		ret = -ENODEV;
 	}
-	memcpy(rumble_output.rumble_data,
-	       con->rumble_data[con->rumble_queue_tail],
-	       NX_CON_RUMBLE_DATA_SIZE);
-	spin_unlock_irqrestore(&con->lock, flags);
+	mutex_unlock(&stream->mutex);
 
-	rumble_output.output_id = NX_CON_OUTPUT_RUMBLE_ONLY;
-	rumble_output.packet_num = con->subcmd_num;
-	if (++con->subcmd_num > 0xF)
-		con->subcmd_num = 0;
+	if (ret) {
+		clear_bit(0, &stream->open);
+		return ret;
+	}
 
-	nx_con_enforce_subcmd_rate(con);
+	file->private_data = stream;
 
-	return __nx_con_hid_send(con->hdev,
-				 (u8 *)&rumble_output,
-				 sizeof(rumble_output));
+	return stream_open(inode, file);
 }
 
-static void nx_con_rumble_worker(struct work_struct *work)
+static int nx_con_stream_release(struct inode *inode, struct file *file)
 {
-	struct nx_con *con = container_of(work, struct nx_con, rumble_worker);
+	struct nx_con_rumble_stream *stream = file->private_data;
+	struct nx_con *con;
 	unsigned long flags;
-	bool again = true;
-	int ret;
 
-	while (again) {
-		mutex_lock(&con->output_mutex);
-		ret = nx_con_send_rumble_data(con);
-		mutex_unlock(&con->output_mutex);
+	mutex_lock(&stream->mutex);
+	if ((con = stream->con)) {
+		hrtimer_cancel(&con->stream_timer);
 
-		/* -ENODEV means the controller was just unplugged */
-		spin_lock_irqsave(&con->lock, flags);
-		if (ret < 0 && ret != -ENODEV && con->state != NX_CON_STATE_REMOVED)
-			hid_warn(con->hdev, "Failed to set rumble; e=%d", ret);
+		spin_lock_irqsave(&stream->lock, flags);
+		kfifo_reset(&stream->fifo);
+		con->stream_timer_armed = false;
+		spin_unlock_irqrestore(&stream->lock, flags);
 
-		con->rumble_msecs = jiffies_to_msecs(jiffies);
-		if (con->rumble_queue_tail != con->rumble_queue_head) {
-			if (++con->rumble_queue_tail >= NX_CON_RUMBLE_QUEUE_SIZE)
-				con->rumble_queue_tail = 0;
-		} else {
-			again = false;
-		}
+		/* go back to whatever force feedback is playing, if anything */
+		spin_lock_irqsave(&con->lock, flags);
+		con->rumble_streaming = false;
+		nx_con_ff_update(con);
 		spin_unlock_irqrestore(&con->lock, flags);
+
+		clear_bit(NX_CON_RUMBLE_USER_STREAM, &con->rumble_users);
+		nx_con_update_features(con, true);
 	}
+	mutex_unlock(&stream->mutex);
+
+	clear_bit(0, &stream->open);
+	kref_put(&stream->kref, nx_con_stream_free);
+
+	return 0;
 }
 
-#if IS_ENABLED(CONFIG_NINTENDO_FF)
-static struct nx_con_rumble_freq_data nx_con_find_rumble_freq(u16 freq)
+static ssize_t nx_con_stream_read(struct file *file,
+				  char __user *buf,
+				  size_t count,
+				  loff_t *ppos)
 {
-	const size_t length = ARRAY_SIZE(nx_con_rumble_frequencies);
-	const struct nx_con_rumble_freq_data *data = nx_con_rumble_frequencies;
-	int i = 0;
+	struct nx_con_rumble_stream *stream = file->private_data;
+	struct nx_con_rumble_stream_stats stats;
+	unsigned long flags;
 
-	if (freq > data[0].freq) {
-		for (i = 1; i < length - 1; i++) {
-			if (freq > data[i - 1].freq && freq <= data[i].freq)
-				break;
-		}
-	}
+	if (count < sizeof(stats))
+		return -EINVAL;
+
+	spin_lock_irqsave(&stream->lock, flags);
+	stats = stream->stats;
+	stats.queued = kfifo_len(&stream->fifo);
+	spin_unlock_irqrestore(&stream->lock, flags);
 
-	return data[i];
+	if (copy_to_user(buf, &stats, sizeof(stats)))
+		return -EFAULT;
+
+	return sizeof(stats);
 }
 
-static struct nx_con_rumble_amp_data nx_con_find_rumble_amp(u16 amp)
+/*
+ * Queues whole frames only. Blocks while the queue is full, unless the device
+ * was opened with O_NONBLOCK, and returns early once some frames are queued.
+ */
+static ssize_t nx_con_stream_write(struct file *file,
+				   const char __user *buf,
+				   size_t count,
+				   loff_t *ppos)
 {
-	const size_t length = ARRAY_SIZE(nx_con_rumble_amplitudes);
-	const struct nx_con_rumble_amp_data *data = nx_con_rumble_amplitudes;
-	int i = 0;
+	struct nx_con_rumble_stream *stream = file->private_data;
+	struct nx_con_rumble_stream_frame frame;
+	struct nx_con *con;
+	unsigned long flags;
+	size_t written = 0;
+	int ret = 0;
+
+	if (!count || count % sizeof(frame))
+		return -EINVAL;
+
+	if ((ret = mutex_lock_interruptible(&stream->mutex)))
+		return ret;
 
-	if (amp > data[0].amp) {
-		for (i = 1; i < length - 1; i++) {
-			if (amp > data[i - 1].amp && amp <= data[i].amp)
+	while (written < count) {
+		if (!(con = stream->con)) {
+			ret = -ENODEV;
+			break;
+		}
+
+		if (kfifo_is_full(&stream->fifo)) {
+			if (written)
+				break;
+			if (file->f_flags & O_NONBLOCK) {
+				ret = -EAGAIN;
 				break;
+			}
+
+			mutex_unlock(&stream->mutex);
+			if ((ret = wait_event_interruptible(stream->wait,
+							    READ_ONCE(stream->gone) ||
+							    !kfifo_is_full(&stream->fifo))))
+				return ret;
+			if ((ret = mutex_lock_interruptible(&stream->mutex)))
+				return ret;
+			continue;
 		}
-	}
 
-	return data[i];
-}
+		if (copy_from_user(&frame, buf + written, sizeof(frame))) {
+			ret = -EFAULT;
+			break;
+		}
 
-static void nx_con_encode_rumble(u8 *data, u16 freq_low, u16 freq_high, u16 amp)
-{
-	struct nx_con_rumble_freq_data freq_data_low;
-	struct nx_con_rumble_freq_data freq_data_high;
-	struct nx_con_rumble_amp_data amp_data;
+		spin_lock_irqsave(&stream->lock, flags);
+		kfifo_put(&stream->fifo, frame);
+		if (!con->stream_timer_armed) {
+			con->stream_timer_armed = true;
+			hrtimer_start(&con->stream_timer,
+				      ns_to_ktime(frame.timestamp_ns),
+				      HRTIMER_MODE_ABS);
+		}
+		spin_unlock_irqrestore(&stream->lock, flags);
 
-	freq_data_low = nx_con_find_rumble_freq(freq_low);
-	freq_data_high = nx_con_find_rumble_freq(freq_high);
-	amp_data = nx_con_find_rumble_amp(amp);
+		written += sizeof(frame);
+	}
+	mutex_unlock(&stream->mutex);
 
-	data[0] = (freq_data_high.high >> 8) & 0xFF;
-	data[1] = (freq_data_high.high & 0xFF) + amp_data.high;
-	data[2] = freq_data_low.low + ((amp_data.low >> 8) & 0xFF);
-	data[3] = amp_data.low & 0xFF;
+	return written ? written : ret;
 }
 
-static const u16 NX_CON_MAX_RUMBLE_HIGH_FREQ	= 1253;
-static const u16 NX_CON_MIN_RUMBLE_HIGH_FREQ	= 82;
-static const u16 NX_CON_MAX_RUMBLE_LOW_FREQ	= 626;
-static const u16 NX_CON_MIN_RUMBLE_LOW_FREQ	= 41;
-
-static void nx_con_clamp_rumble_freqs(struct nx_con *con)
+static __poll_t nx_con_stream_poll(struct file *file, poll_table *wait)
 {
-	unsigned long flags;
+	struct nx_con_rumble_stream *stream = file->private_data;
+	__poll_t mask = EPOLLIN | EPOLLRDNORM;
 
-	spin_lock_irqsave(&con->lock, flags);
-	con->rumble_ll_freq = clamp(con->rumble_ll_freq,
-				    NX_CON_MIN_RUMBLE_LOW_FREQ,
-				    NX_CON_MAX_RUMBLE_LOW_FREQ);
-	con->rumble_lh_freq = clamp(con->rumble_lh_freq,
-				    NX_CON_MIN_RUMBLE_HIGH_FREQ,
-				    NX_CON_MAX_RUMBLE_HIGH_FREQ);
-	con->rumble_rl_freq = clamp(con->rumble_rl_freq,
-				    NX_CON_MIN_RUMBLE_LOW_FREQ,
-				    NX_CON_MAX_RUMBLE_LOW_FREQ);
-	con->rumble_rh_freq = clamp(con->rumble_rh_freq,
-				    NX_CON_MIN_RUMBLE_HIGH_FREQ,
-				    NX_CON_MAX_RUMBLE_HIGH_FREQ);
-	spin_unlock_irqrestore(&con->lock, flags);
-}
+	poll_wait(file, &stream->wait, wait);
 
-static int nx_con_set_rumble(struct nx_con *con,
-			     u16 amp_r,
-			     u16 amp_l,
-			     bool schedule_now)
-{
-	u8 data[NX_CON_RUMBLE_DATA_SIZE];
-	u16 amp;
-	u16 freq_r_low;
-	u16 freq_r_high;
-	u16 freq_l_low;
-	u16 freq_l_high;
-	unsigned long flags;
+	if (READ_ONCE(stream->gone))
+		return EPOLLHUP | EPOLLERR;
 
-	spin_lock_irqsave(&con->lock, flags);
-	freq_r_low = con->rumble_rl_freq;
-	freq_r_high = con->rumble_rh_freq;
-	freq_l_low = con->rumble_ll_freq;
-	freq_l_high = con->rumble_lh_freq;
-	/* limit number of silent rumble packets to reduce traffic */
-	if (amp_l != 0 || amp_r != 0)
-		con->rumble_zero_countdown = NX_CON_RUMBLE_ZERO_AMP_PKT_CNT;
-	spin_unlock_irqrestore(&con->lock, flags);
+	if (!kfifo_is_full(&stream->fifo))
+		mask |= EPOLLOUT | EPOLLWRNORM;
 
-	/* right joy-con */
-	amp = amp_r * (u32)nx_con_max_rumble_amp / 65535;
-	nx_con_encode_rumble(data + 4, freq_r_low, freq_r_high, amp);
+	return mask;
+}
 
-	/* left joy-con */
-	amp = amp_l * (u32)nx_con_max_rumble_amp / 65535;
-	nx_con_encode_rumble(data, freq_l_low, freq_l_high, amp);
+static const struct file_operations nx_con_stream_fops = {
+	.owner		= THIS_MODULE,
+	.open		= nx_con_stream_open,
+	.read		= nx_con_stream_read,
+	.write		= nx_con_stream_write,
+	.poll		= nx_con_stream_poll,
+	.release	= nx_con_stream_release,
+};
 
-	spin_lock_irqsave(&con->lock, flags);
-	if (++con->rumble_queue_head >= NX_CON_RUMBLE_QUEUE_SIZE)
-		con->rumble_queue_head = 0;
-	memcpy(con->rumble_data[con->rumble_queue_head], data, NX_CON_RUMBLE_DATA_SIZE);
-	spin_unlock_irqrestore(&con->lock, flags);
+static int nx_con_stream_create(struct nx_con *con)
+{
+	struct nx_con_rumble_stream *stream;
+	int ret;
 
-	/* don't wait for the periodic send (reduces latency) */
-	if (schedule_now)
-		queue_work(con->rumble_queue, &con->rumble_worker);
+	if (!(stream = kzalloc(sizeof(*stream), GFP_KERNEL)))
+		return -ENOMEM;
+
+	kref_init(&stream->kref);
+	mutex_init(&stream->mutex);
+	spin_lock_init(&stream->lock);
+	INIT_KFIFO(stream->fifo);
+	init_waitqueue_head(&stream->wait);
+	stream->con = con;
+
+	snprintf(stream->name, sizeof(stream->name),
+		 "hid-nx-rumble%d", con->player_id);
+	stream->misc.minor = MISC_DYNAMIC_MINOR;
+	stream->misc.name = stream->name;
+	stream->misc.fops = &nx_con_stream_fops;
+	stream->misc.parent = &con->hdev->dev;
+
+	con->stream = stream;
+	if ((ret = misc_register(&stream->misc))) {
+		con->stream = NULL;
+		kfree(stream);
+		return ret;
+	}
 
 	return 0;
 }
 
-static int nx_con_play_effect(struct input_dev *idev,
-                              void *data,
-			      struct ff_effect *effect)
+/*
+ * Detaches the stream device from its controller. Whoever still has it open
+ * gets -ENODEV from then on.
+ */
+static void nx_con_stream_destroy(struct nx_con *con)
 {
-	struct nx_con *con = input_get_drvdata(idev);
+	struct nx_con_rumble_stream *stream = con->stream;
+
+	if (!stream)
+		return;
 
-	if (effect->type != FF_RUMBLE)
-		return 0;
+	misc_deregister(&stream->misc);
 
-	return nx_con_set_rumble(con,
-				 effect->u.rumble.weak_magnitude,
-				 effect->u.rumble.strong_magnitude,
-				 true);
+	mutex_lock(&stream->mutex);
+	stream->con = NULL;
+	WRITE_ONCE(stream->gone, true);
+	mutex_unlock(&stream->mutex);
+
+	hrtimer_cancel(&con->stream_timer);
+	wake_up_all(&stream->wait);
+
+	con->stream = NULL;
+	kref_put(&stream->kref, nx_con_stream_free);
 }
 #endif /* IS_ENABLED(CONFIG_NINTENDO_FF) */
 
@@ -1920,20 +4362,42 @@ static void nx_con_config_dpad(struct input_dev *idev)
 			     NX_CON_DPAD_FLAT);
 }
 
-static void nx_con_config_buttons(struct input_dev *idev,
-                                  const struct nx_con_button_mapping button_mappings[])
+/* Also maps each button's bit to its keycode, for nx_con_report_buttons */
+static void nx_con_config_buttons(struct nx_con *con,
+				  const struct nx_con_button_mapping button_mappings[])
 {
 	const struct nx_con_button_mapping *button;
 
-	for (button = button_mappings; button->code; button++)
-		input_set_capability(idev, EV_KEY, button->code);
+	for (button = button_mappings; button->code; button++) {
+		input_set_capability(con->idev, EV_KEY, button->code);
+		con->button_codes[__ffs(button->bit)] = button->code;
+	}
 }
 
-static void nx_con_config_rumble(struct nx_con *con)
+static int nx_con_config_rumble(struct nx_con *con)
 {
 #if IS_ENABLED(CONFIG_NINTENDO_FF)
-	input_set_capability(con->idev, EV_FF, FF_RUMBLE);
-	input_ff_create_memless(con->idev, NULL, nx_con_play_effect);
+	static const unsigned int ff_caps[] = {
+		FF_RUMBLE, FF_PERIODIC, FF_CONSTANT, FF_RAMP, FF_GAIN,
+		FF_SINE, FF_SQUARE, FF_TRIANGLE, FF_SAW_UP, FF_SAW_DOWN,
+	};
+	struct ff_device *ff;
+	int ret;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(ff_caps); i++)
+		input_set_capability(con->idev, EV_FF, ff_caps[i]);
+
+	if ((ret = input_ff_create(con->idev, NX_CON_FF_MAX_EFFECTS)))
+		return ret;
+
+	ff = con->idev->ff;
+	ff->upload = nx_con_ff_upload;
+	ff->erase = nx_con_ff_erase;
+	ff->playback = nx_con_ff_playback;
+	ff->set_gain = nx_con_ff_set_gain;
+	con->ff_gain = 0xFFFF;
+	con->idev->close = nx_con_idev_close;
 
 	con->rumble_ll_freq = NX_CON_RUMBLE_DFLT_LOW_FREQ;
 	con->rumble_lh_freq = NX_CON_RUMBLE_DFLT_HIGH_FREQ;
@@ -1942,9 +4406,92 @@ static void nx_con_config_rumble(struct nx_con *con)
 
 	nx_con_clamp_rumble_freqs(con);
 	nx_con_set_rumble(con, 0, 0, false);
-
-	con->rumble_msecs = jiffies_to_msecs(jiffies);
 #endif
+	return 0;
+}
+
+/* Which kinds of device the IMU is exposed as; both may be used at once */
+static bool imu_evdev = true;
+module_param(imu_evdev, bool, 0644);
+MODULE_PARM_DESC(imu_evdev, "Expose the IMU as an input device (default: true)");
+
+static bool imu_iio;
+module_param(imu_iio, bool, 0644);
+MODULE_PARM_DESC(imu_iio, "Expose the IMU as an IIO device (default: false)");
+
+/* Per G and per dps (times NX_CON_IMU_PREC_RANGE_SCALE), at the current ranges */
+static u32 nx_con_imu_accel_res(struct nx_con *con)
+{
+	u8 range = READ_ONCE(con->imu_settings[NX_CON_IMU_SET_ACCEL_RANGE]);
+
+	return NX_CON_IMU_ACCEL_RES_PER_G * NX_CON_IMU_DFLT_ACCEL_RANGE /
+	       nx_con_imu_setting_values[NX_CON_IMU_SET_ACCEL_RANGE][range];
+}
+
+static u32 nx_con_imu_gyro_res(struct nx_con *con)
+{
+	u8 range = READ_ONCE(con->imu_settings[NX_CON_IMU_SET_GYRO_RANGE]);
+
+	return NX_CON_IMU_GYRO_RES_PER_DPS * NX_CON_IMU_DFLT_GYRO_RANGE /
+	       nx_con_imu_setting_values[NX_CON_IMU_SET_GYRO_RANGE][range];
+}
+
+static void nx_con_imu_idev_set_res(struct nx_con *con)
+{
+	u32 accel_res = nx_con_imu_accel_res(con);
+	u32 gyro_res = nx_con_imu_gyro_res(con);
+
+	input_abs_set_res(con->imu_idev, ABS_X, accel_res);
+	input_abs_set_res(con->imu_idev, ABS_Y, accel_res);
+	input_abs_set_res(con->imu_idev, ABS_Z, accel_res);
+	input_abs_set_res(con->imu_idev, ABS_RX, gyro_res);
+	input_abs_set_res(con->imu_idev, ABS_RY, gyro_res);
+	input_abs_set_res(con->imu_idev, ABS_RZ, gyro_res);
+}
+
+/*
+ * Changes one of the IMU settings. It's sent to the controller right away if
+ * the IMU is on, and otherwise when it's next enabled.
+ */
+static int nx_con_set_imu_setting(struct nx_con *con,
+				  enum nx_con_imu_setting setting,
+				  u8 value)
+{
+	u8 settings[NX_CON_IMU_NUM_SETTINGS];
+	int ret = 0;
+
+	mutex_lock(&con->features_mutex);
+	memcpy(settings, con->imu_settings, sizeof(settings));
+	settings[setting] = value;
+
+	if (con->imu_on && (ret = nx_con_send_imu_settings(con, settings, false)))
+		goto out;
+
+	memcpy(con->imu_settings, settings, sizeof(settings));
+	if (con->imu_idev)
+		nx_con_imu_idev_set_res(con);
+
+out:
+	mutex_unlock(&con->features_mutex);
+	return ret;
+}
+
+static int nx_con_imu_idev_open(struct input_dev *idev)
+{
+	struct nx_con *con = input_get_drvdata(idev);
+
+	set_bit(NX_CON_IMU_USER_EVDEV, &con->imu_users);
+	nx_con_update_features(con, true);
+
+	return 0;
+}
+
+static void nx_con_imu_idev_close(struct input_dev *idev)
+{
+	struct nx_con *con = input_get_drvdata(idev);
+
+	clear_bit(NX_CON_IMU_USER_EVDEV, &con->imu_users);
+	nx_con_update_features(con, true);
 }
 
 static int nx_con_imu_idev_create(struct nx_con *con)
@@ -1971,6 +4518,8 @@ static int nx_con_imu_idev_create(struct nx_con *con)
 	con->imu_idev->name = imu_name;
 
 	input_set_drvdata(con->imu_idev, con);
+	con->imu_idev->open = nx_con_imu_idev_open;
+	con->imu_idev->close = nx_con_imu_idev_close;
 
 	input_set_abs_params(con->imu_idev,
 			     ABS_X,
@@ -1991,45 +4540,196 @@ static int nx_con_imu_idev_create(struct nx_con *con)
 			     NX_CON_IMU_ACCEL_FUZZ,
 			     NX_CON_IMU_ACCEL_FLAT);
 
-	input_abs_set_res(con->imu_idev, ABS_X, NX_CON_IMU_ACCEL_RES_PER_G);
-	input_abs_set_res(con->imu_idev, ABS_Y, NX_CON_IMU_ACCEL_RES_PER_G);
-	input_abs_set_res(con->imu_idev, ABS_Z, NX_CON_IMU_ACCEL_RES_PER_G);
+	input_set_abs_params(con->imu_idev,
+			     ABS_RX,
+			     -NX_CON_IMU_MAX_GYRO_MAG,
+			     NX_CON_IMU_MAX_GYRO_MAG,
+			     NX_CON_IMU_GYRO_FUZZ,
+			     NX_CON_IMU_GYRO_FLAT);
+	input_set_abs_params(con->imu_idev,
+			     ABS_RY,
+			     -NX_CON_IMU_MAX_GYRO_MAG,
+			     NX_CON_IMU_MAX_GYRO_MAG,
+			     NX_CON_IMU_GYRO_FUZZ,
+			     NX_CON_IMU_GYRO_FLAT);
+	input_set_abs_params(con->imu_idev,
+			     ABS_RZ,
+			     -NX_CON_IMU_MAX_GYRO_MAG,
+			     NX_CON_IMU_MAX_GYRO_MAG,
+			     NX_CON_IMU_GYRO_FUZZ,
+			     NX_CON_IMU_GYRO_FLAT);
+
+	nx_con_imu_idev_set_res(con);
+
+	__set_bit(EV_MSC, con->imu_idev->evbit);
+	__set_bit(MSC_TIMESTAMP, con->imu_idev->mscbit);
+	__set_bit(INPUT_PROP_ACCELEROMETER, con->imu_idev->propbit);
+
+	if ((ret = input_register_device(con->imu_idev)))
+		return ret;
+
+	return 0;
+}
+
+#if IS_ENABLED(CONFIG_IIO_KFIFO_BUF)
+#define NX_CON_IMU_IIO_CHAN(_type, _mod, _axis) {			\
+	.type = (_type),						\
+	.modified = 1,							\
+	.channel2 = (_mod),						\
+	.address = (_axis),						\
+	.scan_index = (_axis),						\
+	.info_mask_separate = BIT(IIO_CHAN_INFO_RAW) |			\
+			      BIT(IIO_CHAN_INFO_OFFSET) |		\
+			      BIT(IIO_CHAN_INFO_SCALE),			\
+	.scan_type = {							\
+		.sign = 's',						\
+		.realbits = 16,						\
+		.storagebits = 16,					\
+		.endianness = IIO_CPU,					\
+	},								\
+}
+
+static const struct iio_chan_spec nx_con_imu_iio_channels[] = {
+	NX_CON_IMU_IIO_CHAN(IIO_ACCEL, IIO_MOD_X, 0),
+	NX_CON_IMU_IIO_CHAN(IIO_ACCEL, IIO_MOD_Y, 1),
+	NX_CON_IMU_IIO_CHAN(IIO_ACCEL, IIO_MOD_Z, 2),
+	NX_CON_IMU_IIO_CHAN(IIO_ANGL_VEL, IIO_MOD_X, 3),
+	NX_CON_IMU_IIO_CHAN(IIO_ANGL_VEL, IIO_MOD_Y, 4),
+	NX_CON_IMU_IIO_CHAN(IIO_ANGL_VEL, IIO_MOD_Z, 5),
+	IIO_CHAN_SOFT_TIMESTAMP(NX_CON_IMU_NUM_AXES),
+};
+
+/*
+ * Raw values are the controller's own samples. Offset and scale apply the
+ * same calibration as the input device does (see nx_con_calc_imu_mults), in
+ * m/s^2 and rad/s.
+ */
+static int nx_con_imu_iio_read_raw(struct iio_dev *indio_dev,
+				   struct iio_chan_spec const *chan,
+				   int *val,
+				   int *val2,
+				   long mask)
+{
+	struct nx_con *con = *(struct nx_con **)iio_priv(indio_dev);
+	unsigned int axis = chan->address;
+	s64 mults[NX_CON_IMU_NUM_AXES];
+	s32 offsets[NX_CON_IMU_NUM_AXES];
+	s64 mult;
+	u64 unit_pico;
+	u64 scale_pico;
+	s64 scale_nano;
+	u32 dflt_res;
+	u32 res;
+
+	nx_con_get_imu_mults(con, mults, offsets);
+	mult = mults[axis];
+
+	switch (mask) {
+	case IIO_CHAN_INFO_RAW:
+		*val = READ_ONCE(con->imu_raw[axis]);
+		return IIO_VAL_INT;
+	case IIO_CHAN_INFO_OFFSET:
+		*val = -offsets[axis];
+		return IIO_VAL_INT;
+	case IIO_CHAN_INFO_SCALE:
+		if (chan->type == IIO_ACCEL) {
+			unit_pico = NX_CON_IMU_IIO_ACCEL_UNIT_PICO;
+			dflt_res = NX_CON_IMU_ACCEL_RES_PER_G;
+			res = nx_con_imu_accel_res(con);
+		} else {
+			unit_pico = NX_CON_IMU_IIO_GYRO_UNIT_PICO;
+			dflt_res = NX_CON_IMU_GYRO_RES_PER_DPS;
+			res = nx_con_imu_gyro_res(con);
+		}
+		/* the units above are for the default ranges */
+		scale_pico = mul_u64_u32_shr(abs(mult), unit_pico, NX_CON_IMU_MULT_SHIFT);
+		scale_nano = div_u64(div_u64(scale_pico * dflt_res, res), 1000);
+		if (mult < 0)
+			scale_nano = -scale_nano;
+		*val = div_s64_rem(scale_nano, NSEC_PER_SEC, val2);
+		return IIO_VAL_INT_PLUS_NANO;
+	default:
+		return -EINVAL;
+	}
+}
+
+static const struct iio_info nx_con_imu_iio_info = {
+	.read_raw	= nx_con_imu_iio_read_raw,
+};
+
+static int nx_con_imu_iio_postenable(struct iio_dev *indio_dev)
+{
+	struct nx_con *con = *(struct nx_con **)iio_priv(indio_dev);
+
+	set_bit(NX_CON_IMU_USER_IIO, &con->imu_users);
+	nx_con_update_features(con, true);
+
+	return 0;
+}
+
+static int nx_con_imu_iio_predisable(struct iio_dev *indio_dev)
+{
+	struct nx_con *con = *(struct nx_con **)iio_priv(indio_dev);
 
-	input_set_abs_params(con->imu_idev,
-			     ABS_RX,
-			     -NX_CON_IMU_MAX_GYRO_MAG,
-			     NX_CON_IMU_MAX_GYRO_MAG,
-			     NX_CON_IMU_GYRO_FUZZ,
-			     NX_CON_IMU_GYRO_FLAT);
-	input_set_abs_params(con->imu_idev,
-			     ABS_RY,
-			     -NX_CON_IMU_MAX_GYRO_MAG,
-			     NX_CON_IMU_MAX_GYRO_MAG,
-			     NX_CON_IMU_GYRO_FUZZ,
-			     NX_CON_IMU_GYRO_FLAT);
-	input_set_abs_params(con->imu_idev,
-			     ABS_RZ,
-			     -NX_CON_IMU_MAX_GYRO_MAG,
-			     NX_CON_IMU_MAX_GYRO_MAG,
-			     NX_CON_IMU_GYRO_FUZZ,
-			     NX_CON_IMU_GYRO_FLAT);
+	clear_bit(NX_CON_IMU_USER_IIO, &con->imu_users);
+	nx_con_update_features(con, true);
 
-	input_abs_set_res(con->imu_idev, ABS_RX, NX_CON_IMU_GYRO_RES_PER_DPS);
-	input_abs_set_res(con->imu_idev, ABS_RY, NX_CON_IMU_GYRO_RES_PER_DPS);
-	input_abs_set_res(con->imu_idev, ABS_RZ, NX_CON_IMU_GYRO_RES_PER_DPS);
+	return 0;
+}
 
-	__set_bit(EV_MSC, con->imu_idev->evbit);
-	__set_bit(MSC_TIMESTAMP, con->imu_idev->mscbit);
-	__set_bit(INPUT_PROP_ACCELEROMETER, con->imu_idev->propbit);
+static const struct iio_buffer_setup_ops nx_con_imu_iio_setup_ops = {
+	.postenable	= nx_con_imu_iio_postenable,
+	.predisable	= nx_con_imu_iio_predisable,
+};
 
-	if ((ret = input_register_device(con->imu_idev)))
+static int nx_con_imu_iio_create(struct nx_con *con)
+{
+	struct hid_device *hdev = con->hdev;
+	struct iio_dev *indio_dev;
+	int ret;
+
+	if (!(indio_dev = devm_iio_device_alloc(&hdev->dev, sizeof(con))))
+		return -ENOMEM;
+
+	*(struct nx_con **)iio_priv(indio_dev) = con;
+
+	indio_dev->name = devm_kasprintf(&hdev->dev, GFP_KERNEL, "%s (IMU)", con->idev->name);
+	if (!indio_dev->name)
+		return -ENOMEM;
+
+	indio_dev->info = &nx_con_imu_iio_info;
+	indio_dev->modes = INDIO_DIRECT_MODE;
+	indio_dev->channels = nx_con_imu_iio_channels;
+	indio_dev->num_channels = ARRAY_SIZE(nx_con_imu_iio_channels);
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 19, 0)
+	ret = devm_iio_kfifo_buffer_setup(&hdev->dev,
+					  indio_dev,
+					  INDIO_BUFFER_SOFTWARE,
+					  &nx_con_imu_iio_setup_ops);
+#else
+	ret = devm_iio_kfifo_buffer_setup(&hdev->dev, indio_dev, &nx_con_imu_iio_setup_ops);
+#endif
+	if (ret)
+		return ret;
+
+	if ((ret = devm_iio_device_register(&hdev->dev, indio_dev)))
 		return ret;
 
+	con->imu_iio = indio_dev;
+	return 0;
+}
+#else
+static int nx_con_imu_iio_create(struct nx_con *con)
+{
+	hid_warn(con->hdev, "built without IIO buffer support; ignoring imu_iio\n");
 	return 0;
 }
+#endif /* IS_ENABLED(CONFIG_IIO_KFIFO_BUF) */
 
 static int nx_con_idev_create(struct nx_con *con)
 {
+	const struct nx_con_desc *desc = con->desc;
 	struct hid_device *hdev;
 	int ret;
 
@@ -2047,41 +4747,25 @@ static int nx_con_idev_create(struct nx_con *con)
 
 	input_set_drvdata(con->idev, con);
 
-	if (nx_con_type_is_right_joycon(con)) {
-		nx_con_config_right_stick(con->idev);
-		nx_con_config_buttons(con->idev, right_joycon_button_mappings);
-		if (!nx_con_device_is_chrggrip(con))
-			nx_con_config_buttons(con->idev, right_joycon_s_button_mappings);
-	} else if (nx_con_type_is_left_joycon(con)) {
-		nx_con_config_left_stick(con->idev);
-		nx_con_config_buttons(con->idev, left_joycon_button_mappings);
-		if (!nx_con_device_is_chrggrip(con))
-			nx_con_config_buttons(con->idev, left_joycon_s_button_mappings);
-	} else if (nx_con_type_is_procon(con)) {
+	if (con->caps & NX_CON_CAP_LEFT_STICK)
 		nx_con_config_left_stick(con->idev);
+	if (con->caps & NX_CON_CAP_RIGHT_STICK)
 		nx_con_config_right_stick(con->idev);
+	if (con->caps & NX_CON_CAP_DPAD)
 		nx_con_config_dpad(con->idev);
-		nx_con_config_buttons(con->idev, procon_button_mappings);
-	} else if (nx_con_type_is_any_nescon(con)) {
-		nx_con_config_dpad(con->idev);
-		nx_con_config_buttons(con->idev, nescon_button_mappings);
-	} else if (nx_con_type_is_snescon(con)) {
-		nx_con_config_dpad(con->idev);
-		nx_con_config_buttons(con->idev, snescon_button_mappings);
-	} else if (nx_con_type_is_gencon(con)) {
-		nx_con_config_dpad(con->idev);
-		nx_con_config_buttons(con->idev, gencon_button_mappings);
-	} else if (nx_con_type_is_n64con(con)) {
-		nx_con_config_dpad(con->idev);
-		nx_con_config_left_stick(con->idev);
-		nx_con_config_buttons(con->idev, n64con_button_mappings);
-	}
+	if (desc->buttons)
+		nx_con_config_buttons(con, desc->buttons);
+	if (desc->side_buttons && !nx_con_device_is_chrggrip(con))
+		nx_con_config_buttons(con, desc->side_buttons);
+
+	if (nx_con_has_imu(con) && imu_evdev && (ret = nx_con_imu_idev_create(con)))
+		return ret;
 
-	if (nx_con_has_imu(con) && (ret = nx_con_imu_idev_create(con)))
+	if (nx_con_has_imu(con) && imu_iio && (ret = nx_con_imu_iio_create(con)))
 		return ret;
 
-	if (nx_con_has_rumble(con))
-		nx_con_config_rumble(con);
+	if (nx_con_has_rumble(con) && (ret = nx_con_config_rumble(con)))
+		return ret;
 
 	if ((ret = input_register_device(con->idev)))
 		return ret;
@@ -2089,8 +4773,13 @@ static int nx_con_idev_create(struct nx_con *con)
 	return 0;
 }
 
-static int nx_con_player_led_brightness_set(struct led_classdev *led,
-					    enum led_brightness brightness)
+/*
+ * LED changes are queued without waiting for the controller to acknowledge
+ * them, so that LED triggers never block on the controller. Note that the LED
+ * core may call these from atomic context.
+ */
+static void nx_con_player_led_brightness_set(struct led_classdev *led,
+					     enum led_brightness brightness)
 {
 	struct device *dev = led->dev->parent;
 	struct hid_device *hdev = to_hid_device(dev);
@@ -2102,7 +4791,7 @@ static int nx_con_player_led_brightness_set(struct led_classdev *led,
 
 	if (!(con = hid_get_drvdata(hdev))) {
 		hid_err(hdev, "No controller data\n");
-		return -ENODEV;
+		return;
 	}
 
 	/* determine which player led this is */
@@ -2111,36 +4800,24 @@ static int nx_con_player_led_brightness_set(struct led_classdev *led,
 			break;
 	}
 	if (num >= NX_CON_NUM_LEDS)
-		return -EINVAL;
+		return;
 
-	mutex_lock(&con->output_mutex);
 	for (i = 0; i < NX_CON_NUM_LEDS; i++) {
 		if (i == num)
 			val |= brightness << i;
 		else
 			val |= con->leds[i].brightness << i;
 	}
-	ret = nx_con_set_player_leds(con, 0, val);
-	mutex_unlock(&con->output_mutex);
 
-	return ret;
+	if ((ret = nx_con_set_player_leds(con, 0, val, true)) && ret != -ENODEV)
+		hid_warn(hdev, "Failed to queue player leds; ret=%d\n", ret);
 }
 
-static int nx_con_home_led_brightness_set(struct led_classdev *led,
-					  enum led_brightness brightness)
+static int nx_con_set_home_led(struct nx_con *con, u8 brightness, bool async)
 {
-	struct device *dev = led->dev->parent;
-	struct hid_device *hdev = to_hid_device(dev);
-	struct nx_con *con;
 	struct nx_con_subcmd_request *req;
 	u8 buffer[sizeof(*req) + 5] = { 0 };
 	u8 *data;
-	int ret;
-
-	if (!(con = hid_get_drvdata(hdev))) {
-		hid_err(hdev, "No controller data\n");
-		return -ENODEV;
-	}
 
 	req = (struct nx_con_subcmd_request *)buffer;
 	req->subcmd_id = NX_CON_SUBCMD_SET_HOME_LIGHT;
@@ -2151,15 +4828,43 @@ static int nx_con_home_led_brightness_set(struct led_classdev *led,
 	data[3] = 0x11;
 	data[4] = 0x11;
 
-	hid_dbg(hdev, "setting home led brightness\n");
-	mutex_lock(&con->output_mutex);
-	ret = nx_con_send_subcmd(con, req, 5, HZ/4);
-	mutex_unlock(&con->output_mutex);
+	hid_dbg(con->hdev, "setting home led brightness\n");
+	if (async)
+		return nx_con_send_subcmd_async(con, req, 5, HZ/4);
+	return nx_con_send_subcmd(con, req, 5, HZ/4, NULL);
+}
 
-	return ret;
+static void nx_con_home_led_brightness_set(struct led_classdev *led,
+					   enum led_brightness brightness)
+{
+	struct device *dev = led->dev->parent;
+	struct hid_device *hdev = to_hid_device(dev);
+	struct nx_con *con;
+	int ret;
+
+	if (!(con = hid_get_drvdata(hdev))) {
+		hid_err(hdev, "No controller data\n");
+		return;
+	}
+
+	if ((ret = nx_con_set_home_led(con, brightness, true)) && ret != -ENODEV)
+		hid_warn(hdev, "Failed to queue home led; ret=%d\n", ret);
+}
+
+/*
+ * Player numbers are allocated as the lowest free slot, so a controller which
+ * reconnects gets its old player LEDs back as long as no other controller took
+ * its place in the meantime.
+ */
+static DEFINE_IDA(nx_con_player_ida);
+
+static void nx_con_player_id_free(void *data)
+{
+	struct nx_con *con = data;
+
+	ida_free(&nx_con_player_ida, con->player_id);
 }
 
-static DEFINE_MUTEX(nx_con_input_num_mutex);
 static int nx_con_leds_create(struct nx_con *con)
 {
 	struct hid_device *hdev = con->hdev;
@@ -2169,14 +4874,21 @@ static int nx_con_leds_create(struct nx_con *con)
 	char *name;
 	int ret = 0;
 	int i;
-	static int input_num = 1;
+	int player_num;
+
+	if ((ret = ida_alloc(&nx_con_player_ida, GFP_KERNEL)) < 0)
+		return ret;
+	con->player_id = ret;
+
+	/* the slot is released when the controller is removed */
+	if ((ret = devm_add_action_or_reset(dev, nx_con_player_id_free, con)))
+		return ret;
+
+	player_num = con->player_id % NX_CON_NUM_LEDS + 1;
 
 	/* Set the default controller player leds based on controller number */
-	mutex_lock(&nx_con_input_num_mutex);
-	mutex_lock(&con->output_mutex);
-	if ((ret = nx_con_set_player_leds(con, 0, 0xF >> (4 - input_num))))
+	if ((ret = nx_con_set_player_leds(con, 0, 0xF >> (4 - player_num), false)))
 		hid_warn(con->hdev, "Failed to set leds; ret=%d\n", ret);
-	mutex_unlock(&con->output_mutex);
 
 	/* configure the player LEDs */
 	for (i = 0; i < NX_CON_NUM_LEDS; i++) {
@@ -2186,29 +4898,22 @@ static int nx_con_leds_create(struct nx_con *con)
 				      d_name,
 				      "green",
 				      nx_con_player_led_names[i]);
-		if (!name) {
-			mutex_unlock(&nx_con_input_num_mutex);
+		if (!name)
 			return -ENOMEM;
-		}
 
 		led = &con->leds[i];
 		led->name = name;
-		led->brightness = ((i + 1) <= input_num) ? 1 : 0;
+		led->brightness = ((i + 1) <= player_num) ? 1 : 0;
 		led->max_brightness = 1;
-		led->brightness_set_blocking = nx_con_player_led_brightness_set;
+		led->brightness_set = nx_con_player_led_brightness_set;
 		led->flags = LED_CORE_SUSPENDRESUME | LED_HW_PLUGGABLE;
 
 		if ((ret = devm_led_classdev_register(&hdev->dev, led))) {
 			hid_err(hdev, "Failed registering %s LED\n", led->name);
-			mutex_unlock(&nx_con_input_num_mutex);
 			return ret;
 		}
 	}
 
-	if (++input_num > 4)
-		input_num = 1;
-	mutex_unlock(&nx_con_input_num_mutex);
-
 	/* configure the home LED */
 	if (nx_con_type_has_right_controls(con)) {
 		name = devm_kasprintf(dev,
@@ -2224,7 +4929,7 @@ static int nx_con_leds_create(struct nx_con *con)
 		led->name = name;
 		led->brightness = 0;
 		led->max_brightness = 0xF;
-		led->brightness_set_blocking = nx_con_home_led_brightness_set;
+		led->brightness_set = nx_con_home_led_brightness_set;
 		led->flags = LED_CORE_SUSPENDRESUME | LED_HW_PLUGGABLE;
 
 		if ((ret = devm_led_classdev_register(&hdev->dev, led))) {
@@ -2233,7 +4938,7 @@ static int nx_con_leds_create(struct nx_con *con)
 		}
 
 		/* Set the home LED to 0 as default state */
-		if ((ret = nx_con_home_led_brightness_set(led, 0))) {
+		if ((ret = nx_con_set_home_led(con, 0, false))) {
 			hid_warn(hdev, "Failed to set home LED default, unregistering home LED");
 			devm_led_classdev_unregister(&hdev->dev, led);
 		}
@@ -2247,17 +4952,11 @@ static int nx_con_battery_get_property(struct power_supply *supply,
 				       union power_supply_propval *val)
 {
 	struct nx_con *con = power_supply_get_drvdata(supply);
-	unsigned long flags;
+	u8 bat_con = READ_ONCE(con->bat_con);
+	int capacity = nx_con_battery_capacity(bat_con);
+	bool charging = bat_con & NX_CON_BAT_CON_CHARGING;
+	bool powered = bat_con & NX_CON_BAT_CON_POWERED;
 	int ret = 0;
-	u8 capacity;
-	bool charging;
-	bool powered;
-
-	spin_lock_irqsave(&con->lock, flags);
-	capacity = con->battery_capacity;
-	charging = con->battery_charging;
-	powered = con->host_powered;
-	spin_unlock_irqrestore(&con->lock, flags);
 
 	switch (prop) {
 	case POWER_SUPPLY_PROP_PRESENT:
@@ -2300,7 +4999,7 @@ static int nx_con_power_supply_create(struct nx_con *con)
 	int ret = 0;
 
 	/* Set initially to unknown before receiving first input report */
-	con->battery_capacity = POWER_SUPPLY_CAPACITY_LEVEL_UNKNOWN;
+	con->bat_con = NX_CON_BAT_CON_UNKNOWN;
 
 	/* Configure the battery's description */
 	con->battery_desc.properties = nx_con_battery_props;
@@ -2323,47 +5022,555 @@ static int nx_con_power_supply_create(struct nx_con *con)
 		return ret;
 	}
 
-	return power_supply_powers(con->battery, &hdev->dev);
+	return power_supply_powers(con->battery, &hdev->dev);
+}
+
+static int nx_con_set_mac_addr(struct nx_con *con, const u8 *mac_addr)
+{
+	memcpy(con->mac_addr, mac_addr, sizeof(con->mac_addr));
+
+	con->mac_addr_str = devm_kasprintf(&con->hdev->dev,
+					   GFP_KERNEL,
+					   "%02X:%02X:%02X:%02X:%02X:%02X",
+					   con->mac_addr[0],
+					   con->mac_addr[1],
+					   con->mac_addr[2],
+					   con->mac_addr[3],
+					   con->mac_addr[4],
+					   con->mac_addr[5]);
+	if (!con->mac_addr_str)
+		return -ENOMEM;
+	hid_info(con->hdev, "controller MAC = %s\n", con->mac_addr_str);
+
+	return 0;
+}
+
+static int nx_con_request_device_info(struct nx_con *con)
+{
+	int ret;
+	struct nx_con_subcmd_request req = { 0 };
+	struct nx_con_input_report *report;
+	u8 reply[NX_CON_MAX_RESP_SIZE];
+
+	req.subcmd_id = NX_CON_SUBCMD_REQ_DEV_INFO;
+	if ((ret = nx_con_send_subcmd(con, &req, 0, HZ, reply))) {
+		hid_err(con->hdev, "Failed to get NX controller info; ret=%d\n", ret);
+		return ret;
+	}
+
+	report = (struct nx_con_input_report *)reply;
+
+	if ((ret = nx_con_set_mac_addr(con, &report->subcmd_reply.data[4])))
+		return ret;
+
+	/* Retrieve the type so we can distinguish for charging grip */
+	con->type = report->subcmd_reply.data[2];
+
+	hid_dbg(con->hdev, "con->type = 0x%02X\n", con->type);
+
+	return 0;
+}
+
+/*
+ * Calibration cache
+ *
+ * Controllers tend to reconnect often (e.g., after sleeping), and reading their
+ * device info and calibration accounts for most of the time spent in probe.
+ * Since neither changes between connections, they're cached here by MAC
+ * address for the lifetime of the module. On a cache hit, probe skips straight
+ * from setting the report mode to creating the input devices.
+ *
+ * The cache can be saved and restored across reboots through debugfs (see
+ * nx_con_cal_cache_fops below).
+ */
+#define NX_CON_CAL_CACHE_MAX_ENTRIES	32
+
+struct nx_con_cal_cache_entry {
+	struct list_head node;
+	u8 mac_addr[6];
+	enum nx_con_type type;
+	struct nx_con_stick_cal left_stick_cal_x;
+	struct nx_con_stick_cal left_stick_cal_y;
+	struct nx_con_stick_cal right_stick_cal_x;
+	struct nx_con_stick_cal right_stick_cal_y;
+	struct nx_con_imu_cal accel_cal;
+	struct nx_con_imu_cal gyro_cal;
+};
+
+static bool cal_cache = true;
+module_param(cal_cache, bool, 0644);
+MODULE_PARM_DESC(cal_cache, "Cache controller calibration across reconnects (default: true)");
+
+/* most recently used entries are kept at the front */
+static LIST_HEAD(nx_con_cal_cache);
+static DEFINE_MUTEX(nx_con_cal_cache_mutex);
+static unsigned int nx_con_cal_cache_count;
+
+static struct nx_con_cal_cache_entry *nx_con_cal_cache_find(const u8 *mac_addr)
+{
+	struct nx_con_cal_cache_entry *entry;
+
+	list_for_each_entry(entry, &nx_con_cal_cache, node) {
+		if (!memcmp(entry->mac_addr, mac_addr, sizeof(entry->mac_addr)))
+			return entry;
+	}
+
+	return NULL;
+}
+
+/* Inserts (or replaces) an entry, taking ownership of it */
+static void nx_con_cal_cache_insert(struct nx_con_cal_cache_entry *new)
+{
+	struct nx_con_cal_cache_entry *entry;
+
+	mutex_lock(&nx_con_cal_cache_mutex);
+	if ((entry = nx_con_cal_cache_find(new->mac_addr))) {
+		list_del(&entry->node);
+		kfree(entry);
+		nx_con_cal_cache_count--;
+	}
+
+	list_add(&new->node, &nx_con_cal_cache);
+	if (++nx_con_cal_cache_count > NX_CON_CAL_CACHE_MAX_ENTRIES) {
+		entry = list_last_entry(&nx_con_cal_cache,
+					struct nx_con_cal_cache_entry,
+					node);
+		list_del(&entry->node);
+		kfree(entry);
+		nx_con_cal_cache_count--;
+	}
+	mutex_unlock(&nx_con_cal_cache_mutex);
+}
+
+static void nx_con_cal_cache_clear(void)
+{
+	struct nx_con_cal_cache_entry *entry;
+	struct nx_con_cal_cache_entry *tmp;
+
+	mutex_lock(&nx_con_cal_cache_mutex);
+	list_for_each_entry_safe(entry, tmp, &nx_con_cal_cache, node) {
+		list_del(&entry->node);
+		kfree(entry);
+	}
+	nx_con_cal_cache_count = 0;
+	mutex_unlock(&nx_con_cal_cache_mutex);
+}
+
+/* Saves the controller's device info and calibration for future connections */
+static void nx_con_cal_cache_store(struct nx_con *con)
+{
+	struct nx_con_cal_cache_entry *entry;
+
+	if (!cal_cache)
+		return;
+
+	if (!(entry = kzalloc(sizeof(*entry), GFP_KERNEL)))
+		return;
+
+	memcpy(entry->mac_addr, con->mac_addr, sizeof(entry->mac_addr));
+	entry->type = con->type;
+	entry->left_stick_cal_x = con->left_stick_cal_x;
+	entry->left_stick_cal_y = con->left_stick_cal_y;
+	entry->right_stick_cal_x = con->right_stick_cal_x;
+	entry->right_stick_cal_y = con->right_stick_cal_y;
+	entry->accel_cal = con->accel_cal;
+	entry->gyro_cal = con->gyro_cal;
+
+	nx_con_cal_cache_insert(entry);
+	hid_dbg(con->hdev, "cached calibration\n");
+}
+
+/*
+ * Restores the controller's device info and calibration from the cache. If
+ * mac_addr is NULL, the HID device's unique ID is used, which is the
+ * controller's MAC address when connected over Bluetooth. This allows skipping
+ * the device info request entirely.
+ *
+ * Returns true on a cache hit.
+ */
+static bool nx_con_cal_cache_restore(struct nx_con *con, const u8 *mac_addr)
+{
+	struct nx_con_cal_cache_entry *entry;
+	struct nx_con_cal_cache_entry found;
+	u8 uniq_addr[6];
+
+	if (!cal_cache)
+		return false;
+
+	if (!mac_addr) {
+		if (sscanf(con->hdev->uniq, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx",
+			   &uniq_addr[0], &uniq_addr[1], &uniq_addr[2],
+			   &uniq_addr[3], &uniq_addr[4], &uniq_addr[5]) != 6)
+			return false;
+		mac_addr = uniq_addr;
+	}
+
+	mutex_lock(&nx_con_cal_cache_mutex);
+	if ((entry = nx_con_cal_cache_find(mac_addr))) {
+		list_move(&entry->node, &nx_con_cal_cache);
+		found = *entry;
+	}
+	mutex_unlock(&nx_con_cal_cache_mutex);
+
+	if (!entry)
+		return false;
+
+	if (!con->mac_addr_str && nx_con_set_mac_addr(con, found.mac_addr))
+		return false;
+
+	con->type = found.type;
+	con->left_stick_cal_x = found.left_stick_cal_x;
+	con->left_stick_cal_y = found.left_stick_cal_y;
+	con->right_stick_cal_x = found.right_stick_cal_x;
+	con->right_stick_cal_y = found.right_stick_cal_y;
+	con->accel_cal = found.accel_cal;
+	con->gyro_cal = found.gyro_cal;
+
+	nx_con_cal_changed(con);
+	con->calibrated = true;
+	hid_info(con->hdev, "using cached calibration\n");
+	return true;
+}
+
+/*
+ * The cache is exported as one line of text per controller, holding the MAC
+ * address, type, the min/center/max of each stick axis (left x, left y, right
+ * x, right y), and the IMU calibration (accel offsets, accel scales, gyro
+ * offsets, gyro scales). Writing lines in the same format imports them, and
+ * writing "clear" empties the cache. Each write must consist of whole lines.
+ */
+#define NX_CON_CAL_CACHE_LINE_MAX	256
+
+static struct dentry *nx_hid_debugfs_dir;
+
+static int nx_con_cal_cache_show(struct seq_file *s, void *unused)
+{
+	struct nx_con_cal_cache_entry *entry;
+	struct nx_con_stick_cal *sticks[4];
+	struct nx_con_imu_cal *imu_cals[2];
+	int i;
+	int j;
+
+	mutex_lock(&nx_con_cal_cache_mutex);
+	list_for_each_entry(entry, &nx_con_cal_cache, node) {
+		sticks[0] = &entry->left_stick_cal_x;
+		sticks[1] = &entry->left_stick_cal_y;
+		sticks[2] = &entry->right_stick_cal_x;
+		sticks[3] = &entry->right_stick_cal_y;
+		imu_cals[0] = &entry->accel_cal;
+		imu_cals[1] = &entry->gyro_cal;
+
+		seq_printf(s, "%02X:%02X:%02X:%02X:%02X:%02X %02X",
+			   entry->mac_addr[0],
+			   entry->mac_addr[1],
+			   entry->mac_addr[2],
+			   entry->mac_addr[3],
+			   entry->mac_addr[4],
+			   entry->mac_addr[5],
+			   entry->type);
+		for (i = 0; i < ARRAY_SIZE(sticks); i++)
+			seq_printf(s, " %d %d %d",
+				   sticks[i]->min,
+				   sticks[i]->center,
+				   sticks[i]->max);
+		for (i = 0; i < ARRAY_SIZE(imu_cals); i++) {
+			for (j = 0; j < 3; j++)
+				seq_printf(s, " %d", imu_cals[i]->offset[j]);
+			for (j = 0; j < 3; j++)
+				seq_printf(s, " %d", imu_cals[i]->scale[j]);
+		}
+		seq_puts(s, "\n");
+	}
+	mutex_unlock(&nx_con_cal_cache_mutex);
+
+	return 0;
+}
+
+static int nx_con_cal_cache_import(const char *line)
+{
+	struct nx_con_cal_cache_entry *entry;
+	struct nx_con_stick_cal *sticks[4];
+	struct nx_con_imu_cal *imu_cals[2];
+	unsigned int type;
+	int n;
+	int i;
+	int j;
+
+	if (!(entry = kzalloc(sizeof(*entry), GFP_KERNEL)))
+		return -ENOMEM;
+
+	sticks[0] = &entry->left_stick_cal_x;
+	sticks[1] = &entry->left_stick_cal_y;
+	sticks[2] = &entry->right_stick_cal_x;
+	sticks[3] = &entry->right_stick_cal_y;
+	imu_cals[0] = &entry->accel_cal;
+	imu_cals[1] = &entry->gyro_cal;
+
+	if (sscanf(line, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx %x%n",
+		   &entry->mac_addr[0],
+		   &entry->mac_addr[1],
+		   &entry->mac_addr[2],
+		   &entry->mac_addr[3],
+		   &entry->mac_addr[4],
+		   &entry->mac_addr[5],
+		   &type,
+		   &n) != 7 || type > 0xFF)
+		goto err;
+	entry->type = type;
+	line += n;
+
+	for (i = 0; i < ARRAY_SIZE(sticks); i++) {
+		if (sscanf(line, " %d %d %d%n",
+			   &sticks[i]->min,
+			   &sticks[i]->center,
+			   &sticks[i]->max,
+			   &n) != 3)
+			goto err;
+		if (sticks[i]->min >= sticks[i]->center ||
+		    sticks[i]->center >= sticks[i]->max)
+			goto err;
+		line += n;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(imu_cals); i++) {
+		for (j = 0; j < 6; j++) {
+			s16 *val = j < 3 ? &imu_cals[i]->offset[j] :
+					   &imu_cals[i]->scale[j - 3];
+
+			if (sscanf(line, " %hd%n", val, &n) != 1)
+				goto err;
+			line += n;
+		}
+		/* these would otherwise produce a zero divisor */
+		for (j = 0; j < 3; j++) {
+			if (imu_cals[i]->offset[j] == imu_cals[i]->scale[j])
+				goto err;
+		}
+	}
+
+	/* nothing but whitespace may follow */
+	if (*skip_spaces(line))
+		goto err;
+
+	nx_con_cal_cache_insert(entry);
+	return 0;
+
+err:
+	kfree(entry);
+	return -EINVAL;
+}
+
+static int nx_con_cal_cache_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, nx_con_cal_cache_show, NULL);
+}
+
+static ssize_t nx_con_cal_cache_write(struct file *file,
+				      const char __user *ubuf,
+				      size_t count,
+				      loff_t *ppos)
+{
+	char *buf;
+	char *cur;
+	char *line;
+	int ret = 0;
+
+	if (count > NX_CON_CAL_CACHE_MAX_ENTRIES * NX_CON_CAL_CACHE_LINE_MAX)
+		return -EINVAL;
+
+	buf = memdup_user_nul(ubuf, count);
+	if (IS_ERR(buf))
+		return PTR_ERR(buf);
+
+	cur = buf;
+	while ((line = strsep(&cur, "\n"))) {
+		line = strim(line);
+		if (!*line)
+			continue;
+
+		if (!strcmp(line, "clear"))
+			nx_con_cal_cache_clear();
+		else if ((ret = nx_con_cal_cache_import(line)))
+			break;
+	}
+
+	kfree(buf);
+	return ret ? ret : count;
+}
+
+static ssize_t nx_con_imu_trace_read(struct file *file,
+				     char __user *ubuf,
+				     size_t count,
+				     loff_t *ppos)
+{
+	struct nx_con *con = file->private_data;
+	char buf[2] = { test_bit(0, &con->imu_trace) ? 'Y' : 'N', '\n' };
+
+	return simple_read_from_buffer(ubuf, count, ppos, buf, sizeof(buf));
+}
+
+static ssize_t nx_con_imu_trace_write(struct file *file,
+				      const char __user *ubuf,
+				      size_t count,
+				      loff_t *ppos)
+{
+	struct nx_con *con = file->private_data;
+	bool enable;
+	int ret;
+
+	if ((ret = kstrtobool_from_user(ubuf, count, &enable)))
+		return ret;
+
+	if (enable) {
+		if (!test_and_set_bit(0, &con->imu_trace))
+			static_branch_inc(&nx_con_imu_trace_key);
+	} else if (test_and_clear_bit(0, &con->imu_trace)) {
+		static_branch_dec(&nx_con_imu_trace_key);
+	}
+
+	return count;
 }
 
-static int nx_con_request_device_info(struct nx_con *con)
+/* Logs each raw IMU sample of one controller, at KERN_DEBUG */
+static const struct file_operations nx_con_imu_trace_fops = {
+	.owner		= THIS_MODULE,
+	.open		= simple_open,
+	.read		= nx_con_imu_trace_read,
+	.write		= nx_con_imu_trace_write,
+	.llseek		= default_llseek,
+};
+
+static void nx_con_debugfs_create(struct nx_con *con)
 {
-	int ret;
-	int i;
-	int j;
-	struct nx_con_subcmd_request req = { 0 };
-	struct nx_con_input_report *report;
+	con->debugfs_dir = debugfs_create_dir(dev_name(&con->hdev->dev),
+					      nx_hid_debugfs_dir);
+
+	if (nx_con_has_imu(con))
+		debugfs_create_file("imu_trace",
+				    0600,
+				    con->debugfs_dir,
+				    con,
+				    &nx_con_imu_trace_fops);
+}
 
-	req.subcmd_id = NX_CON_SUBCMD_REQ_DEV_INFO;
-	if ((ret = nx_con_send_subcmd(con, &req, 0, HZ))) {
-		hid_err(con->hdev, "Failed to get NX controller info; ret=%d\n", ret);
-		return ret;
+static void nx_con_debugfs_remove(struct nx_con *con)
+{
+	/* waits out any write to imu_trace that's still in progress */
+	debugfs_remove_recursive(con->debugfs_dir);
+
+	if (test_and_clear_bit(0, &con->imu_trace))
+		static_branch_dec(&nx_con_imu_trace_key);
+}
+
+static const struct file_operations nx_con_cal_cache_fops = {
+	.owner		= THIS_MODULE,
+	.open		= nx_con_cal_cache_open,
+	.read		= seq_read,
+	.write		= nx_con_cal_cache_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/* Reads and parses all of the controller's calibration, caching it if valid */
+static void nx_con_calibrate(struct nx_con *con)
+{
+	struct hid_device *hdev = con->hdev;
+	bool valid = true;
+
+	/*
+	 * Read all calibration data up front. Any calibration which couldn't be
+	 * read will be replaced with defaults below.
+	 */
+	if (nx_con_has_joysticks(con) || nx_con_has_imu(con)) {
+		if (nx_con_read_cal_image(con))
+			hid_warn(hdev, "Failed to read calibration data\n");
 	}
 
-	report = (struct nx_con_input_report *)con->input_buf;
+	if (nx_con_has_joysticks(con)) {
+		if (nx_con_request_calibration(con)) {
+			/*
+			* We can function with default calibration, but it may be
+			* inaccurate. Provide a warning, and continue on.
+			*/
+			hid_warn(hdev, "Analog stick positions may be inaccurate\n");
+			valid = false;
+		}
+	}
 
-	for (i = 4, j = 0; j < 6; i++, j++)
-		con->mac_addr[j] = report->subcmd_reply.data[i];
+	if (nx_con_has_imu(con)) {
+		if (nx_con_request_imu_calibration(con)) {
+			/*
+			* We can function with default calibration, but it may be
+			* inaccurate. Provide a warning, and continue on.
+			*/
+			hid_warn(hdev, "Unable to read IMU calibration data\n");
+			valid = false;
+		}
+	}
 
-	con->mac_addr_str = devm_kasprintf(&con->hdev->dev,
-					   GFP_KERNEL,
-					   "%02X:%02X:%02X:%02X:%02X:%02X",
-					   con->mac_addr[0],
-					   con->mac_addr[1],
-					   con->mac_addr[2],
-					   con->mac_addr[3],
-					   con->mac_addr[4],
-					   con->mac_addr[5]);
-	if (!con->mac_addr_str)
-		return -ENOMEM;
-	hid_info(con->hdev, "controller MAC = %s\n", con->mac_addr_str);
+	/*
+	 * Whatever calibration the controller doesn't use is left at the
+	 * defaults, so that its cache entry can be exported and imported again.
+	 */
+	if (!nx_con_has_joysticks(con)) {
+		nx_con_set_default_stick_cal(&con->left_stick_cal_x,
+					     &con->left_stick_cal_y);
+		nx_con_set_default_stick_cal(&con->right_stick_cal_x,
+					     &con->right_stick_cal_y);
+	}
+	if (!nx_con_has_imu(con))
+		nx_con_set_default_imu_cal(con);
 
-	/* Retrieve the type so we can distinguish for charging grip */
-	con->type = report->subcmd_reply.data[2];
+	/* don't let defaults stand in for a controller's real calibration */
+	if (valid)
+		nx_con_cal_cache_store(con);
 
-	hid_dbg(con->hdev, "con->type = 0x%02X\n", con->type);
+	nx_con_cal_changed(con);
+	con->calibrated = true;
+}
 
-	return 0;
+/*
+ * When set, probe only does what's needed to identify the controller and
+ * create its devices. Everything else is finished by nx_con_setup_worker.
+ */
+static bool deferred_setup;
+module_param(deferred_setup, bool, 0644);
+MODULE_PARM_DESC(deferred_setup, "Finish controller setup after probe (default: false)");
+
+/*
+ * Calibrates the controller (if needed) and enables its IMU and rumble, if
+ * anything has started using them already.
+ */
+static int nx_con_setup_features(struct nx_con *con)
+{
+	if (!con->calibrated)
+		nx_con_calibrate(con);
+
+	mutex_lock(&con->features_mutex);
+	con->features_ready = true;
+	mutex_unlock(&con->features_mutex);
+
+	return nx_con_update_features(con, false);
+}
+
+/*
+ * Finishes a deferred setup. The input devices already exist at this point
+ * and are reporting with default calibration, which is swapped out for the
+ * controller's own as soon as it has been read.
+ */
+static void nx_con_setup_worker(struct work_struct *work)
+{
+	struct nx_con *con = container_of(work, struct nx_con, setup_worker);
+	int ret;
+
+	hid_dbg(con->hdev, "deferred setup - start\n");
+
+	ret = nx_con_setup_features(con);
+
+	if (ret && con->state != NX_CON_STATE_REMOVED)
+		hid_warn(con->hdev, "deferred setup - fail = %d\n", ret);
+	else
+		hid_dbg(con->hdev, "deferred setup - done\n");
 }
 
 /* Common handler for parsing inputs */
@@ -2374,6 +5581,10 @@ static int nx_con_read_handler(struct nx_con *con, u8 *data, int size)
 	     data[0] == NX_CON_INPUT_MCU_DATA) &&
 	     size >= 12) { /* make sure it contains the input report */
 		nx_con_parse_report(con, (struct nx_con_input_report *)data);
+	} else if (data[0] == NX_CON_INPUT_BUTTON_EVENT &&
+		   size >= 4 &&
+		   con->desc->simple_buttons) {
+		nx_con_parse_simple_report(con, data, size);
 	}
 
 	return 0;
@@ -2384,9 +5595,12 @@ static int nx_con_handle_event(struct nx_con *con, u8 *data, int size)
 	int ret = 0;
 	bool match = false;
 	struct nx_con_input_report *report;
+	unsigned long flags;
 
-	if (unlikely(mutex_is_locked(&con->output_mutex)) &&
-	    con->msg_type != NX_CON_MSG_TYPE_NONE) {
+	/* only a reply being waited for needs the lock; checked again under it */
+	if (unlikely(READ_ONCE(con->msg_type) != NX_CON_MSG_TYPE_NONE)) {
+		/* the reply buffer is only valid while msg_type is set */
+		spin_lock_irqsave(&con->lock, flags);
 		switch (con->msg_type) {
 		case NX_CON_MSG_TYPE_USB:
 			if (size < 2)
@@ -2408,10 +5622,14 @@ static int nx_con_handle_event(struct nx_con *con, u8 *data, int size)
 		}
 
 		if (match) {
-			memcpy(con->input_buf, data,
+			memcpy(con->resp_buf, data,
 			       min(size, (int)NX_CON_MAX_RESP_SIZE));
-			con->msg_type = NX_CON_MSG_TYPE_NONE;
+			WRITE_ONCE(con->msg_type, NX_CON_MSG_TYPE_NONE);
 			con->received_resp = true;
+		}
+		spin_unlock_irqrestore(&con->lock, flags);
+
+		if (match) {
 			wake_up(&con->wait);
 
 			/* This message has been handled */
@@ -2435,24 +5653,49 @@ static int nx_hid_event(struct hid_device *hdev,
 	if (size < 1)
 		return -EINVAL;
 
+	/* before anything else, so IMU timestamps see as little jitter as possible */
+	con->event_time = ktime_get();
+
 	return nx_con_handle_event(con, raw_data, size);
 }
 
-static int nx_con_init_rumble_worker(struct nx_con *con)
+static void nx_con_init_output_workers(struct nx_con *con)
 {
-	if (!(con->rumble_queue = alloc_workqueue("hid-nx-rumble_wq",
-					          WQ_FREEZABLE | WQ_MEM_RECLAIM,
-					          0)))
-		return -ENOMEM;
-
-	INIT_WORK(&con->rumble_worker, nx_con_rumble_worker);
-
-	return 0;
+	INIT_WORK(&con->output_worker, nx_con_output_worker);
+	hrtimer_init(&con->rumble_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	con->rumble_timer.function = nx_con_rumble_timer;
+#if IS_ENABLED(CONFIG_NINTENDO_FF)
+	hrtimer_init(&con->ff_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	con->ff_timer.function = nx_con_ff_timer;
+	hrtimer_init(&con->stream_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	con->stream_timer.function = nx_con_stream_timer;
+#endif
 }
 
-static inline bool nx_con_using_usb(struct nx_con *con)
+/*
+ * Stops all output to the controller for good. Anything still queued, or
+ * waiting on a reply, fails with -ENODEV.
+ */
+static void nx_con_stop_output(struct nx_con *con)
 {
-	return con->hdev->bus == BUS_USB;
+	unsigned long flags;
+
+#if IS_ENABLED(CONFIG_NINTENDO_FF)
+	nx_con_stream_destroy(con);
+#endif
+
+	/* Prevent further attempts at sending subcommands. */
+	spin_lock_irqsave(&con->lock, flags);
+	con->state = NX_CON_STATE_REMOVED;
+	spin_unlock_irqrestore(&con->lock, flags);
+	wake_up(&con->wait);
+
+#if IS_ENABLED(CONFIG_NINTENDO_FF)
+	hrtimer_cancel(&con->ff_timer);
+#endif
+	hrtimer_cancel(&con->rumble_timer);
+	cancel_work_sync(&con->output_worker);
+	nx_con_flush_subcmds(con, -ENODEV);
 }
 
 static int nx_con_usb_handshake(struct nx_con *con)
@@ -2483,6 +5726,198 @@ static int nx_con_usb_handshake(struct nx_con *con)
 	return 0;
 }
 
+/*
+ * Per-controller sysfs attributes
+ */
+static ssize_t nx_con_rumble_mode_show(struct device *dev,
+				       struct device_attribute *attr,
+				       char *buf)
+{
+	struct nx_con *con = hid_get_drvdata(to_hid_device(dev));
+
+	return sysfs_emit(buf, "%s\n",
+			  nx_con_rumble_mode_names[READ_ONCE(con->rumble_mode)]);
+}
+
+static ssize_t nx_con_rumble_mode_store(struct device *dev,
+					struct device_attribute *attr,
+					const char *buf,
+					size_t count)
+{
+	struct nx_con *con = hid_get_drvdata(to_hid_device(dev));
+	unsigned long flags;
+	int mode;
+
+	if ((mode = sysfs_match_string(nx_con_rumble_mode_names, buf)) < 0)
+		return mode;
+
+	spin_lock_irqsave(&con->lock, flags);
+	con->rumble_mode = mode;
+	spin_unlock_irqrestore(&con->lock, flags);
+
+	return count;
+}
+
+static ssize_t nx_con_rumble_coalesced_show(struct device *dev,
+					    struct device_attribute *attr,
+					    char *buf)
+{
+	struct nx_con *con = hid_get_drvdata(to_hid_device(dev));
+	unsigned long flags;
+	unsigned long coalesced;
+
+	spin_lock_irqsave(&con->lock, flags);
+	coalesced = con->rumble_coalesced;
+	spin_unlock_irqrestore(&con->lock, flags);
+
+	return sysfs_emit(buf, "%lu\n", coalesced);
+}
+
+static ssize_t nx_con_reports_unchanged_show(struct device *dev,
+					     struct device_attribute *attr,
+					     char *buf)
+{
+	struct nx_con *con = hid_get_drvdata(to_hid_device(dev));
+
+	return sysfs_emit(buf, "%lu\n", READ_ONCE(con->reports_unchanged));
+}
+
+static ssize_t nx_con_report_mode_show(struct device *dev,
+				       struct device_attribute *attr,
+				       char *buf)
+{
+	struct nx_con *con = hid_get_drvdata(to_hid_device(dev));
+
+	return sysfs_emit(buf, "%s\n",
+			  nx_con_report_mode_names[READ_ONCE(con->report_mode_pref)]);
+}
+
+static ssize_t nx_con_report_mode_store(struct device *dev,
+					struct device_attribute *attr,
+					const char *buf,
+					size_t count)
+{
+	struct nx_con *con = hid_get_drvdata(to_hid_device(dev));
+	enum nx_con_report_mode_pref old;
+	int pref;
+	int ret = 0;
+
+	if ((pref = sysfs_match_string(nx_con_report_mode_names, buf)) < 0)
+		return pref;
+
+	mutex_lock(&con->features_mutex);
+	old = con->report_mode_pref;
+	con->report_mode_pref = pref;
+	if (nx_con_choose_report_mode(con) != con->report_mode &&
+	    (ret = nx_con_set_report_mode(con)))
+		con->report_mode_pref = old;
+	mutex_unlock(&con->features_mutex);
+
+	return ret ? ret : count;
+}
+
+static ssize_t nx_con_imu_setting_show(struct device *dev,
+				       struct device_attribute *attr,
+				       char *buf)
+{
+	struct nx_con *con = hid_get_drvdata(to_hid_device(dev));
+	uintptr_t setting = (uintptr_t)container_of(attr, struct dev_ext_attribute, attr)->var;
+
+	return sysfs_emit(buf, "%u\n",
+			  nx_con_imu_setting_values[setting][READ_ONCE(con->imu_settings[setting])]);
+}
+
+static ssize_t nx_con_imu_setting_store(struct device *dev,
+					struct device_attribute *attr,
+					const char *buf,
+					size_t count)
+{
+	struct nx_con *con = hid_get_drvdata(to_hid_device(dev));
+	uintptr_t setting = (uintptr_t)container_of(attr, struct dev_ext_attribute, attr)->var;
+	unsigned int value;
+	u8 i;
+	int ret;
+
+	if ((ret = kstrtouint(buf, 0, &value)))
+		return ret;
+
+	for (i = 0; i < ARRAY_SIZE(nx_con_imu_setting_values[setting]); i++) {
+		if (value && nx_con_imu_setting_values[setting][i] == value)
+			break;
+	}
+	if (i == ARRAY_SIZE(nx_con_imu_setting_values[setting]))
+		return -EINVAL;
+
+	if ((ret = nx_con_set_imu_setting(con, setting, i)))
+		return ret;
+
+	return count;
+}
+
+#define NX_CON_IMU_SETTING_ATTR(_name, _setting)			\
+	struct dev_ext_attribute dev_attr_##_name = {			\
+		__ATTR(_name, 0644,					\
+		       nx_con_imu_setting_show,				\
+		       nx_con_imu_setting_store),			\
+		(void *)(_setting),					\
+	}
+
+static NX_CON_IMU_SETTING_ATTR(imu_gyro_range, NX_CON_IMU_SET_GYRO_RANGE);
+static NX_CON_IMU_SETTING_ATTR(imu_accel_range, NX_CON_IMU_SET_ACCEL_RANGE);
+static NX_CON_IMU_SETTING_ATTR(imu_gyro_rate, NX_CON_IMU_SET_GYRO_RATE);
+static NX_CON_IMU_SETTING_ATTR(imu_accel_bandwidth, NX_CON_IMU_SET_ACCEL_BANDWIDTH);
+
+static DEVICE_ATTR(report_mode, 0644,
+		   nx_con_report_mode_show, nx_con_report_mode_store);
+static DEVICE_ATTR(rumble_mode, 0644,
+		   nx_con_rumble_mode_show, nx_con_rumble_mode_store);
+static DEVICE_ATTR(rumble_coalesced, 0444,
+		   nx_con_rumble_coalesced_show, NULL);
+static DEVICE_ATTR(reports_unchanged, 0444,
+		   nx_con_reports_unchanged_show, NULL);
+
+static struct attribute *nx_con_attrs[] = {
+	&dev_attr_rumble_mode.attr,
+	&dev_attr_rumble_coalesced.attr,
+	&dev_attr_reports_unchanged.attr,
+	&dev_attr_report_mode.attr,
+	&dev_attr_imu_gyro_range.attr.attr,
+	&dev_attr_imu_accel_range.attr.attr,
+	&dev_attr_imu_gyro_rate.attr.attr,
+	&dev_attr_imu_accel_bandwidth.attr.attr,
+	NULL,
+};
+
+static umode_t nx_con_attr_is_visible(struct kobject *kobj,
+				      struct attribute *attr,
+				      int n)
+{
+	struct device *dev = kobj_to_dev(kobj);
+	struct nx_con *con = hid_get_drvdata(to_hid_device(dev));
+
+	if (attr == &dev_attr_rumble_mode.attr ||
+	    attr == &dev_attr_rumble_coalesced.attr)
+		return (IS_ENABLED(CONFIG_NINTENDO_FF) &&
+			nx_con_has_rumble(con)) ? attr->mode : 0;
+
+	if (attr == &dev_attr_imu_gyro_range.attr.attr ||
+	    attr == &dev_attr_imu_accel_range.attr.attr ||
+	    attr == &dev_attr_imu_gyro_rate.attr.attr ||
+	    attr == &dev_attr_imu_accel_bandwidth.attr.attr)
+		return nx_con_has_imu(con) ? attr->mode : 0;
+
+	if (attr == &dev_attr_report_mode.attr)
+		return (con->desc->simple_buttons &&
+			nx_con_is_digital_only(con)) ? attr->mode : 0;
+
+	return attr->mode;
+}
+
+static const struct attribute_group nx_con_attr_group = {
+	.attrs		= nx_con_attrs,
+	.is_visible	= nx_con_attr_is_visible,
+};
+
 static void nx_con_probe_hid_dbg_device(struct nx_con *con)
 {
 	hid_dbg(con->hdev, "device_is_left_joycon    = %d\n", nx_con_device_is_left_joycon(con));
@@ -2505,6 +5940,7 @@ static void nx_con_probe_hid_dbg_device(struct nx_con *con)
  	hid_dbg(con->hdev, "type_has_right_controls  = %d\n", nx_con_type_has_right_controls(con));
  	hid_dbg(con->hdev, "type_is_any_joycon       = %d\n", nx_con_type_is_any_joycon(con));
  	hid_dbg(con->hdev, "type_is_any_nescon       = %d\n", nx_con_type_is_any_nescon(con));
+ 	hid_dbg(con->hdev, "caps                     = %#x\n", con->caps);
  	hid_dbg(con->hdev, "has_imu                  = %d\n", nx_con_has_imu(con));
  	hid_dbg(con->hdev, "has_joysticks            = %d\n", nx_con_has_joysticks(con));
  	hid_dbg(con->hdev, "has_rumble               = %d\n", nx_con_has_rumble(con));
@@ -2515,6 +5951,8 @@ static int nx_hid_probe(struct hid_device *hdev,
 			const struct hid_device_id *id)
 {
 	int ret;
+	int i;
+	bool deferred = READ_ONCE(deferred_setup);
 	struct nx_con *con;
 
 	hid_dbg(hdev, "probe - start\n");
@@ -2526,21 +5964,23 @@ static int nx_hid_probe(struct hid_device *hdev,
 
 	con->hdev = hdev;
 	con->state = NX_CON_STATE_INIT;
-	con->rumble_queue_head = NX_CON_RUMBLE_QUEUE_SIZE - 1;
-	con->rumble_queue_tail = 0;
 	hid_set_drvdata(hdev, con);
 	mutex_init(&con->output_mutex);
+	mutex_init(&con->features_mutex);
+	memcpy(con->imu_settings, nx_con_imu_dflt_settings, sizeof(con->imu_settings));
 	init_waitqueue_head(&con->wait);
+	init_completion(&con->input_report);
 	spin_lock_init(&con->lock);
-
-	if ((ret = nx_con_init_rumble_worker(con))) {
-		hid_err(hdev, "Failed to initialize rumble worker/queue\n");
-		goto err_wq;
-	}
+	seqcount_spinlock_init(&con->cal_seq, &con->lock);
+	for (i = 0; i < NX_CON_SUBCMD_NUM_PRIOS; i++)
+		INIT_LIST_HEAD(&con->subcmd_queue[i]);
+	INIT_WORK(&con->setup_worker, nx_con_setup_worker);
+	INIT_WORK(&con->idle_worker, nx_con_idle_worker);
+	nx_con_init_output_workers(con);
 
 	if ((ret = hid_parse(hdev))) {
 		hid_err(hdev, "HID parse failed\n");
-		goto err_wq;
+		goto err;
 	}
 
 	/*
@@ -2554,7 +5994,7 @@ static int nx_hid_probe(struct hid_device *hdev,
 
 	if ((ret = hid_hw_start(hdev, HID_CONNECT_HIDRAW))) {
 		hid_err(hdev, "HW start failed\n");
-		goto err_wq;
+		goto err;
 	}
 
 	if ((ret = hid_hw_open(hdev))) {
@@ -2564,57 +6004,49 @@ static int nx_hid_probe(struct hid_device *hdev,
 
 	hid_device_io_start(hdev);
 
-	mutex_lock(&con->output_mutex);
-
-	if (nx_con_using_usb(con) && (ret = nx_con_usb_handshake(con)))
-		goto err_mutex;
-
-	if ((ret = nx_con_set_report_mode(con))) {
-		hid_err(hdev, "Failed to set report mode; ret=%d\n", ret);
-		goto err_mutex;
-	}
-
-	/* needed for `con->type` */
-	if ((ret = nx_con_request_device_info(con))) {
-		hid_err(hdev, "Failed to retrieve controller info; ret=%d\n", ret);
-		goto err_mutex;
+	if (nx_con_using_usb(con)) {
+		mutex_lock(&con->output_mutex);
+		ret = nx_con_usb_handshake(con);
+		mutex_unlock(&con->output_mutex);
+		if (ret)
+			goto err_close;
 	}
 
-	if (nx_con_has_joysticks(con)) {
-		if (nx_con_request_calibration(con)) {
-			/*
-			* We can function with default calibration, but it may be
-			* inaccurate. Provide a warning, and continue on.
-			*/
-			hid_warn(hdev, "Analog stick positions may be inaccurate\n");
+	/*
+	 * Device info is needed for `con->type`. A cached controller already
+	 * has it, as well as all of its calibration.
+	 */
+	if (!nx_con_cal_cache_restore(con, NULL)) {
+		if ((ret = nx_con_request_device_info(con))) {
+			hid_err(hdev, "Failed to retrieve controller info; ret=%d\n", ret);
+			goto err_close;
 		}
+		nx_con_cal_cache_restore(con, con->mac_addr);
 	}
+	nx_con_select_desc(con);
 
-	if (nx_con_has_imu(con)) {
-		if (nx_con_request_imu_calibration(con)) {
-			/*
-			* We can function with default calibration, but it may be
-			* inaccurate. Provide a warning, and continue on.
-			*/
-			hid_warn(hdev, "Unable to read IMU calibration data\n");
-		}
-
-		if ((ret = nx_con_enable_imu(con))) {
-			hid_err(hdev, "Failed to enable the IMU; ret=%d\n", ret);
-			goto err_mutex;
-		}
+	/* which report mode suits the controller depends on its type */
+	if ((ret = nx_con_set_report_mode(con))) {
+		hid_err(hdev, "Failed to set report mode; ret=%d\n", ret);
+		goto err_close;
 	}
 
-	if (nx_con_has_rumble(con)) {
-		if ((ret = nx_con_enable_rumble(con))) {
-			hid_err(hdev, "Failed to enable rumble; ret=%d\n", ret);
-			goto err_mutex;
+	if (!deferred) {
+		if ((ret = nx_con_setup_features(con)))
+			goto err_close;
+	} else if (!con->calibrated) {
+		/* until nx_con_setup_worker reads the real calibration */
+		if (nx_con_has_joysticks(con)) {
+			nx_con_set_default_stick_cal(&con->left_stick_cal_x,
+						     &con->left_stick_cal_y);
+			nx_con_set_default_stick_cal(&con->right_stick_cal_x,
+						     &con->right_stick_cal_y);
 		}
-
+		if (nx_con_has_imu(con))
+			nx_con_set_default_imu_cal(con);
+		nx_con_cal_changed(con);
 	}
 
-	mutex_unlock(&con->output_mutex);
-
 	if ((ret = nx_con_leds_create(con))) {
 		hid_err(hdev, "Failed to create leds; ret=%d\n", ret);
 		goto err_close;
@@ -2630,21 +6062,35 @@ static int nx_hid_probe(struct hid_device *hdev,
 		goto err_close;
 	}
 
+	if ((ret = devm_device_add_group(&hdev->dev, &nx_con_attr_group))) {
+		hid_err(hdev, "Failed to create sysfs attributes; ret=%d\n", ret);
+		goto err_close;
+	}
+
+#if IS_ENABLED(CONFIG_NINTENDO_FF)
+	if (nx_con_has_rumble(con) && (ret = nx_con_stream_create(con))) {
+		hid_err(hdev, "Failed to create rumble stream device; ret=%d\n", ret);
+		goto err_close;
+	}
+#endif
+
+	nx_con_debugfs_create(con);
+
 	con->state = NX_CON_STATE_READ;
 
+	if (deferred)
+		queue_work(system_long_wq, &con->setup_worker);
+
 	nx_con_probe_hid_dbg_device(con);
 	hid_dbg(hdev, "probe - success\n");
 
 	return 0;
 
-err_mutex:
-	mutex_unlock(&con->output_mutex);
 err_close:
+	nx_con_stop_output(con);
 	hid_hw_close(hdev);
 err_stop:
 	hid_hw_stop(hdev);
-err_wq:
-	destroy_workqueue(con->rumble_queue);
 err:
 	hid_err(hdev, "probe - fail = %d\n", ret);
 	return ret;
@@ -2653,16 +6099,15 @@ err:
 static void nx_hid_remove(struct hid_device *hdev)
 {
 	struct nx_con *con = hid_get_drvdata(hdev);
-	unsigned long flags;
 
 	hid_dbg(hdev, "remove\n");
 
-	/* Prevent further attempts at sending subcommands. */
-	spin_lock_irqsave(&con->lock, flags);
-	con->state = NX_CON_STATE_REMOVED;
-	spin_unlock_irqrestore(&con->lock, flags);
+	nx_con_debugfs_remove(con);
 
-	destroy_workqueue(con->rumble_queue);
+	/* this also fails whatever the setup worker might be waiting on */
+	nx_con_stop_output(con);
+	cancel_work_sync(&con->setup_worker);
+	cancel_work_sync(&con->idle_worker);
 
 	hid_hw_close(hdev);
 	hid_hw_stop(hdev);
@@ -2692,7 +6137,51 @@ static struct hid_driver nx_hid_driver = {
 	.remove		= nx_hid_remove,
 	.raw_event	= nx_hid_event,
 };
-module_hid_driver(nx_hid_driver);
+
+static int __init nx_hid_init(void)
+{
+	int ret;
+
+#if IS_ENABLED(CONFIG_NINTENDO_FF)
+	nx_con_init_rumble_tables();
+#endif
+
+	/*
+	 * Output for every controller is handled on this one queue. Rumble
+	 * is latency sensitive, hence WQ_HIGHPRI; WQ_FREEZABLE keeps output
+	 * from being sent to controllers while the system is suspending.
+	 */
+	if (!(nx_con_output_wq = alloc_workqueue("hid-nx-output",
+						 WQ_HIGHPRI | WQ_FREEZABLE,
+						 0)))
+		return -ENOMEM;
+
+	nx_hid_debugfs_dir = debugfs_create_dir("hid-nx", NULL);
+	debugfs_create_file("cal_cache",
+			    0600,
+			    nx_hid_debugfs_dir,
+			    NULL,
+			    &nx_con_cal_cache_fops);
+
+	if ((ret = hid_register_driver(&nx_hid_driver))) {
+		debugfs_remove_recursive(nx_hid_debugfs_dir);
+		destroy_workqueue(nx_con_output_wq);
+	}
+
+	return ret;
+}
+
+static void __exit nx_hid_exit(void)
+{
+	hid_unregister_driver(&nx_hid_driver);
+	destroy_workqueue(nx_con_output_wq);
+	debugfs_remove_recursive(nx_hid_debugfs_dir);
+	nx_con_cal_cache_clear();
+	ida_destroy(&nx_con_player_ida);
+}
+
+module_init(nx_hid_init);
+module_exit(nx_hid_exit);
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Emily Strickland <linux@emily.st>");
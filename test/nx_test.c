@@ -0,0 +1,305 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Userspace checks for hid-nx; see the Makefile.
+ *
+ * IMU conversion: the driver converts IMU samples with precomputed Q20
+ * multipliers. This compares it with the division it replaced, which must
+ * never be off by more than 1 LSB, over:
+ *   - every 16-bit raw value, with the default calibration and with
+ *     NX_TEST_IMU_CALS pseudo-random calibrations near the factory values,
+ *     as the left and the right Joy-Con (whose Y and Z axes are negated)
+ *   - the samples of any recorded reports given on the command line, with
+ *     the same calibrations
+ *
+ * Rumble: frames pushed in latest mode must replace the ones that haven't
+ * gone out yet, and be counted as coalesced; in queue mode, each must go out
+ * once, in order.
+ *
+ * Recorded reports are text files with one report per line, in hex (spaces
+ * allowed), as read from the controller's hidraw node, e.g. with
+ *   xxd -p -c 49 /dev/hidrawN > capture.txt
+ * over Bluetooth. Only full (0x30) reports are used.
+ */
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nx_test.h"
+
+#define NX_TEST_IMU_CALS	400
+
+/* the driver's offsets, and size, of the samples in a full report */
+#define NX_TEST_REPORT_IMU_OFFSET	13
+#define NX_TEST_REPORT_SIZE		(NX_TEST_REPORT_IMU_OFFSET + 3 * 12)
+
+struct nx_test_imu_cal {
+	short accel_offset[3];
+	short accel_scale[3];
+	short gyro_offset[3];
+	short gyro_scale[3];
+	int right_joycon;
+};
+
+static int verbose;
+
+/* hid_dbg() and friends end up here; only errors are shown without -v */
+int printk(const char *fmt, ...)
+{
+	int level = 4; /* KERN_WARNING, as the kernel defaults to */
+	va_list ap;
+	int ret;
+
+	/* skip the log level, if any */
+	if (fmt[0] == '\001') {
+		level = fmt[1] - '0';
+		fmt += 2;
+	}
+
+	if (!verbose && level > 3)
+		return 0;
+
+	va_start(ap, fmt);
+	ret = vprintf(fmt, ap);
+	va_end(ap);
+	return ret;
+}
+
+void *kmemdup(const void *src, size_t len, unsigned int gfp)
+{
+	void *p = malloc(len);
+
+	if (p)
+		memcpy(p, src, len);
+	return p;
+}
+
+void kfree(const void *p)
+{
+	free((void *)p);
+}
+
+/* The arithmetic nx_con_calc_imu_mults() replaced, axis by axis */
+static int nx_test_imu_old_value(const struct nx_test_imu_cal *cal, int axis, short raw)
+{
+	int i = axis % 3;
+	int value;
+	int x, q, r, d;
+
+	if (axis < 3) {
+		value = ((int)raw * cal->accel_scale[i]) /
+			(cal->accel_scale[i] - cal->accel_offset[i]);
+	} else {
+		/* mult_frac(x, scale, d) */
+		x = 1000 * (raw - cal->gyro_offset[i]);
+		d = cal->gyro_scale[i] - cal->gyro_offset[i];
+		q = x / d;
+		r = x % d;
+		value = q * cal->gyro_scale[i] + r * cal->gyro_scale[i] / d;
+	}
+
+	if (cal->right_joycon && i > 0)
+		value = -value;
+	return value;
+}
+
+struct nx_test_imu_stats {
+	unsigned long compared;
+	unsigned long off_by_one;
+	unsigned long failed;
+};
+
+static void nx_test_imu_compare(const struct nx_test_imu_cal *cal,
+				const short raw[6],
+				struct nx_test_imu_stats *stats)
+{
+	int value[6];
+	int old;
+	int i;
+
+	nx_test_imu_convert(raw, value);
+
+	for (i = 0; i < 6; i++) {
+		old = nx_test_imu_old_value(cal, i, raw[i]);
+		stats->compared++;
+		if (value[i] == old)
+			continue;
+		if (abs(value[i] - old) == 1) {
+			stats->off_by_one++;
+			continue;
+		}
+		if (!stats->failed++)
+			fprintf(stderr,
+				"imu: axis %d raw %d: got %d, the division gave %d\n",
+				i, raw[i], value[i], old);
+	}
+}
+
+static void nx_test_imu_use_cal(const struct nx_test_imu_cal *cal)
+{
+	nx_test_imu_set_cal(cal->accel_offset, cal->accel_scale,
+			    cal->gyro_offset, cal->gyro_scale,
+			    cal->right_joycon);
+}
+
+/* a fixed LCG, so that every run checks the same calibrations */
+static unsigned int nx_test_rand_state = 1;
+
+static int nx_test_rand(int lo, int hi)
+{
+	nx_test_rand_state = nx_test_rand_state * 1103515245 + 12345;
+	return lo + (int)((nx_test_rand_state >> 8) % (unsigned int)(hi - lo + 1));
+}
+
+static void nx_test_imu_make_cals(struct nx_test_imu_cal *cals, int count)
+{
+	int n;
+	int i;
+
+	for (n = 0; n < count; n++) {
+		/* the first pair is the driver's default calibration */
+		for (i = 0; i < 3; i++) {
+			cals[n].accel_offset[i] = n < 2 ? 0 : nx_test_rand(-700, 700);
+			cals[n].accel_scale[i] = n < 2 ? 16384 : nx_test_rand(15300, 17400);
+			cals[n].gyro_offset[i] = n < 2 ? 0 : nx_test_rand(-150, 150);
+			cals[n].gyro_scale[i] = n < 2 ? 13371 : nx_test_rand(12700, 14000);
+		}
+		cals[n].right_joycon = n & 1;
+	}
+}
+
+/* Parses a line of hex into a report; returns its length */
+static int nx_test_parse_report(const char *line, unsigned char *buf, int size)
+{
+	int len = 0;
+	int hi = -1;
+	int digit;
+
+	for (; *line; line++) {
+		if (isspace((unsigned char)*line))
+			continue;
+		if (!isxdigit((unsigned char)*line))
+			return -1;
+		digit = isdigit((unsigned char)*line) ? *line - '0' :
+			tolower((unsigned char)*line) - 'a' + 10;
+		if (hi < 0) {
+			hi = digit;
+			continue;
+		}
+		if (len == size)
+			return -1;
+		buf[len++] = hi << 4 | digit;
+		hi = -1;
+	}
+
+	return hi < 0 ? len : -1;
+}
+
+/* Reads the samples of the full reports in a capture; returns how many */
+static long nx_test_read_capture(const char *path, short (**samples)[6])
+{
+	unsigned char report[256];
+	short (*s)[6] = NULL;
+	long count = 0;
+	char line[1024];
+	FILE *f;
+	int len;
+	int i;
+	int j;
+
+	if (!(f = fopen(path, "r"))) {
+		perror(path);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		len = nx_test_parse_report(line, report, sizeof(report));
+		if (len < NX_TEST_REPORT_SIZE || report[0] != 0x30)
+			continue;
+
+		if (!(s = realloc(s, (count + 3) * sizeof(*s)))) {
+			fclose(f);
+			return -1;
+		}
+		for (i = 0; i < 3; i++, count++) {
+			for (j = 0; j < 6; j++) {
+				const unsigned char *p = report + NX_TEST_REPORT_IMU_OFFSET +
+							 i * 12 + j * 2;
+
+				s[count][j] = (short)(p[0] | p[1] << 8);
+			}
+		}
+	}
+
+	fclose(f);
+	*samples = s;
+	return count;
+}
+
+static int nx_test_imu(int ncaptures, char **captures)
+{
+	static struct nx_test_imu_cal cals[NX_TEST_IMU_CALS + 2];
+	struct nx_test_imu_stats sweep = { 0 };
+	struct nx_test_imu_stats recorded = { 0 };
+	short (*samples)[6];
+	short raw[6];
+	long count;
+	long n;
+	int c;
+	int v;
+	int i;
+
+	nx_test_imu_make_cals(cals, NX_TEST_IMU_CALS + 2);
+
+	for (c = 0; c < NX_TEST_IMU_CALS + 2; c++) {
+		nx_test_imu_use_cal(&cals[c]);
+		for (v = -32768; v <= 32767; v++) {
+			for (i = 0; i < 6; i++)
+				raw[i] = v;
+			nx_test_imu_compare(&cals[c], raw, &sweep);
+		}
+	}
+	printf("imu: %lu values over every raw value, %lu off by 1, %lu off by more\n",
+	       sweep.compared, sweep.off_by_one, sweep.failed);
+
+	for (i = 0; i < ncaptures; i++) {
+		if ((count = nx_test_read_capture(captures[i], &samples)) < 0)
+			return 1;
+
+		for (c = 0; c < NX_TEST_IMU_CALS + 2; c++) {
+			nx_test_imu_use_cal(&cals[c]);
+			for (n = 0; n < count; n++)
+				nx_test_imu_compare(&cals[c], samples[n], &recorded);
+		}
+		printf("imu: %s: %ld samples\n", captures[i], count);
+		free(samples);
+	}
+	if (ncaptures)
+		printf("imu: %lu values from recorded reports, %lu off by 1, %lu off by more\n",
+		       recorded.compared, recorded.off_by_one, recorded.failed);
+
+	return sweep.failed || recorded.failed;
+}
+
+int main(int argc, char **argv)
+{
+	int rumble_failed;
+	int failed = 0;
+
+	if (argc > 1 && !strcmp(argv[1], "-v")) {
+		verbose = 1;
+		argc--;
+		argv++;
+	}
+
+	failed |= nx_test_imu(argc - 1, argv + 1);
+
+	rumble_failed = nx_test_rumble();
+	printf("rumble: %d checks failed\n", rumble_failed);
+	failed |= rumble_failed != 0;
+
+	printf("%s\n", failed ? "FAIL" : "PASS");
+	return failed;
+}
@@ -0,0 +1,22 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * What nx_test_driver.c, which is built with hid-nx.c in the kernel's
+ * environment, offers the userspace side of the checks in nx_test.c.
+ */
+#ifndef NX_TEST_H
+#define NX_TEST_H
+
+/* Sets the calibration that nx_test_imu_convert() applies */
+void nx_test_imu_set_cal(const short accel_offset[3],
+			 const short accel_scale[3],
+			 const short gyro_offset[3],
+			 const short gyro_scale[3],
+			 int right_joycon);
+
+/* Converts a raw IMU sample (accel x, y, z, then gyro x, y, z) as the driver does */
+void nx_test_imu_convert(const short raw[6], int value[6]);
+
+/* Checks rumble frames are sent, and coalesced, as they should be; returns how many checks failed */
+int nx_test_rumble(void);
+
+#endif /* NX_TEST_H */
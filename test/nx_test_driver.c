@@ -0,0 +1,202 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * The driver's side of the checks: hid-nx.c itself, built against
+ * nx_test_kernel.h, and wrappers around the parts of it that are checked.
+ * Kernel functions that the checked code calls are defined here too.
+ */
+
+#include "../hid-nx.c"
+
+#include "nx_test.h"
+
+s64 div_s64(s64 dividend, s32 divisor)
+{
+	return dividend / divisor;
+}
+
+/* time moves on by a rumble period whenever it's read, so nothing waits */
+static ktime_t nx_test_now;
+
+ktime_t ktime_get(void)
+{
+	return nx_test_now += NX_CON_RUMBLE_PERIOD_MS * NSEC_PER_MSEC;
+}
+
+ktime_t ms_to_ktime(u64 ms)
+{
+	return ms * NSEC_PER_MSEC;
+}
+
+s64 ktime_us_delta(ktime_t later, ktime_t earlier)
+{
+	return (later - earlier) / NSEC_PER_USEC;
+}
+
+/* outputs are never rate limited, given the clock above */
+unsigned long usecs_to_jiffies(unsigned int us)
+{
+	return us;
+}
+
+void reinit_completion(struct completion *x)
+{
+}
+
+unsigned long wait_for_completion_timeout(struct completion *x, unsigned long timeout)
+{
+	return timeout;
+}
+
+void usleep_range(unsigned long min, unsigned long max)
+{
+}
+
+void spin_lock_init(spinlock_t *lock)
+{
+}
+
+bool queue_work(struct workqueue_struct *wq, struct work_struct *work)
+{
+	return true;
+}
+
+void wake_up(wait_queue_head_t *wq)
+{
+}
+
+void hrtimer_start(struct hrtimer *timer, ktime_t time, enum hrtimer_mode mode)
+{
+}
+
+static struct nx_con nx_test_imu_con;
+
+void nx_test_imu_set_cal(const short accel_offset[3],
+			 const short accel_scale[3],
+			 const short gyro_offset[3],
+			 const short gyro_scale[3],
+			 int right_joycon)
+{
+	struct nx_con *con = &nx_test_imu_con;
+	int i;
+
+	con->type = right_joycon ? NX_CON_TYPE_JCR : NX_CON_TYPE_PRO;
+	for (i = 0; i < 3; i++) {
+		con->accel_cal.offset[i] = accel_offset[i];
+		con->accel_cal.scale[i] = accel_scale[i];
+		con->gyro_cal.offset[i] = gyro_offset[i];
+		con->gyro_cal.scale[i] = gyro_scale[i];
+	}
+	nx_con_calc_imu_mults(con, &con->cal);
+}
+
+void nx_test_imu_convert(const short raw[6], int value[6])
+{
+	struct nx_con *con = &nx_test_imu_con;
+	int i;
+
+	for (i = 0; i < NX_CON_IMU_NUM_AXES; i++)
+		value[i] = nx_con_imu_value(raw[i],
+					    con->cal.imu_offset[i],
+					    con->cal.imu_mult[i]);
+}
+
+static struct nx_con nx_test_rumble_con;
+static char nx_test_rumble_sent[32]; /* the first byte of each frame sent */
+static int nx_test_rumble_nsent;
+static char nx_test_rumble_push_on_send; /* pushed by the next send, if set */
+
+static void nx_test_rumble_push(char frame)
+{
+	u8 data[NX_CON_RUMBLE_DATA_SIZE] = { frame };
+
+	nx_con_push_rumble_frame(&nx_test_rumble_con, data, true);
+}
+
+int hid_hw_output_report(struct hid_device *hdev, u8 *buf, size_t len)
+{
+	struct nx_con_rumble_output *out = (struct nx_con_rumble_output *)buf;
+	char frame = nx_test_rumble_push_on_send;
+
+	if (nx_test_rumble_nsent < sizeof(nx_test_rumble_sent) - 1)
+		nx_test_rumble_sent[nx_test_rumble_nsent++] = out->rumble_data[0];
+
+	if (frame) {
+		nx_test_rumble_push_on_send = 0;
+		nx_test_rumble_push(frame);
+	}
+	return len;
+}
+
+/* Does what the output worker would with only rumble to send */
+static void nx_test_rumble_run_worker(void)
+{
+	struct nx_con *con = &nx_test_rumble_con;
+	int i;
+
+	memset(nx_test_rumble_sent, 0, sizeof(nx_test_rumble_sent));
+	nx_test_rumble_nsent = 0;
+	for (i = 0; i < 16 && READ_ONCE(con->rumble_pending); i++)
+		nx_con_output_rumble(con);
+}
+
+static int nx_test_rumble_expect(const char *what, const char *sent,
+				 unsigned long coalesced)
+{
+	struct nx_con *con = &nx_test_rumble_con;
+
+	if (strcmp(nx_test_rumble_sent, sent) ||
+	    con->rumble_coalesced != coalesced || con->rumble_pending) {
+		printk(KERN_ERR "rumble: %s: sent \"%s\", %lu coalesced%s; expected \"%s\", %lu\n",
+		       what, nx_test_rumble_sent, con->rumble_coalesced,
+		       con->rumble_pending ? ", still pending" : "",
+		       sent, coalesced);
+		return 1;
+	}
+	return 0;
+}
+
+int nx_test_rumble(void)
+{
+	struct nx_con *con = &nx_test_rumble_con;
+	struct hid_device hdev = { 0 };
+	int failed = 0;
+
+	con->hdev = &hdev;
+	con->state = NX_CON_STATE_READ;
+	con->rumble_mode = NX_CON_RUMBLE_MODE_LATEST;
+
+	nx_test_rumble_push('A');
+	nx_test_rumble_run_worker();
+	failed += nx_test_rumble_expect("one frame", "A", 0);
+
+	nx_test_rumble_push('B');
+	nx_test_rumble_push('C');
+	nx_test_rumble_push('D');
+	nx_test_rumble_run_worker();
+	failed += nx_test_rumble_expect("a burst", "D", 2);
+
+	nx_con_queue_rumble(con);
+	nx_test_rumble_run_worker();
+	failed += nx_test_rumble_expect("a refresh", "D", 2);
+
+	nx_test_rumble_push_on_send = 'F';
+	nx_test_rumble_push('E');
+	nx_test_rumble_run_worker();
+	failed += nx_test_rumble_expect("a frame pushed while sending", "EF", 2);
+
+	con->rumble_mode = NX_CON_RUMBLE_MODE_QUEUE;
+	nx_test_rumble_push('G');
+	nx_test_rumble_push('H');
+	nx_test_rumble_push('I');
+	nx_test_rumble_run_worker();
+	failed += nx_test_rumble_expect("queue mode", "GHI", 2);
+
+	nx_test_rumble_push('J');
+	nx_test_rumble_push('K');
+	con->rumble_mode = NX_CON_RUMBLE_MODE_LATEST;
+	nx_test_rumble_push('L');
+	nx_test_rumble_run_worker();
+	failed += nx_test_rumble_expect("a backlog from queue mode", "L", 4);
+
+	return failed;
+}
@@ -0,0 +1,707 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * Just enough of the kernel's API for hid-nx.c to build as part of a userspace
+ * program (see the Makefile). Every kernel header the driver includes resolves
+ * to this one. Most of it is only declared; whatever the checks actually call
+ * is defined in nx_test_driver.c or, where it needs libc, in nx_test.c.
+ */
+#ifndef NX_TEST_KERNEL_H
+#define NX_TEST_KERNEL_H
+
+#include <linux/input-event-codes.h>
+
+typedef unsigned char u8; typedef unsigned short u16; typedef unsigned int u32; typedef unsigned long long u64;
+typedef signed char s8; typedef short s16; typedef int s32; typedef long long s64;
+typedef u8 __u8; typedef u16 __u16; typedef u32 __u32; typedef u64 __u64; typedef s16 __s16; typedef s32 __s32; typedef s64 __s64;
+typedef unsigned long size_t; typedef long ssize_t; typedef long long loff_t; typedef _Bool bool;
+typedef s64 ktime_t; typedef unsigned int gfp_t; typedef unsigned short umode_t;
+#define true 1
+#define false 0
+#define NULL ((void *)0)
+#define __packed __attribute__((packed))
+#define __aligned(x) __attribute__((aligned(x)))
+#define __ro_after_init
+#define __init
+#define __exit
+#define __user
+#define __maybe_unused __attribute__((unused))
+#define likely(x) (x)
+#define unlikely(x) (x)
+#define BIT(n) (1UL << (n))
+#define BIT_ULL(n) (1ULL << (n))
+#define GENMASK(h, l) (((~0UL) << (l)) & (~0UL >> (63 - (h))))
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define BUILD_BUG_ON(c) ((void)sizeof(char[1 - 2 * !!(c)]))
+#define offsetof(t, m) __builtin_offsetof(t, m)
+#define container_of(p, t, m) ((t *)((char *)(p) - offsetof(t, m)))
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define min_t(t, a, b) ((t)(a) < (t)(b) ? (t)(a) : (t)(b))
+#define max_t(t, a, b) ((t)(a) > (t)(b) ? (t)(a) : (t)(b))
+#define clamp(v, lo, hi) min(max(v, lo), hi)
+#define clamp_t(t, v, lo, hi) ((t)clamp((t)(v), (t)(lo), (t)(hi)))
+#define clamp_val(v, lo, hi) clamp(v, lo, hi)
+#define abs(x) ((x) < 0 ? -(x) : (x))
+#define swap(a, b) do { typeof(a) __t = (a); (a) = (b); (b) = __t; } while (0)
+#define mult_frac(x, n, d) ((x) / (d) * (n) + ((x) % (d)) * (n) / (d))
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+#define DIV_ROUND_CLOSEST(n, d) ((n) / (d))
+#define READ_ONCE(x) (x)
+#define WRITE_ONCE(x, v) ((x) = (v))
+#define IS_ENABLED(x) 1
+#define IS_REACHABLE(x) 1
+#define KERNEL_VERSION(a, b, c) (((a) << 16) + ((b) << 8) + (c))
+#define LINUX_VERSION_CODE KERNEL_VERSION(6, 6, 0)
+#define EINVAL 22
+#define ENOMEM 12
+#define ENODEV 19
+#define ETIMEDOUT 110
+#define EBUSY 16
+#define EAGAIN 11
+#define EFAULT 14
+#define ENOENT 2
+#define EIO 5
+#define ENODATA 61
+#define ENOSPC 28
+#define EOPNOTSUPP 95
+#define ECANCELED 125
+#define ENOTTY 25
+#define EPERM 1
+#define ENOSYS 38
+#define ERANGE 34
+#define EPROTO 71
+#define ESHUTDOWN 108
+#define GFP_KERNEL 0u
+#define GFP_ATOMIC 1u
+#define HZ 250
+#define PAGE_SIZE 4096
+#define U8_MAX 255
+#define U16_MAX 65535
+#define S16_MAX 32767
+#define S16_MIN (-32768)
+#define U32_MAX 0xffffffffu
+#define S32_MAX 0x7fffffff
+#define S32_MIN (-S32_MAX - 1)
+#define NSEC_PER_USEC 1000L
+#define NSEC_PER_MSEC 1000000L
+#define NSEC_PER_SEC 1000000000L
+#define USEC_PER_MSEC 1000L
+#define USEC_PER_SEC 1000000L
+#define MSEC_PER_SEC 1000L
+#define IS_ERR(p) ((unsigned long)(p) > (unsigned long)-4096)
+#define PTR_ERR(p) ((long)(p))
+#define ERR_PTR(e) ((void *)(long)(e))
+#define IS_ERR_OR_NULL(p) (!(p) || IS_ERR(p))
+#define WARN_ON(c) (c)
+#define WARN_ON_ONCE(c) (c)
+#define S_IRUGO 0444
+#define S_IWUSR 0200
+#define S_IRUSR 0400
+#define EXPORT_SYMBOL(x)
+#define MODULE_LICENSE(x)
+#define MODULE_AUTHOR(x)
+#define MODULE_DESCRIPTION(x)
+#define MODULE_DEVICE_TABLE(a, b)
+#define MODULE_PARM_DESC(a, b)
+#define module_param(n, t, p) static void *__mp_##n __attribute__((unused)) = &n
+#define module_param_named(n, v, t, p) static void *__mp_##n __attribute__((unused)) = &v
+#define module_init(f) static void *__mi __attribute__((unused)) = f
+#define module_exit(f) static void *__me __attribute__((unused)) = f
+#define module_hid_driver(d) static void *__md __attribute__((unused)) = &d
+#define THIS_MODULE ((struct module *)0)
+struct module;
+
+int printk(const char *, ...);
+#define KERN_ERR "\0013"
+#define KERN_WARNING "\0014"
+#define KERN_NOTICE "\0015"
+#define KERN_INFO "\0016"
+#define KERN_DEBUG "\0017"
+int sprintf(char *, const char *, ...);
+int snprintf(char *, size_t, const char *, ...);
+int scnprintf(char *, size_t, const char *, ...);
+int sysfs_emit(char *, const char *, ...);
+int sysfs_emit_at(char *, int, const char *, ...);
+int sscanf(const char *, const char *, ...);
+int kstrtobool(const char *, bool *);
+int kstrtobool_from_user(const char __user *, size_t, bool *);
+int kstrtouint(const char *, unsigned int, unsigned int *);
+int kstrtoint(const char *, unsigned int, int *);
+int kstrtou8(const char *, unsigned int, u8 *);
+int sysfs_streq(const char *, const char *);
+int sysfs_match_string_impl(const char * const *, size_t, const char *);
+#define sysfs_match_string(a, s) sysfs_match_string_impl(a, ARRAY_SIZE(a), s)
+int match_string(const char * const *, size_t, const char *);
+char *strsep(char **, const char *);
+char *skip_spaces(const char *);
+char *strim(char *);
+size_t strlen(const char *);
+int strcmp(const char *, const char *);
+char *strchr(const char *, int);
+char *strnchr(const char *, size_t, int);
+void *memcpy(void *, const void *, size_t);
+void *memset(void *, int, size_t);
+int memcmp(const void *, const void *, size_t);
+void *memchr(const void *, int, size_t);
+void *kmalloc(size_t, gfp_t);
+void *kzalloc(size_t, gfp_t);
+void *kcalloc(size_t, size_t, gfp_t);
+void *kmemdup(const void *, size_t, gfp_t);
+void *kmalloc_array(size_t, size_t, gfp_t);
+void kfree(const void *);
+void *vzalloc(size_t);
+void vfree(const void *);
+char *kasprintf(gfp_t, const char *, ...);
+#define might_sleep() do { } while (0)
+#define lockdep_assert_held(l) do { } while (0)
+#define lockdep_assert_not_held(l) do { } while (0)
+#define hweight32(x) __builtin_popcount(x)
+#define __ffs(x) __builtin_ctzl(x)
+#define ffs(x) __builtin_ffs(x)
+#define fls(x) (32 - __builtin_clz(x))
+#define ilog2(x) (31 - __builtin_clz(x))
+#define for_each_set_bit(bit, addr, size) \
+	for ((bit) = 0; (bit) < (size); (bit)++) if (!(*(addr) & (1UL << (bit)))) {} else
+u64 div_u64(u64, u32);
+s64 div_s64(s64, s32);
+u64 div64_u64(u64, u64);
+u64 mul_u64_u32_shr(u64, u32, unsigned int);
+s64 div64_s64(s64, s64);
+u64 div_u64_rem(u64, u32, u32 *);
+s64 div_s64_rem(s64, s32, s32 *);
+#define do_div(n, b) ((n) = (n) / (b), 0)
+u32 get_unaligned_le16(const void *);
+u32 get_unaligned_le32(const void *);
+u32 get_unaligned_le24(const void *);
+void put_unaligned_le16(u16, void *);
+void put_unaligned_le32(u32, void *);
+u16 le16_to_cpu(u16);
+int fixp_sin16(int);
+int fixp_cos16(int);
+
+/* lists */
+struct list_head { struct list_head *next, *prev; };
+#define LIST_HEAD(n) struct list_head n = { &(n), &(n) }
+void INIT_LIST_HEAD(struct list_head *);
+void list_add(struct list_head *, struct list_head *);
+void list_add_tail(struct list_head *, struct list_head *);
+void list_del(struct list_head *);
+void list_del_init(struct list_head *);
+void list_move(struct list_head *, struct list_head *);
+void list_move_tail(struct list_head *, struct list_head *);
+void list_splice_init(struct list_head *, struct list_head *);
+void list_splice_tail_init(struct list_head *, struct list_head *);
+int list_empty(const struct list_head *);
+#define list_entry(p, t, m) container_of(p, t, m)
+#define list_first_entry(p, t, m) container_of((p)->next, t, m)
+#define list_last_entry(p, t, m) container_of((p)->prev, t, m)
+#define list_first_entry_or_null(p, t, m) (list_empty(p) ? NULL : list_first_entry(p, t, m))
+#define list_for_each_entry(pos, head, m) for (pos = container_of((head)->next, typeof(*pos), m); &pos->m != (head); pos = container_of(pos->m.next, typeof(*pos), m))
+#define list_for_each_entry_safe(pos, n, head, m) for (pos = container_of((head)->next, typeof(*pos), m), n = container_of(pos->m.next, typeof(*pos), m); &pos->m != (head); pos = n, n = container_of(n->m.next, typeof(*n), m))
+#define list_for_each_entry_reverse(pos, head, m) for (pos = container_of((head)->prev, typeof(*pos), m); &pos->m != (head); pos = container_of(pos->m.prev, typeof(*pos), m))
+
+/* locking */
+typedef struct { int x; } spinlock_t;
+typedef struct { int x; } raw_spinlock_t;
+struct mutex { int x; };
+#define DEFINE_MUTEX(n) struct mutex n
+#define DEFINE_SPINLOCK(n) spinlock_t n
+void mutex_init(struct mutex *);
+void mutex_lock(struct mutex *);
+int mutex_lock_interruptible(struct mutex *);
+int mutex_trylock(struct mutex *);
+void mutex_unlock(struct mutex *);
+int mutex_is_locked(struct mutex *);
+void mutex_destroy(struct mutex *);
+void spin_lock_init(spinlock_t *);
+#define spin_lock_irqsave(l, f) ((void)(f), (void)(l))
+#define spin_unlock_irqrestore(l, f) ((void)(f), (void)(l))
+void spin_lock(spinlock_t *);
+void spin_unlock(spinlock_t *);
+void spin_lock_irq(spinlock_t *);
+void spin_unlock_irq(spinlock_t *);
+void spin_lock_bh(spinlock_t *);
+void spin_unlock_bh(spinlock_t *);
+typedef struct { unsigned seq; } seqcount_t;
+typedef struct { unsigned seq; } seqcount_spinlock_t;
+#define seqcount_init(s) ((s)->seq = 0)
+#define seqcount_spinlock_init(s, l) ((void)(l), (s)->seq = 0)
+#define read_seqcount_begin(s) ((s)->seq)
+#define read_seqcount_retry(s, v) ((s)->seq != (v))
+#define write_seqcount_begin(s) ((s)->seq++)
+#define write_seqcount_end(s) ((s)->seq++)
+#define raw_write_seqcount_begin(s) ((s)->seq++)
+#define raw_write_seqcount_end(s) ((s)->seq++)
+typedef struct { int counter; } atomic_t;
+typedef struct { long counter; } atomic_long_t;
+typedef struct { s64 counter; } atomic64_t;
+#define ATOMIC_INIT(i) { (i) }
+int atomic_read(const atomic_t *);
+void atomic_set(atomic_t *, int);
+void atomic_inc(atomic_t *);
+void atomic_dec(atomic_t *);
+int atomic_inc_return(atomic_t *);
+int atomic_dec_return(atomic_t *);
+int atomic_dec_and_test(atomic_t *);
+int atomic_xchg(atomic_t *, int);
+int atomic_cmpxchg(atomic_t *, int, int);
+int atomic_fetch_inc(atomic_t *);
+void atomic_add(int, atomic_t *);
+s64 atomic64_read(const atomic64_t *);
+void atomic64_set(atomic64_t *, s64);
+void atomic64_inc(atomic64_t *);
+void atomic64_add(s64, atomic64_t *);
+s64 atomic64_xchg(atomic64_t *, s64);
+long atomic_long_read(const atomic_long_t *);
+void atomic_long_inc(atomic_long_t *);
+int test_bit(long, const volatile unsigned long *);
+void set_bit(long, volatile unsigned long *);
+void clear_bit(long, volatile unsigned long *);
+int test_and_set_bit(long, volatile unsigned long *);
+int test_and_clear_bit(long, volatile unsigned long *);
+#define xchg(p, v) ({ typeof(*(p)) __o = *(p); *(p) = (v); __o; })
+#define cmpxchg(p, o, n) ({ typeof(*(p)) __o = *(p); if (__o == (o)) *(p) = (n); __o; })
+void smp_mb(void);
+void smp_wmb(void);
+void smp_rmb(void);
+#define smp_store_release(p, v) (*(p) = (v))
+#define smp_load_acquire(p) (*(p))
+#define smp_mb__after_atomic() do { } while (0)
+
+/* static keys */
+struct static_key_false { int x; };
+#define DEFINE_STATIC_KEY_FALSE(n) struct static_key_false n
+int static_branch_unlikely(struct static_key_false *);
+void static_branch_inc(struct static_key_false *);
+void static_branch_dec(struct static_key_false *);
+void static_branch_enable(struct static_key_false *);
+void static_branch_disable(struct static_key_false *);
+
+/* time */
+extern unsigned long volatile jiffies;
+unsigned int jiffies_to_msecs(unsigned long);
+unsigned long msecs_to_jiffies(unsigned int);
+unsigned long usecs_to_jiffies(unsigned int);
+unsigned int jiffies_to_usecs(unsigned long);
+unsigned long nsecs_to_jiffies(u64);
+int time_after(unsigned long, unsigned long);
+int time_before(unsigned long, unsigned long);
+int time_after_eq(unsigned long, unsigned long);
+int time_is_before_jiffies(unsigned long);
+ktime_t ktime_get(void);
+u64 ktime_get_ns(void);
+u64 ktime_get_real_ns(void);
+s64 ktime_to_ns(ktime_t);
+s64 ktime_to_us(ktime_t);
+s64 ktime_to_ms(ktime_t);
+ktime_t ns_to_ktime(u64);
+ktime_t ms_to_ktime(u64);
+ktime_t us_to_ktime(u64);
+ktime_t ktime_add_ns(ktime_t, u64);
+ktime_t ktime_add_us(ktime_t, u64);
+ktime_t ktime_add_ms(ktime_t, u64);
+ktime_t ktime_add(ktime_t, ktime_t);
+ktime_t ktime_sub(ktime_t, ktime_t);
+s64 ktime_us_delta(ktime_t, ktime_t);
+s64 ktime_ms_delta(ktime_t, ktime_t);
+int ktime_after(ktime_t, ktime_t);
+int ktime_before(ktime_t, ktime_t);
+int ktime_compare(ktime_t, ktime_t);
+#define KTIME_MAX ((s64)~((u64)1 << 63))
+void msleep(unsigned int);
+void usleep_range(unsigned long, unsigned long);
+
+/* waits / completions */
+typedef struct { int x; } wait_queue_head_t;
+void init_waitqueue_head(wait_queue_head_t *);
+void wake_up(wait_queue_head_t *);
+void wake_up_all(wait_queue_head_t *);
+void wake_up_interruptible(wait_queue_head_t *);
+#define wait_event_timeout(wq, cond, t) ({ (void)(wq); (cond) ? 1L : (long)(t); })
+#define wait_event_interruptible(wq, cond) ((cond) ? 0 : 0)
+#define wait_event_interruptible_timeout(wq, cond, t) ((cond) ? 1L : (long)(t))
+#define wait_event(wq, cond) do { (void)(cond); } while (0)
+struct completion { int done; };
+void init_completion(struct completion *);
+void reinit_completion(struct completion *);
+void complete(struct completion *);
+void complete_all(struct completion *);
+void wait_for_completion(struct completion *);
+unsigned long wait_for_completion_timeout(struct completion *, unsigned long);
+int completion_done(struct completion *);
+
+/* work */
+struct work_struct { int x; };
+struct delayed_work { struct work_struct work; };
+struct workqueue_struct;
+typedef void (*work_func_t)(struct work_struct *);
+#define INIT_WORK(w, f) ((void)(w), (void)(work_func_t)(f))
+#define INIT_DELAYED_WORK(w, f) ((void)(w), (void)(work_func_t)(f))
+struct workqueue_struct *alloc_workqueue(const char *, unsigned int, int, ...);
+struct workqueue_struct *alloc_ordered_workqueue(const char *, unsigned int, ...);
+void destroy_workqueue(struct workqueue_struct *);
+bool queue_work(struct workqueue_struct *, struct work_struct *);
+bool queue_delayed_work(struct workqueue_struct *, struct delayed_work *, unsigned long);
+bool mod_delayed_work(struct workqueue_struct *, struct delayed_work *, unsigned long);
+bool schedule_work(struct work_struct *);
+bool cancel_work_sync(struct work_struct *);
+bool cancel_delayed_work_sync(struct delayed_work *);
+bool flush_work(struct work_struct *);
+void flush_workqueue(struct workqueue_struct *);
+struct delayed_work *to_delayed_work(struct work_struct *);
+#define WQ_FREEZABLE 1
+#define WQ_MEM_RECLAIM 2
+#define WQ_HIGHPRI 4
+#define WQ_UNBOUND 8
+extern struct workqueue_struct *system_highpri_wq;
+extern struct workqueue_struct *system_wq;
+extern struct workqueue_struct *system_long_wq;
+
+/* hrtimer */
+enum hrtimer_restart { HRTIMER_NORESTART, HRTIMER_RESTART };
+enum hrtimer_mode { HRTIMER_MODE_ABS, HRTIMER_MODE_REL, HRTIMER_MODE_REL_SOFT, HRTIMER_MODE_ABS_SOFT };
+struct hrtimer { enum hrtimer_restart (*function)(struct hrtimer *); };
+#define CLOCK_MONOTONIC 1
+#define CLOCK_REALTIME 0
+void hrtimer_init(struct hrtimer *, int, enum hrtimer_mode);
+void hrtimer_setup(struct hrtimer *, enum hrtimer_restart (*)(struct hrtimer *), int, enum hrtimer_mode);
+void hrtimer_start(struct hrtimer *, ktime_t, enum hrtimer_mode);
+int hrtimer_cancel(struct hrtimer *);
+int hrtimer_try_to_cancel(struct hrtimer *);
+int hrtimer_active(const struct hrtimer *);
+int hrtimer_is_queued(struct hrtimer *);
+u64 hrtimer_forward_now(struct hrtimer *, ktime_t);
+ktime_t hrtimer_get_expires(const struct hrtimer *);
+void hrtimer_set_expires(struct hrtimer *, ktime_t);
+ktime_t hrtimer_cb_get_time(struct hrtimer *);
+
+/* ida */
+struct ida { int x; };
+#define DEFINE_IDA(n) struct ida n
+int ida_alloc(struct ida *, gfp_t);
+int ida_alloc_min(struct ida *, unsigned int, gfp_t);
+int ida_alloc_range(struct ida *, unsigned int, unsigned int, gfp_t);
+void ida_free(struct ida *, unsigned int);
+void ida_destroy(struct ida *);
+
+/* kfifo */
+#define DECLARE_KFIFO_PTR(fifo, type) struct { type *buf; unsigned in, out, mask; } fifo
+#define DECLARE_KFIFO(fifo, type, size) struct { type buf[size]; unsigned in, out, mask; } fifo
+#define INIT_KFIFO(fifo) ((void)(fifo))
+#define kfifo_alloc(fifo, size, gfp) ((void)(fifo), 0)
+#define kfifo_free(fifo) ((void)(fifo))
+#define kfifo_reset(fifo) ((void)(fifo))
+#define kfifo_len(fifo) ((fifo)->in - (fifo)->out)
+#define kfifo_avail(fifo) ((fifo)->mask + 1 - kfifo_len(fifo))
+#define kfifo_is_empty(fifo) ((fifo)->in == (fifo)->out)
+#define kfifo_is_full(fifo) (kfifo_len(fifo) > (fifo)->mask)
+#define kfifo_put(fifo, val) ({ (fifo)->buf[0] = (val); 1; })
+#define kfifo_get(fifo, val) (*(val) = (fifo)->buf[0], 1)
+#define kfifo_peek(fifo, val) (*(val) = (fifo)->buf[0], 1)
+#define kfifo_skip(fifo) ((fifo)->out++)
+#define kfifo_size(fifo) ((fifo)->mask + 1)
+
+/* device model */
+struct kobject { int x; };
+struct device_driver { const char *name; const struct attribute_group **groups; const struct attribute_group **dev_groups; };
+struct device { struct device *parent; struct kobject kobj; const char *init_name; struct device_driver *driver; };
+const char *dev_name(const struct device *);
+void *dev_get_drvdata(const struct device *);
+void *devm_kzalloc(struct device *, size_t, gfp_t);
+void *devm_kcalloc(struct device *, size_t, size_t, gfp_t);
+void devm_kfree(struct device *, const void *);
+char *devm_kasprintf(struct device *, gfp_t, const char *, ...);
+int devm_add_action_or_reset(struct device *, void (*)(void *), void *);
+int devm_add_action(struct device *, void (*)(void *), void *);
+void devm_remove_action(struct device *, void (*)(void *), void *);
+struct attribute { const char *name; umode_t mode; };
+struct device_attribute {
+	struct attribute attr;
+	ssize_t (*show)(struct device *, struct device_attribute *, char *);
+	ssize_t (*store)(struct device *, struct device_attribute *, const char *, size_t);
+};
+struct attribute_group { const char *name; struct attribute **attrs; umode_t (*is_visible)(struct kobject *, struct attribute *, int); };
+#define DEVICE_ATTR_RW(n) struct device_attribute dev_attr_##n = { { #n, 0644 }, n##_show, n##_store }
+#define DEVICE_ATTR_RO(n) struct device_attribute dev_attr_##n = { { #n, 0444 }, n##_show, NULL }
+#define DEVICE_ATTR_WO(n) struct device_attribute dev_attr_##n = { { #n, 0200 }, NULL, n##_store }
+#define DEVICE_ATTR(n, m, sh, st) struct device_attribute dev_attr_##n = { { #n, m }, sh, st }
+#define __ATTR(n, m, sh, st) { .attr = { #n, m }, .show = sh, .store = st }
+struct dev_ext_attribute { struct device_attribute attr; void *var; };
+#define ATTRIBUTE_GROUPS(n) static const struct attribute_group n##_group = { .attrs = n##_attrs }; static const struct attribute_group *n##_groups[] = { &n##_group, NULL }
+int devm_device_add_group(struct device *, const struct attribute_group *);
+int device_add_group(struct device *, const struct attribute_group *);
+void device_remove_group(struct device *, const struct attribute_group *);
+int sysfs_create_group(struct kobject *, const struct attribute_group *);
+void sysfs_remove_group(struct kobject *, const struct attribute_group *);
+void sysfs_notify(struct kobject *, const char *, const char *);
+struct kobject *kobj_to_dev_stub(struct kobject *);
+#define kobj_to_dev(k) container_of(k, struct device, kobj)
+#define dev_err(d, ...) printk(KERN_ERR __VA_ARGS__)
+#define dev_warn(d, ...) printk(KERN_WARNING __VA_ARGS__)
+#define dev_info(d, ...) printk(KERN_INFO __VA_ARGS__)
+#define dev_dbg(d, ...) printk(KERN_DEBUG __VA_ARGS__)
+#define pr_err(...) printk(KERN_ERR __VA_ARGS__)
+#define pr_warn(...) printk(KERN_WARNING __VA_ARGS__)
+#define pr_info(...) printk(KERN_INFO __VA_ARGS__)
+#define pr_debug(...) printk(KERN_DEBUG __VA_ARGS__)
+
+/* hid */
+struct hid_device { struct device dev; u16 bus; u32 vendor; u32 product; u32 version; char name[128]; char phys[64]; char uniq[64]; int id; };
+struct hid_report;
+struct hid_device_id { u16 bus; u32 vendor; u32 product; };
+struct hid_driver {
+	char *name; const struct hid_device_id *id_table;
+	int (*probe)(struct hid_device *, const struct hid_device_id *);
+	void (*remove)(struct hid_device *);
+	int (*raw_event)(struct hid_device *, struct hid_report *, u8 *, int);
+	int (*suspend)(struct hid_device *, int);
+	int (*resume)(struct hid_device *);
+	int (*reset_resume)(struct hid_device *);
+	struct device_driver driver;
+};
+#define HID_USB_DEVICE(v, p) .bus = 3, .vendor = (v), .product = (p)
+#define HID_BLUETOOTH_DEVICE(v, p) .bus = 5, .vendor = (v), .product = (p)
+#define BUS_USB 3
+#define BUS_BLUETOOTH 5
+#define HID_CONNECT_HIDRAW 1
+int hid_register_driver(struct hid_driver *);
+void hid_unregister_driver(struct hid_driver *);
+void *hid_get_drvdata(struct hid_device *);
+void hid_set_drvdata(struct hid_device *, void *);
+int hid_parse(struct hid_device *);
+int hid_hw_start(struct hid_device *, unsigned int);
+void hid_hw_stop(struct hid_device *);
+int hid_hw_open(struct hid_device *);
+void hid_hw_close(struct hid_device *);
+void hid_device_io_start(struct hid_device *);
+void hid_device_io_stop(struct hid_device *);
+int hid_hw_output_report(struct hid_device *, u8 *, size_t);
+u32 hid_field_extract(const struct hid_device *, u8 *, unsigned int, unsigned int);
+#define to_hid_device(d) container_of(d, struct hid_device, dev)
+#define hid_err(h, ...) ((void)(h), printk(KERN_ERR __VA_ARGS__))
+#define hid_warn(h, ...) ((void)(h), printk(KERN_WARNING __VA_ARGS__))
+#define hid_info(h, ...) ((void)(h), printk(KERN_INFO __VA_ARGS__))
+#define hid_dbg(h, ...) ((void)(h), printk(KERN_DEBUG __VA_ARGS__))
+#define hid_printk(l, h, ...) ((void)(h), printk(l __VA_ARGS__))
+#define hid_warn_ratelimited(h, ...) ((void)(h), printk(KERN_WARNING __VA_ARGS__))
+#define hid_err_ratelimited(h, ...) ((void)(h), printk(KERN_ERR __VA_ARGS__))
+#define hid_notice(h, ...) ((void)(h), printk(KERN_NOTICE __VA_ARGS__))
+
+/* input */
+struct ff_envelope { __u16 attack_length; __u16 attack_level; __u16 fade_length; __u16 fade_level; };
+struct ff_trigger { __u16 button; __u16 interval; };
+struct ff_replay { __u16 length; __u16 delay; };
+struct ff_constant_effect { __s16 level; struct ff_envelope envelope; };
+struct ff_ramp_effect { __s16 start_level; __s16 end_level; struct ff_envelope envelope; };
+struct ff_condition_effect { __u16 right_saturation; __u16 left_saturation; __s16 right_coeff; __s16 left_coeff; __u16 deadband; __s16 center; };
+struct ff_periodic_effect { __u16 waveform; __u16 period; __s16 magnitude; __s16 offset; __u16 phase; struct ff_envelope envelope; __u32 custom_len; __s16 *custom_data; };
+struct ff_rumble_effect { __u16 strong_magnitude; __u16 weak_magnitude; };
+struct ff_effect {
+	__u16 type; __s16 id; __u16 direction; struct ff_trigger trigger; struct ff_replay replay;
+	union { struct ff_constant_effect constant; struct ff_ramp_effect ramp; struct ff_periodic_effect periodic; struct ff_condition_effect condition[2]; struct ff_rumble_effect rumble; } u;
+};
+struct input_dev;
+struct ff_device {
+	int (*upload)(struct input_dev *, struct ff_effect *, struct ff_effect *);
+	int (*erase)(struct input_dev *, int);
+	int (*playback)(struct input_dev *, int, int);
+	void (*set_gain)(struct input_dev *, u16);
+	void (*set_autocenter)(struct input_dev *, u16);
+	void (*destroy)(struct ff_device *);
+	void *private;
+	unsigned long ffbit[2];
+	struct mutex mutex;
+	int max_effects;
+	struct ff_effect *effects;
+	struct file *effect_owners[];
+};
+struct input_id { u16 bustype, vendor, product, version; };
+struct input_absinfo { s32 value, minimum, maximum, fuzz, flat, resolution; };
+struct input_dev {
+	const char *name; const char *phys; const char *uniq; struct input_id id;
+	unsigned long evbit[1]; unsigned long keybit[12]; unsigned long absbit[1]; unsigned long mscbit[1]; unsigned long ffbit[2]; unsigned long propbit[1];
+	struct ff_device *ff; struct input_absinfo *absinfo; unsigned int users; struct mutex mutex; struct device dev;
+	int (*open)(struct input_dev *); void (*close)(struct input_dev *);
+	int (*event)(struct input_dev *, unsigned int, unsigned int, int);
+};
+struct input_dev *devm_input_allocate_device(struct device *);
+void input_set_drvdata(struct input_dev *, void *);
+void *input_get_drvdata(struct input_dev *);
+int input_register_device(struct input_dev *);
+void input_unregister_device(struct input_dev *);
+void input_event(struct input_dev *, unsigned int, unsigned int, int);
+void input_report_key(struct input_dev *, unsigned int, int);
+void input_report_abs(struct input_dev *, unsigned int, int);
+void input_sync(struct input_dev *);
+void input_set_abs_params(struct input_dev *, unsigned int, int, int, int, int);
+void input_abs_set_res(struct input_dev *, unsigned int, int);
+int input_abs_get_res(struct input_dev *, unsigned int);
+void input_set_capability(struct input_dev *, unsigned int, unsigned int);
+int input_ff_create_memless(struct input_dev *, void *, int (*)(struct input_dev *, void *, struct ff_effect *));
+int input_ff_create(struct input_dev *, unsigned int);
+void input_ff_destroy(struct input_dev *);
+bool input_device_enabled(struct input_dev *);
+void __set_bit(long, volatile unsigned long *);
+void __clear_bit(long, volatile unsigned long *);
+
+/* leds */
+enum led_brightness { LED_OFF = 0, LED_ON = 1, LED_FULL = 255 };
+struct led_classdev {
+	const char *name; unsigned int brightness; unsigned int max_brightness; unsigned long flags;
+	void (*brightness_set)(struct led_classdev *, enum led_brightness);
+	int (*brightness_set_blocking)(struct led_classdev *, enum led_brightness);
+	struct device *dev;
+};
+#define LED_CORE_SUSPENDRESUME BIT(19)
+#define LED_HW_PLUGGABLE BIT(20)
+int devm_led_classdev_register(struct device *, struct led_classdev *);
+void devm_led_classdev_unregister(struct device *, struct led_classdev *);
+
+/* power supply */
+enum power_supply_property { POWER_SUPPLY_PROP_PRESENT, POWER_SUPPLY_PROP_CAPACITY_LEVEL, POWER_SUPPLY_PROP_SCOPE, POWER_SUPPLY_PROP_STATUS };
+enum { POWER_SUPPLY_CAPACITY_LEVEL_UNKNOWN, POWER_SUPPLY_CAPACITY_LEVEL_CRITICAL, POWER_SUPPLY_CAPACITY_LEVEL_LOW, POWER_SUPPLY_CAPACITY_LEVEL_NORMAL, POWER_SUPPLY_CAPACITY_LEVEL_HIGH, POWER_SUPPLY_CAPACITY_LEVEL_FULL };
+enum { POWER_SUPPLY_STATUS_UNKNOWN, POWER_SUPPLY_STATUS_CHARGING, POWER_SUPPLY_STATUS_DISCHARGING, POWER_SUPPLY_STATUS_NOT_CHARGING, POWER_SUPPLY_STATUS_FULL };
+enum { POWER_SUPPLY_SCOPE_UNKNOWN, POWER_SUPPLY_SCOPE_SYSTEM, POWER_SUPPLY_SCOPE_DEVICE };
+enum { POWER_SUPPLY_TYPE_BATTERY = 1 };
+union power_supply_propval { int intval; const char *strval; };
+struct power_supply;
+struct power_supply_desc {
+	const char *name; int type; const enum power_supply_property *properties; size_t num_properties;
+	int (*get_property)(struct power_supply *, enum power_supply_property, union power_supply_propval *);
+	bool use_for_apm;
+};
+struct power_supply_config { void *drv_data; };
+struct power_supply *devm_power_supply_register(struct device *, const struct power_supply_desc *, const struct power_supply_config *);
+void *power_supply_get_drvdata(struct power_supply *);
+int power_supply_powers(struct power_supply *, struct device *);
+void power_supply_changed(struct power_supply *);
+
+/* fs / debugfs / misc */
+struct inode { void *i_private; };
+struct file { void *private_data; unsigned int f_flags; };
+struct poll_table_struct;
+typedef struct poll_table_struct poll_table;
+typedef unsigned int __poll_t;
+#define EPOLLIN 1
+#define EPOLLOUT 4
+#define EPOLLRDNORM 0x40
+#define EPOLLWRNORM 0x100
+#define EPOLLERR 8
+#define EPOLLHUP 0x10
+#define O_NONBLOCK 04000
+void poll_wait(struct file *, wait_queue_head_t *, poll_table *);
+struct file_operations {
+	struct module *owner;
+	ssize_t (*read)(struct file *, char __user *, size_t, loff_t *);
+	ssize_t (*write)(struct file *, const char __user *, size_t, loff_t *);
+	__poll_t (*poll)(struct file *, struct poll_table_struct *);
+	long (*unlocked_ioctl)(struct file *, unsigned int, unsigned long);
+	int (*open)(struct inode *, struct file *);
+	int (*release)(struct inode *, struct file *);
+	loff_t (*llseek)(struct file *, loff_t, int);
+};
+loff_t no_llseek(struct file *, loff_t, int);
+loff_t noop_llseek(struct file *, loff_t, int);
+loff_t default_llseek(struct file *, loff_t, int);
+int nonseekable_open(struct inode *, struct file *);
+int stream_open(struct inode *, struct file *);
+int simple_open(struct inode *, struct file *);
+unsigned long copy_from_user(void *, const void __user *, unsigned long);
+unsigned long copy_to_user(void __user *, const void *, unsigned long);
+ssize_t simple_read_from_buffer(void __user *, size_t, loff_t *, const void *, size_t);
+ssize_t simple_write_to_buffer(void *, size_t, loff_t *, const void __user *, size_t);
+void *memdup_user_nul(const void __user *, size_t);
+struct dentry;
+struct dentry *debugfs_create_dir(const char *, struct dentry *);
+struct dentry *debugfs_create_file(const char *, umode_t, struct dentry *, void *, const struct file_operations *);
+void debugfs_create_bool(const char *, umode_t, struct dentry *, bool *);
+void debugfs_create_u32(const char *, umode_t, struct dentry *, u32 *);
+void debugfs_create_u64(const char *, umode_t, struct dentry *, u64 *);
+void debugfs_remove_recursive(struct dentry *);
+void debugfs_remove(struct dentry *);
+struct seq_file { void *private; };
+int seq_printf(struct seq_file *, const char *, ...);
+void seq_puts(struct seq_file *, const char *);
+ssize_t seq_read(struct file *, char __user *, size_t, loff_t *);
+loff_t seq_lseek(struct file *, loff_t, int);
+int single_open(struct file *, int (*)(struct seq_file *, void *), void *);
+int single_release(struct inode *, struct file *);
+#define DEFINE_SHOW_ATTRIBUTE(n) static const struct file_operations n##_fops = { .read = seq_read }
+#define MISC_DYNAMIC_MINOR 255
+struct miscdevice { int minor; const char *name; const struct file_operations *fops; struct device *parent; umode_t mode; struct device *this_device; };
+int misc_register(struct miscdevice *);
+void misc_deregister(struct miscdevice *);
+#define _IOC(d, t, n, s) (((d) << 30) | ((t) << 8) | (n) | ((s) << 16))
+#define _IO(t, n) _IOC(0, t, n, 0)
+#define _IOR(t, n, s) _IOC(2, t, n, sizeof(s))
+#define _IOW(t, n, s) _IOC(1, t, n, sizeof(s))
+
+typedef unsigned long uintptr_t;
+/* iio */
+enum iio_chan_type { IIO_ACCEL, IIO_ANGL_VEL, IIO_TIMESTAMP };
+enum iio_modifier { IIO_NO_MOD, IIO_MOD_X, IIO_MOD_Y, IIO_MOD_Z };
+enum iio_chan_info_enum { IIO_CHAN_INFO_RAW, IIO_CHAN_INFO_SCALE, IIO_CHAN_INFO_OFFSET, IIO_CHAN_INFO_SAMP_FREQ };
+#define BIT_IIO(x) BIT(x)
+#define IIO_VAL_INT 1
+#define IIO_VAL_INT_PLUS_MICRO 2
+#define IIO_VAL_INT_PLUS_NANO 3
+#define IIO_VAL_FRACTIONAL 10
+#define INDIO_DIRECT_MODE 1
+#define INDIO_BUFFER_SOFTWARE 4
+#define IIO_LE 0
+#define IIO_CPU 1
+struct iio_scan_type { char sign; u8 realbits; u8 storagebits; u8 shift; int endianness; };
+struct iio_chan_spec {
+	enum iio_chan_type type; int channel; int channel2; unsigned long address; int scan_index;
+	struct iio_scan_type scan_type; long info_mask_separate; long info_mask_shared_by_type; long info_mask_shared_by_all; unsigned modified:1; unsigned indexed:1;
+};
+#define IIO_CHAN_SOFT_TIMESTAMP(i) { .type = IIO_TIMESTAMP, .channel = -1, .scan_index = (i), .scan_type = { .sign = 's', .realbits = 64, .storagebits = 64 } }
+struct iio_dev;
+struct iio_info { int (*read_raw)(struct iio_dev *, struct iio_chan_spec const *, int *, int *, long); };
+struct iio_buffer_setup_ops { int (*preenable)(struct iio_dev *); int (*postenable)(struct iio_dev *); int (*predisable)(struct iio_dev *); int (*postdisable)(struct iio_dev *); };
+struct iio_dev { int modes; const char *name; const struct iio_chan_spec *channels; int num_channels; const struct iio_info *info; const unsigned long *available_scan_masks; struct device dev; };
+struct iio_dev *devm_iio_device_alloc(struct device *, int);
+void *iio_priv(const struct iio_dev *);
+int devm_iio_device_register(struct device *, struct iio_dev *);
+int devm_iio_kfifo_buffer_setup(struct device *, struct iio_dev *, const struct iio_buffer_setup_ops *);
+int iio_push_to_buffers_with_timestamp(struct iio_dev *, void *, s64);
+s64 iio_get_time_ns(const struct iio_dev *);
+bool iio_buffer_enabled(struct iio_dev *);
+int iio_device_claim_direct_mode(struct iio_dev *);
+void iio_device_release_direct_mode(struct iio_dev *);
+
+/* kref */
+struct kref { int refcount; };
+void kref_init(struct kref *);
+void kref_get(struct kref *);
+int kref_put(struct kref *, void (*)(struct kref *));
+
+/* force feedback, from the uapi input.h */
+#define FF_STATUS_STOPPED	0x00
+#define FF_STATUS_PLAYING	0x01
+#define FF_STATUS_MAX		0x01
+#define FF_RUMBLE	0x50
+#define FF_PERIODIC	0x51
+#define FF_CONSTANT	0x52
+#define FF_SPRING	0x53
+#define FF_FRICTION	0x54
+#define FF_DAMPER	0x55
+#define FF_INERTIA	0x56
+#define FF_RAMP		0x57
+#define FF_EFFECT_MIN	FF_RUMBLE
+#define FF_EFFECT_MAX	FF_RAMP
+#define FF_SQUARE	0x58
+#define FF_TRIANGLE	0x59
+#define FF_SINE		0x5a
+#define FF_SAW_UP	0x5b
+#define FF_SAW_DOWN	0x5c
+#define FF_CUSTOM	0x5d
+#define FF_WAVEFORM_MIN	FF_SQUARE
+#define FF_WAVEFORM_MAX	FF_CUSTOM
+#define FF_GAIN		0x60
+#define FF_AUTOCENTER	0x61
+#define FF_MAX_EFFECTS	FF_GAIN
+#define FF_MAX		0x7f
+#define FF_CNT		(FF_MAX+1)
+
+#endif /* NX_TEST_KERNEL_H */